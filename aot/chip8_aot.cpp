@@ -0,0 +1,37 @@
+/* Ahead-of-time recompiler: chip8_aot PROGRAM [OUTPUT]
+ *
+ * Recompiles a CHIP-8 program into C++ source (written to OUTPUT, or standard output), for the programs that are run
+ * often enough to be worth building. See recompiler.h for what is recompiled, and the top of the output for how to
+ * build and run it.
+ */
+#include <stdio.h>
+
+#include "recompiler.h"
+#include "rom_image.h"
+
+int main(int argc, char* argv[]) {
+    if (argc < 2 || argc > 3){
+        printf("Usage: %s PROGRAM [OUTPUT]\n", argv[0]);
+        return 1;
+    }
+    std::shared_ptr<const RomImage> rom = RomImage::load(argv[1]);
+    if (!rom){
+        return 1;
+    }
+
+    FILE* out = stdout;
+    if (argc == 3){
+        out = fopen(argv[2], "w");
+        if (out == NULL){
+            printf("Error opening %s for writing\n", argv[2]);
+            return 1;
+        }
+    }
+    Recompiler::Summary summary = Recompiler::recompile(*rom, argv[1], out);
+    if (out != stdout && fclose(out) != 0){
+        printf("Error writing %s\n", argv[2]);
+        return 1;
+    }
+    fprintf(stderr, "%s: %d blocks, %d instructions recompiled\n", argv[1], summary.blocks, summary.instructions);
+    return 0;
+}
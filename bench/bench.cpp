@@ -0,0 +1,210 @@
+/* Benchmark suite: chip8_bench [--reps N] [--filter TEXT] [--programs DIR] [--instructions N]
+ *
+ * Runs microbenchmarks of instruction dispatch (on every core), sprite drawing and screen clearing, then full programs,
+ * all headless. Each benchmark is repeated and reported as one CSV line on stdout:
+ *
+ *   benchmark,metric,unit,reps,min,median,mean,stddev
+ *
+ * The microbenchmarks run synthetic programs that fill memory with one kind of instruction, so each measurement is
+ * that instruction's handler plus the dispatch around it (compare with the dispatch benchmarks to separate the two).
+ */
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdlib>
+#include <cstring>
+#include <filesystem>
+#include <functional>
+#include <stdio.h>
+#include <string>
+#include <vector>
+
+#include "emulator.h"
+#include "headless_frontend.h"
+
+// Instructions per frame for the microbenchmarks, large enough that the per-frame timer tick doesn't matter
+static const int instPerFrame = 1000;
+
+static int repetitions = 5;
+static const char* filter = NULL;
+
+/* Runs a measurement repetitions times and prints the statistics of its results as a CSV line.
+ * Skipped if a filter is set and isn't part of the benchmark name.
+ */
+static void report(const std::string &name, const char* metric, const char* unit, const std::function<double()> &measure) {
+    if (filter != NULL && name.find(filter) == std::string::npos){
+        return;
+    }
+    std::vector<double> results;
+    for (int r = 0; r < repetitions; ++r){
+        results.push_back(measure());
+    }
+    std::sort(results.begin(), results.end());
+
+    double mean = 0;
+    for (double result : results){
+        mean += result;
+    }
+    mean /= results.size();
+    double variance = 0;
+    for (double result : results){
+        variance += (result - mean) * (result - mean);
+    }
+    double stddev = results.size() > 1 ? std::sqrt(variance / (results.size() - 1)) : 0;
+    double median = results.size() % 2 ? results[results.size() / 2]
+                                       : (results[results.size() / 2 - 1] + results[results.size() / 2]) / 2;
+
+    printf("%s,%s,%s,%d,%.4f,%.4f,%.4f,%.4f\n", name.c_str(), metric, unit, (int) results.size(), results.front(),
+           median, mean, stddev);
+    fflush(stdout);
+}
+
+/* Builds a machine whose memory from 0x200 up is the given instructions repeated, ending in a jump back to 0x200.
+ * Registers are set from vRegs, and I points at the font (so sprites are drawn from real data).
+ */
+static MachineState syntheticProgram(const std::vector<uint16_t> &instructions, const std::vector<uint8_t> &vRegs) {
+    MachineState state;
+    HeadlessFrontend frontend;
+    Emulator(&frontend).saveState(state);   // Start from the power-on state, with the font loaded
+
+    uint16_t address = 0x200;
+    for (size_t i = 0; address < 0xFFC; ++i, address += 2){
+        uint16_t instruction = instructions[i % instructions.size()];
+        state.memory[address] = instruction >> 8;
+        state.memory[address + 1] = instruction & 0xFF;
+    }
+    state.memory[address] = 0x12;
+    state.memory[address + 1] = 0x00;
+
+    std::copy(vRegs.begin(), vRegs.end(), state.vRegs);
+    state.indexRegister = 0x50;
+    return state;
+}
+
+/* Runs the machine for the given number of instructions on the core, and returns the nanoseconds per instruction.
+ */
+static double nsPerInstruction(const MachineState &start, Core core, uint64_t instructions) {
+    HeadlessFrontend frontend;
+    Emulator emulator(&frontend);
+    emulator.loadState(start);
+    emulator.setCore(core);
+    emulator.setInstPerSecond(instPerFrame * 60);
+
+    auto begin = std::chrono::steady_clock::now();
+    for (uint64_t i = 0; i < instructions / instPerFrame; ++i){
+        emulator.runFrame();
+    }
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - begin).count();
+    return seconds * 1e9 / emulator.getInstExecuted();
+}
+
+int main(int argc, char* argv[]) {
+    const char* programDirectory = "chip8_programs";
+    uint64_t microInstructions = 2000000;
+    uint64_t programInstructions = 2000000;
+
+    for (int i = 1; i < argc; ++i){
+        if (strcmp(argv[i], "--reps") == 0 && i + 1 < argc){
+            repetitions = std::max(atoi(argv[++i]), 1);
+        } else if (strcmp(argv[i], "--filter") == 0 && i + 1 < argc){
+            filter = argv[++i];
+        } else if (strcmp(argv[i], "--programs") == 0 && i + 1 < argc){
+            programDirectory = argv[++i];
+        } else if (strcmp(argv[i], "--instructions") == 0 && i + 1 < argc){
+            microInstructions = programInstructions = strtoull(argv[++i], NULL, 10);
+        } else {
+            printf("Unknown option: %s\n", argv[i]);
+            return 1;
+        }
+    }
+
+    const char* coreNames[] = {"switch", "table", "threaded", "blocks", "jit"};
+    const Core cores[] = {Core::Switch, Core::Table, Core::Threaded, Core::Blocks, Core::Jit};
+    const int coreCount = sizeof(cores) / sizeof(cores[0]);
+
+    printf("benchmark,metric,unit,reps,min,median,mean,stddev\n");
+
+    // Dispatch: a mix of register instructions (set, add, add with carry, subtract, skip not taken, set I, add to I)
+    MachineState dispatch = syntheticProgram({0x6012, 0x7101, 0x8014, 0x8125, 0x32FF, 0xA300, 0xF01E, 0x8230}, {});
+    for (int c = 0; c < coreCount; ++c){
+        report(std::string("dispatch/") + coreNames[c], "time_per_instruction", "ns", [&](){
+            return nsPerInstruction(dispatch, cores[c], microInstructions);
+        });
+    }
+
+    // Sprite drawing (on the reference core): fully on screen at (8, 4), and clipped at the right and bottom edges
+    for (int height : {1, 5, 8, 15}){
+        uint16_t draw = 0xD010 | height;
+        MachineState onScreen = syntheticProgram({draw}, {8, 4});
+        MachineState clipped = syntheticProgram({draw}, {60, 28});
+        report("draw/h" + std::to_string(height) + "/noclip", "time_per_instruction", "ns", [&](){
+            return nsPerInstruction(onScreen, Core::Switch, microInstructions);
+        });
+        report("draw/h" + std::to_string(height) + "/clip", "time_per_instruction", "ns", [&](){
+            return nsPerInstruction(clipped, Core::Switch, microInstructions);
+        });
+    }
+
+    // Clearing the screen
+    MachineState clear = syntheticProgram({0x00E0}, {});
+    report("clear", "time_per_instruction", "ns", [&](){
+        return nsPerInstruction(clear, Core::Switch, microInstructions);
+    });
+
+    // Full programs at their normal rate (700 instructions per second), for a fixed number of instructions
+    std::vector<std::string> programs;
+    if (std::filesystem::is_directory(programDirectory)){
+        for (const auto &entry : std::filesystem::directory_iterator(programDirectory)){
+            if (entry.path().extension() == ".ch8"){
+                programs.push_back(entry.path().string());
+            }
+        }
+    }
+    std::sort(programs.begin(), programs.end());
+
+    // Every core, plus the block cache cores without superinstructions to show what those gain
+    struct ProgramCore { std::string name; Core core; bool fusion; };
+    std::vector<ProgramCore> programCores;
+    for (int c = 0; c < coreCount; ++c){
+        programCores.push_back({coreNames[c], cores[c], true});
+    }
+    programCores.push_back({"blocks_unfused", Core::Blocks, false});
+    programCores.push_back({"jit_unfused", Core::Jit, false});
+
+    for (const std::string &program : programs){
+        std::string name = std::filesystem::path(program).stem().string();
+        std::shared_ptr<const RomImage> rom = RomImage::load(program.c_str());
+        if (!rom){
+            continue;
+        }
+        for (const ProgramCore &programCore : programCores){
+            // Each run measures both, so the frame rates are taken from the runs timed for the first metric
+            auto run = [&](){
+                HeadlessFrontend frontend;
+                Emulator emulator(&frontend);
+                emulator.loadProgram(*rom);
+                emulator.setCore(programCore.core);
+                emulator.setFusion(programCore.fusion);
+                emulator.setSeed(0);
+
+                auto begin = std::chrono::steady_clock::now();
+                while (emulator.getInstExecuted() < programInstructions){
+                    emulator.runFrame();
+                }
+                double elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - begin).count();
+                return std::make_pair(elapsed * 1e9 / emulator.getInstExecuted(), emulator.getFrameCount() / elapsed);
+            };
+            std::string benchmark = "program/" + name + "/" + programCore.name;
+            std::vector<std::pair<double, double>> runs;
+            report(benchmark, "time_per_instruction", "ns", [&](){
+                runs.push_back(run());
+                return runs.back().first;
+            });
+            size_t next = 0;
+            report(benchmark, "frames_per_second", "fps", [&](){
+                return next < runs.size() ? runs[next++].second : run().second;
+            });
+        }
+    }
+    return 0;
+}
@@ -0,0 +1,758 @@
+/* Differential fuzzer: chip8_fuzz [options]
+ *
+ * Generates random machines (memory full of random instructions, and random registers, I, timers, stack, display and
+ * keys) and runs each on the reference core and on the candidate cores side by side, comparing their whole state after
+ * every chunk of instructions. The reference is the switch core with idle skipping off, so it is decode() and its
+ * handlers and nothing else. The candidates run with idle skipping on, so the switch candidate checks idle skipping.
+ *
+ * At the first difference the case is minimized: blocks of memory (halving in size down to single bytes) and then the
+ * registers, timers, stack, display and keys are put back to their power-on values, as long as the same core still
+ * diverges. The minimized case is printed with the exact instruction that diverged, and saved to a file that --replay
+ * runs again.
+ *
+ * The rewind candidate is the switch core keeping a rewind history. After every chunk it restores a frame up to four
+ * chunks back, checks that it matches the state saved at the time, and runs forward again from there.
+ *
+ *   --cases N          Cases to run (default 10000, 0 to run until something diverges)
+ *   --instructions N   Instructions per case (default 20000)
+ *   --seed N           Seed for generating cases (default: the time); case k of a seed is always the same machine
+ *   --cores LIST       Candidates, comma separated: switch, table, threaded, blocks, jit, rewind, simd (default all)
+ *   --quirks NAME      Quirk profile to run the cases with (default modern); simd only runs modern
+ *   --threads N        Worker threads (default: one per hardware thread)
+ *   --save FILE        Where to save the minimized case (default fuzz_case.txt)
+ *   --replay FILE      Run a saved case on the candidates instead of fuzzing
+ *
+ * The cores print a warning for every return with an empty stack, which random code does all the time, so standard
+ * output is discarded and the fuzzer reports on standard error.
+ */
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <memory>
+#include <mutex>
+#include <sstream>
+#include <stdio.h>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "emulator.h"
+#include "headless_frontend.h"
+#include "simd_engine.h"
+
+// Instructions between state comparisons
+static const int chunk = 256;
+
+// A machine to start the cores from, and the keys held while they run
+struct FuzzCase {
+    MachineState state;
+    uint16_t keypad = 0;
+};
+
+struct Candidate {
+    const char* name;
+    Core core;
+    bool simd;
+    bool rewind;        // Goes back through its rewind history after every chunk (see runRewinding)
+};
+static const Candidate candidates[] = {
+    {"switch", Core::Switch, false, false}, {"table", Core::Table, false, false},
+    {"threaded", Core::Threaded, false, false}, {"blocks", Core::Blocks, false, false}, {"jit", Core::Jit, false, false},
+    {"rewind", Core::Switch, false, true}, {"simd", Core::Switch, true, false}
+};
+
+// Where a candidate first differed from the reference (candidate is NULL if it never did)
+struct Divergence {
+    const Candidate* candidate = NULL;
+    uint64_t instructions = 0;      // Instructions run when the difference was found
+    std::string difference;
+};
+
+static QuirkProfile quirks = QuirkProfile::Modern;
+static HeadlessFrontend frontend;
+static MachineState powerOn;
+
+/* splitmix64, so that case k of a seed can be generated without generating the ones before it.
+ */
+struct CaseRandom {
+    uint64_t state;
+
+    CaseRandom(uint64_t seed, uint64_t number) : state(seed ^ (number * 0x9E3779B97F4A7C15ULL)) {
+    }
+    uint64_t next() {
+        uint64_t z = (state += 0x9E3779B97F4A7C15ULL);
+        z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+        z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+        return z ^ (z >> 31);
+    }
+    uint32_t below(uint32_t n) {
+        return (uint32_t) (next() % n);
+    }
+};
+
+/* Returns an instruction of a random form with random operands. Every form is equally likely, and now and then the
+ * word is arbitrary (undefined instructions, and data in the middle of code).
+ */
+static uint16_t randomInstruction(CaseRandom &random) {
+    // Fixed bits of each form, and the bits that are operands
+    static const uint16_t forms[][2] = {
+        {0x00E0, 0x0000}, {0x00EE, 0x0000}, {0x1000, 0x0FFF}, {0x2000, 0x0FFF}, {0x3000, 0x0FFF}, {0x4000, 0x0FFF},
+        {0x5000, 0x0FF0}, {0x6000, 0x0FFF}, {0x7000, 0x0FFF}, {0x8000, 0x0FF0}, {0x8001, 0x0FF0}, {0x8002, 0x0FF0},
+        {0x8003, 0x0FF0}, {0x8004, 0x0FF0}, {0x8005, 0x0FF0}, {0x8006, 0x0FF0}, {0x8007, 0x0FF0}, {0x800E, 0x0FF0},
+        {0x9000, 0x0FF0}, {0xA000, 0x0FFF}, {0xB000, 0x0FFF}, {0xC000, 0x0FFF}, {0xD000, 0x0FFF}, {0xE09E, 0x0F00},
+        {0xE0A1, 0x0F00}, {0xF007, 0x0F00}, {0xF00A, 0x0F00}, {0xF015, 0x0F00}, {0xF018, 0x0F00}, {0xF01E, 0x0F00},
+        {0xF029, 0x0F00}, {0xF033, 0x0F00}, {0xF055, 0x0F00}, {0xF065, 0x0F00}, {0x0000, 0xFFFF}
+    };
+    const uint16_t* form = forms[random.below(sizeof(forms) / sizeof(forms[0]))];
+    return form[0] | (random.next() & form[1]);
+}
+
+/* A byte that is often one of the values arithmetic goes wrong at.
+ */
+static uint8_t randomValue(CaseRandom &random) {
+    static const uint8_t edges[] = {0x00, 0x01, 0x7F, 0x80, 0xFE, 0xFF};
+    return random.below(4) == 0 ? edges[random.below(sizeof(edges))] : random.next() & 0xFF;
+}
+
+/* Writes one of the sequences the block cache fuses into a superinstruction at the address, with random operands:
+ * a counting loop or delay-timer poll (set, test, jump back or elsewhere), a run of 6XNN, or ANNN and DXYN. Random
+ * instructions rarely line up into these on their own.
+ */
+static void writeFusable(CaseRandom &random, MachineState &state, uint16_t address) {
+    uint8_t x = random.below(16);
+    uint16_t target = random.below(2) ? address : random.below(0x1000);
+    std::vector<uint16_t> sequence;
+    switch (random.below(4)){
+    case 0:
+        sequence = {(uint16_t) (0x7000 | x << 8 | (random.next() & 0xFF)),
+                    (uint16_t) ((random.below(2) ? 0x3000 : 0x4000) | x << 8 | randomValue(random)),
+                    (uint16_t) (0x1000 | target)};
+        break;
+    case 1:
+        sequence = {(uint16_t) (0xF007 | x << 8), (uint16_t) ((random.below(2) ? 0x3000 : 0x4000) | x << 8),
+                    (uint16_t) (0x1000 | target)};
+        break;
+    case 2:
+        for (uint32_t i = 0, length = 2 + random.below(5); i < length; ++i){
+            sequence.push_back(0x6000 | random.below(16) << 8 | randomValue(random));
+        }
+        break;
+    default:
+        sequence = {(uint16_t) (0xA000 | random.below(0x1000)), (uint16_t) (0xD000 | (random.next() & 0xFFF))};
+        break;
+    }
+    for (uint16_t instruction : sequence){
+        if (address > 0xFFE){
+            break;
+        }
+        state.memory[address] = instruction >> 8;
+        state.memory[address + 1] = instruction & 0xFF;
+        address += 2;
+    }
+}
+
+/* Generates case number of the seed: a program of random instructions from 0x200 to the end of memory (the font
+ * stays) with some fusable sequences mixed in, and random values for the rest of the state, favouring the edges (I at
+ * the end of memory or past it, a full or empty stack).
+ */
+static FuzzCase generateCase(uint64_t seed, uint64_t number) {
+    CaseRandom random(seed, number);
+    FuzzCase fuzzCase;
+    MachineState &state = fuzzCase.state;
+    state = powerOn;
+
+    for (int address = 0x200; address < 0x1000; address += 2){
+        uint16_t instruction = randomInstruction(random);
+        state.memory[address] = instruction >> 8;
+        state.memory[address + 1] = instruction & 0xFF;
+    }
+    for (uint32_t i = 0, count = random.below(64); i < count; ++i){
+        writeFusable(random, state, 0x200 + 2 * random.below(0x700));
+    }
+    for (int r = 0; r < 16; ++r){
+        state.vRegs[r] = randomValue(random);
+    }
+    switch (random.below(4)){
+    case 0:  state.indexRegister = 0xFF0 + random.below(16);            break;
+    case 1:  state.indexRegister = random.next() & 0xFFFF;              break;
+    default: state.indexRegister = random.below(0x1000);                break;
+    }
+    if (random.below(8) == 0){
+        state.programCounter = random.below(0x1000);
+    }
+    state.delayTimer = random.below(2) ? randomValue(random) : 0;
+    state.soundTimer = random.below(2) ? randomValue(random) : 0;
+    state.stackPointer = random.below(4) == 0 ? MachineState::stackSize : random.below(MachineState::stackSize + 1);
+    for (int i = 0; i < state.stackPointer; ++i){
+        state.addressStack[i] = random.below(0x1000);
+    }
+    for (int row = 0; row < 32; ++row){
+        state.framebuffer[row] = random.below(2) ? random.next() : 0;
+    }
+    state.awaitingKey = random.below(16) == 0;
+    state.rngState = seedRandom((uint32_t) random.next());
+    fuzzCase.keypad = random.below(2) ? random.next() & 0xFFFF : 0;
+    return fuzzCase;
+}
+
+/* Creates an emulator for the core, in the case's state.
+ */
+static std::unique_ptr<Emulator> startEmulator(const FuzzCase &fuzzCase, Core core, bool idleSkipping) {
+    std::unique_ptr<Emulator> emulator(new Emulator(&frontend));
+    emulator->setQuirks(quirks);
+    emulator->loadState(fuzzCase.state);
+    emulator->setKeypad(fuzzCase.keypad);
+    emulator->setCore(core);
+    emulator->setIdleSkipping(idleSkipping);
+    return emulator;
+}
+
+// Runs a frame of exactly count instructions (followed by the frame's timer tick)
+static void runInstructions(Emulator &emulator, int count) {
+    emulator.setInstPerSecond(count * 60);
+    emulator.runFrame();
+}
+static void runInstructions(SimdEngine &engine, int count) {
+    engine.setInstPerSecond(count * 60);
+    engine.runFrame();
+}
+
+// The states a rewinding candidate saved at the end of each of its frames (the first is the start), and the length of
+// each frame, for running forward again after restoring one
+struct RewindCheck {
+    std::vector<MachineState> saved;
+    std::vector<int> lengths;
+};
+
+/* Runs a frame of count instructions on a rewinding candidate, then restores a frame one to four frames back with
+ * Emulator::restoreFrame, and checks it against the state saved then. If it matches, the frames after it are run again
+ * (so the candidate ends up where it was, for comparing with the reference). Returns a description of any difference.
+ */
+static std::string runRewinding(Emulator &emulator, RewindCheck &check, int count) {
+    runInstructions(emulator, count);
+    check.saved.emplace_back();
+    emulator.saveState(check.saved.back());
+    check.lengths.push_back(count);
+
+    size_t back = std::min<size_t>(check.lengths.size() % 4 + 1, check.lengths.size());
+    if (!emulator.restoreFrame(back)){
+        return "frame " + std::to_string(back) + " back is missing from the rewind history";
+    }
+    Emulator expected(&frontend);
+    expected.loadState(check.saved[check.saved.size() - 1 - back]);
+    std::string difference = expected.compareState(emulator);
+    if (!difference.empty()){
+        return "restoring the frame " + std::to_string(back) + " back: " + difference;
+    }
+
+    std::vector<int> lengths(check.lengths.end() - back, check.lengths.end());
+    check.saved.resize(check.saved.size() - back);
+    check.lengths.resize(check.lengths.size() - back);
+    for (int length : lengths){
+        runInstructions(emulator, length);
+        check.saved.emplace_back();
+        emulator.saveState(check.saved.back());
+        check.lengths.push_back(length);
+    }
+    return "";
+}
+
+/* Runs the case on the reference and the candidates (which mustn't include simd) in lockstep for up to limit
+ * instructions, comparing after every chunk of them and at the end. Returns the first candidate to differ, if any.
+ */
+static Divergence runCase(const FuzzCase &fuzzCase, const std::vector<const Candidate*> &cores, uint64_t limit) {
+    std::unique_ptr<Emulator> reference = startEmulator(fuzzCase, Core::Switch, false);
+    std::vector<std::unique_ptr<Emulator>> emulators;
+    std::vector<RewindCheck> rewindChecks(cores.size());
+    for (size_t c = 0; c < cores.size(); ++c){
+        emulators.push_back(startEmulator(fuzzCase, cores[c]->core, true));
+        if (cores[c]->rewind){
+            emulators[c]->setRewindBudget(4 << 20);
+            rewindChecks[c].saved.emplace_back();
+            emulators[c]->saveState(rewindChecks[c].saved.back());
+        }
+    }
+
+    Divergence divergence;
+    for (uint64_t done = 0; done < limit;){
+        int count = (int) std::min<uint64_t>(chunk, limit - done);
+        done += count;
+        runInstructions(*reference, count);
+        for (size_t c = 0; c < cores.size(); ++c){
+            std::string difference;
+            if (cores[c]->rewind){
+                difference = runRewinding(*emulators[c], rewindChecks[c], count);
+            } else {
+                runInstructions(*emulators[c], count);
+            }
+            if (difference.empty()){
+                difference = reference->compareState(*emulators[c]);
+            }
+            if (!difference.empty()){
+                divergence.candidate = cores[c];
+                divergence.instructions = done;
+                divergence.difference = difference;
+                return divergence;
+            }
+        }
+    }
+    return divergence;
+}
+
+/* Runs up to 32 cases on the lanes of a SIMD engine (the rest of the lanes keep their power-on state), each beside a
+ * reference emulator, for up to limit instructions. Returns the first lane to differ (and sets lane to it), if any.
+ */
+static Divergence runSimd(const FuzzCase* cases, int count, uint64_t limit, int &lane) {
+    const Candidate* simd = &candidates[sizeof(candidates) / sizeof(candidates[0]) - 1];
+    std::unique_ptr<SimdEngine> engine(new SimdEngine());
+    std::vector<std::unique_ptr<Emulator>> references;
+    for (int l = 0; l < count; ++l){
+        engine->loadState(l, cases[l].state);
+        for (uint8_t key = 0; key < 16; ++key){
+            engine->setKey(l, key, (cases[l].keypad >> key) & 1);
+        }
+        references.push_back(startEmulator(cases[l], Core::Switch, false));
+    }
+
+    Emulator laneEmulator(&frontend);
+    MachineState laneState;
+    Divergence divergence;
+    for (uint64_t done = 0; done < limit;){
+        int instructions = (int) std::min<uint64_t>(chunk, limit - done);
+        done += instructions;
+        runInstructions(*engine, instructions);
+        for (int l = 0; l < count; ++l){
+            runInstructions(*references[l], instructions);
+            engine->saveState(l, laneState);
+            laneEmulator.loadState(laneState);
+            std::string difference = references[l]->compareState(laneEmulator);
+            if (!difference.empty()){
+                lane = l;
+                divergence.candidate = simd;
+                divergence.instructions = done;
+                divergence.difference = difference;
+                return divergence;
+            }
+        }
+    }
+    return divergence;
+}
+
+/* Runs one case on one candidate beside the reference, for up to limit instructions.
+ */
+static Divergence check(const FuzzCase &fuzzCase, const Candidate* candidate, uint64_t limit) {
+    if (candidate->simd){
+        int lane;
+        return runSimd(&fuzzCase, 1, limit, lane);
+    }
+    return runCase(fuzzCase, {candidate}, limit);
+}
+
+/* Puts as much of the case back to power-on as it can while the candidate still diverges, and updates the divergence
+ * to the one the smaller case has.
+ */
+static FuzzCase minimize(FuzzCase fuzzCase, Divergence &divergence) {
+    auto attempt = [&](const FuzzCase &trial){
+        Divergence result = check(trial, divergence.candidate, divergence.instructions);
+        if (result.candidate != NULL){
+            fuzzCase = trial;
+            divergence = result;
+        }
+    };
+
+    for (int size = 2048; size >= 1; size /= 2){
+        for (int start = 0; start < 0x1000; start += size){
+            if (memcmp(fuzzCase.state.memory + start, powerOn.memory + start, size) != 0){
+                FuzzCase trial = fuzzCase;
+                memcpy(trial.state.memory + start, powerOn.memory + start, size);
+                attempt(trial);
+            }
+        }
+    }
+
+    FuzzCase trial;
+    for (int r = 0; r < 16; ++r){
+        trial = fuzzCase;
+        trial.state.vRegs[r] = powerOn.vRegs[r];
+        attempt(trial);
+    }
+    trial = fuzzCase;
+    trial.state.indexRegister = powerOn.indexRegister;
+    attempt(trial);
+    trial = fuzzCase;
+    trial.state.delayTimer = powerOn.delayTimer;
+    attempt(trial);
+    trial = fuzzCase;
+    trial.state.soundTimer = powerOn.soundTimer;
+    attempt(trial);
+    trial = fuzzCase;
+    trial.state.stackPointer = powerOn.stackPointer;
+    std::copy(powerOn.addressStack, powerOn.addressStack + MachineState::stackSize, trial.state.addressStack);
+    attempt(trial);
+    trial = fuzzCase;
+    std::copy(powerOn.framebuffer, powerOn.framebuffer + 32, trial.state.framebuffer);
+    attempt(trial);
+    for (int row = 0; row < 32; ++row){
+        trial = fuzzCase;
+        trial.state.framebuffer[row] = powerOn.framebuffer[row];
+        attempt(trial);
+    }
+    trial = fuzzCase;
+    trial.state.awaitingKey = powerOn.awaitingKey;
+    trial.state.keyPressed = powerOn.keyPressed;
+    attempt(trial);
+    trial = fuzzCase;
+    trial.keypad = 0;
+    attempt(trial);
+    trial = fuzzCase;
+    trial.state.rngState = powerOn.rngState;
+    attempt(trial);
+    return fuzzCase;
+}
+
+/* Narrows a divergence found at the end of a chunk down to the exact instruction after which the states first differ.
+ */
+static void findFirstInstruction(const FuzzCase &fuzzCase, Divergence &divergence) {
+    uint64_t from = divergence.instructions - (divergence.instructions - 1) % chunk;
+    for (uint64_t n = from; n < divergence.instructions; ++n){
+        Divergence earlier = check(fuzzCase, divergence.candidate, n);
+        if (earlier.candidate != NULL){
+            divergence = earlier;
+            return;
+        }
+    }
+}
+
+/* Writes the case as text: the registers on a line each, then the display rows and runs of memory that differ from
+ * power-on (the font and zeroes). readCase reads it back.
+ */
+static bool saveCase(const char* path, const FuzzCase &fuzzCase, const Divergence &divergence) {
+    FILE* file = fopen(path, "w");
+    if (file == NULL){
+        fprintf(stderr, "Error opening %s for writing\n", path);
+        return false;
+    }
+    const MachineState &state = fuzzCase.state;
+    fprintf(file, "# %s after %lu instructions: %s\n", divergence.candidate->name,
+            (unsigned long) divergence.instructions, divergence.difference.c_str());
+    fprintf(file, "quirks %s\n", quirkProfileName(quirks));
+    fprintf(file, "pc %03X\nindex %04X\nv", state.programCounter, state.indexRegister);
+    for (int r = 0; r < 16; ++r){
+        fprintf(file, " %02X", state.vRegs[r]);
+    }
+    fprintf(file, "\ntimers %02X %02X\nstack %d", state.delayTimer, state.soundTimer, state.stackPointer);
+    for (int i = 0; i < state.stackPointer; ++i){
+        fprintf(file, " %03X", state.addressStack[i]);
+    }
+    fprintf(file, "\nkeys %04X\nwait %d %02X\nrng %08X\n", fuzzCase.keypad, state.awaitingKey, state.keyPressed,
+            state.rngState);
+    for (int row = 0; row < 32; ++row){
+        if (state.framebuffer[row] != powerOn.framebuffer[row]){
+            fprintf(file, "display %d %016lX\n", row, (unsigned long) state.framebuffer[row]);
+        }
+    }
+    for (int address = 0; address < 0x1000;){
+        if (state.memory[address] == powerOn.memory[address]){
+            ++address;
+            continue;
+        }
+        fprintf(file, "memory %03X", address);
+        for (int i = 0; address < 0x1000 && state.memory[address] != powerOn.memory[address] && i < 32; ++i){
+            fprintf(file, " %02X", state.memory[address++]);
+        }
+        fprintf(file, "\n");
+    }
+    return fclose(file) == 0;
+}
+
+static bool readCase(const char* path, FuzzCase &fuzzCase) {
+    std::ifstream file(path);
+    if (!file){
+        fprintf(stderr, "Error opening %s\n", path);
+        return false;
+    }
+
+    fuzzCase = FuzzCase();
+    MachineState &state = fuzzCase.state;
+    state = powerOn;
+    std::string line;
+    for (int lineNumber = 1; std::getline(file, line); ++lineNumber){
+        std::istringstream fields(line.substr(0, line.find('#')));
+        std::string item;
+        if (!(fields >> item)){
+            continue;
+        }
+
+        bool ok = true;
+        unsigned a, b;
+        fields >> std::hex;
+        if (item == "quirks"){
+            std::string name;
+            ok = (fields >> name) && parseQuirkProfile(name.c_str(), quirks);
+        } else if (item == "pc"){
+            ok = (bool) (fields >> a);
+            state.programCounter = a;
+        } else if (item == "index"){
+            ok = (bool) (fields >> a);
+            state.indexRegister = a;
+        } else if (item == "v"){
+            for (int r = 0; r < 16 && ok; ++r){
+                ok = (bool) (fields >> a);
+                state.vRegs[r] = a;
+            }
+        } else if (item == "timers"){
+            ok = (bool) (fields >> a >> b);
+            state.delayTimer = a;
+            state.soundTimer = b;
+        } else if (item == "stack"){
+            ok = (fields >> std::dec >> a >> std::hex) && a <= MachineState::stackSize;
+            state.stackPointer = ok ? a : 0;
+            for (int i = 0; i < state.stackPointer && ok; ++i){
+                ok = (bool) (fields >> b);
+                state.addressStack[i] = b;
+            }
+        } else if (item == "keys"){
+            ok = (bool) (fields >> a);
+            fuzzCase.keypad = a;
+        } else if (item == "wait"){
+            ok = (bool) (fields >> a >> b);
+            state.awaitingKey = a != 0;
+            state.keyPressed = b;
+        } else if (item == "rng"){
+            ok = (bool) (fields >> a);
+            state.rngState = a;
+        } else if (item == "display"){
+            unsigned long bits;
+            ok = (fields >> std::dec >> a >> std::hex >> bits) && a < 32;
+            state.framebuffer[ok ? a : 0] = ok ? bits : 0;
+        } else if (item == "memory"){
+            ok = (fields >> a) && a < 0x1000;
+            for (; ok && fields >> b; ++a){
+                ok = a < 0x1000;
+                state.memory[ok ? a : 0] = b;
+            }
+        } else {
+            ok = false;
+        }
+
+        if (!ok){
+            fprintf(stderr, "%s:%d: can't read \"%s\"\n", path, lineNumber, line.c_str());
+            return false;
+        }
+    }
+    return true;
+}
+
+/* Describes a divergence (narrowed down to the exact instruction): the difference, and the instruction that caused it.
+ */
+static void report(const FuzzCase &fuzzCase, const Divergence &divergence) {
+    std::unique_ptr<Emulator> reference = startEmulator(fuzzCase, Core::Switch, false);
+    for (uint64_t done = 0; done + 1 < divergence.instructions;){
+        int count = (int) std::min<uint64_t>(chunk, divergence.instructions - 1 - done);
+        runInstructions(*reference, count);
+        done += count;
+    }
+    MachineState before;
+    reference->saveState(before);
+    uint16_t pc = before.programCounter;
+    uint16_t opcode = (before.memory[pc & 0xFFF] << 8) | before.memory[(pc + 1) & 0xFFF];
+
+    fprintf(stderr, "%s differs from the reference after instruction %lu: %s\n", divergence.candidate->name,
+            (unsigned long) divergence.instructions, divergence.difference.c_str());
+    fprintf(stderr, "  instruction %lu is %04X (%s) at 0x%03X, with I = 0x%04X\n", (unsigned long) divergence.instructions,
+            opcode, Emulator::disassemble(opcode).c_str(), pc, before.indexRegister);
+}
+
+/* Runs a saved case on each candidate, and reports the ones that differ. Returns false if any does.
+ */
+static bool replayCase(const char* path, const std::vector<const Candidate*> &cores, uint64_t instructions) {
+    FuzzCase fuzzCase;
+    if (!readCase(path, fuzzCase)){
+        return false;
+    }
+    bool same = true;
+    for (const Candidate* candidate : cores){
+        Divergence divergence = check(fuzzCase, candidate, instructions);
+        if (divergence.candidate != NULL){
+            findFirstInstruction(fuzzCase, divergence);
+            report(fuzzCase, divergence);
+            same = false;
+        } else {
+            fprintf(stderr, "%s: %lu instructions identical to the reference\n", candidate->name,
+                    (unsigned long) instructions);
+        }
+    }
+    return same;
+}
+
+int main(int argc, char* argv[]) {
+    uint64_t cases = 10000;
+    uint64_t instructions = 20000;
+    uint64_t seed = (uint64_t) std::chrono::system_clock::now().time_since_epoch().count();
+    unsigned threads = std::max(std::thread::hardware_concurrency(), 1u);
+    const char* coreList = "switch,table,threaded,blocks,jit,rewind,simd";
+    const char* savePath = "fuzz_case.txt";
+    const char* replayPath = NULL;
+
+    for (int i = 1; i < argc; ++i){
+        if (strcmp(argv[i], "--cases") == 0 && i + 1 < argc){
+            cases = strtoull(argv[++i], NULL, 10);
+        } else if (strcmp(argv[i], "--instructions") == 0 && i + 1 < argc){
+            instructions = std::max<uint64_t>(strtoull(argv[++i], NULL, 10), 1);
+        } else if (strcmp(argv[i], "--seed") == 0 && i + 1 < argc){
+            seed = strtoull(argv[++i], NULL, 0);
+        } else if (strcmp(argv[i], "--cores") == 0 && i + 1 < argc){
+            coreList = argv[++i];
+        } else if (strcmp(argv[i], "--quirks") == 0 && i + 1 < argc){
+            if (!parseQuirkProfile(argv[++i], quirks)){
+                fprintf(stderr, "Unknown quirk profile: %s\n", argv[i]);
+                return 1;
+            }
+        } else if (strcmp(argv[i], "--threads") == 0 && i + 1 < argc){
+            threads = std::max(atoi(argv[++i]), 1);
+        } else if (strcmp(argv[i], "--save") == 0 && i + 1 < argc){
+            savePath = argv[++i];
+        } else if (strcmp(argv[i], "--replay") == 0 && i + 1 < argc){
+            replayPath = argv[++i];
+        } else {
+            fprintf(stderr, "Unknown option: %s\n", argv[i]);
+            return 1;
+        }
+    }
+
+    std::vector<const Candidate*> emulatorCores;
+    std::vector<const Candidate*> cores;
+    bool simd = false;
+    std::istringstream names(coreList);
+    std::string name;
+    while (std::getline(names, name, ',')){
+        const Candidate* found = NULL;
+        for (const Candidate &candidate : candidates){
+            found = name == candidate.name ? &candidate : found;
+        }
+        if (found == NULL){
+            fprintf(stderr, "Unknown core: %s\n", name.c_str());
+            return 1;
+        }
+        cores.push_back(found);
+        if (found->simd){
+            simd = true;
+        } else {
+            emulatorCores.push_back(found);
+        }
+    }
+
+    Emulator(&frontend).saveState(powerOn);
+    if (!freopen("/dev/null", "w", stdout)){
+        fprintf(stderr, "Can't discard standard output, the cores' warnings will be printed\n");
+    }
+
+    if (replayPath != NULL){
+        return replayCase(replayPath, cores, instructions) ? 0 : 1;
+    }
+    if (simd && quirks != QuirkProfile::Modern){
+        fprintf(stderr, "The SIMD engine only runs the modern quirk profile, leaving it out\n");
+        simd = false;
+    }
+
+    // Workers take groups of 32 cases (a SIMD engine's worth) until the cases run out or something diverges
+    fprintf(stderr, "Fuzzing with seed %lu, %lu instructions per case\n", (unsigned long) seed,
+            (unsigned long) instructions);
+    const uint64_t groupSize = SimdEngine::lanes;
+    std::atomic<uint64_t> nextGroup{0};
+    std::atomic<uint64_t> casesDone{0};
+    std::atomic<uint64_t> instructionsRun{0};
+    std::atomic<bool> stop{false};
+    std::mutex foundMutex;
+    FuzzCase failingCase;
+    uint64_t failingNumber = 0;
+    Divergence divergence;
+
+    auto worker = [&](){
+        std::vector<FuzzCase> group(groupSize);
+        while (!stop){
+            uint64_t first = nextGroup++ * groupSize;
+            if (cases != 0 && first >= cases){
+                break;
+            }
+            int count = (int) (cases == 0 ? groupSize : std::min(groupSize, cases - first));
+            for (int i = 0; i < count; ++i){
+                group[i] = generateCase(seed, first + i);
+            }
+
+            int failed = -1;
+            Divergence result;
+            for (int i = 0; i < count && failed < 0; ++i){
+                result = runCase(group[i], emulatorCores, instructions);
+                failed = result.candidate != NULL ? i : -1;
+            }
+            if (failed < 0 && simd){
+                result = runSimd(group.data(), count, instructions, failed);
+            }
+            if (result.candidate != NULL){
+                std::lock_guard<std::mutex> lock(foundMutex);
+                if (!stop.exchange(true)){
+                    failingCase = group[failed];
+                    failingNumber = first + failed;
+                    divergence = result;
+                }
+                break;
+            }
+            casesDone += count;
+            instructionsRun += count * instructions * (1 + emulatorCores.size() + (simd ? 2 : 0));
+        }
+    };
+
+    auto start = std::chrono::steady_clock::now();
+    std::vector<std::thread> pool;
+    for (unsigned t = 0; t < threads; ++t){
+        pool.emplace_back(worker);
+    }
+    std::thread progress([&](){
+        auto lastReport = std::chrono::steady_clock::now();
+        while (!stop && (cases == 0 || casesDone < cases)){
+            std::this_thread::sleep_for(std::chrono::milliseconds(100));
+            auto now = std::chrono::steady_clock::now();
+            if (now - lastReport >= std::chrono::seconds(10)){
+                double seconds = std::chrono::duration<double>(now - start).count();
+                fprintf(stderr, "  %lu cases, %.1f million instructions per second\n", (unsigned long) casesDone.load(),
+                        instructionsRun / seconds / 1e6);
+                lastReport = now;
+            }
+        }
+    });
+    for (std::thread &thread : pool){
+        thread.join();
+    }
+    stop = true;
+    progress.join();
+
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    fprintf(stderr, "%lu cases, %lu instructions on all cores in %.1f s (%.1f million per second)\n",
+            (unsigned long) casesDone.load(), (unsigned long) instructionsRun.load(), seconds,
+            instructionsRun / seconds / 1e6);
+    if (divergence.candidate == NULL){
+        fprintf(stderr, "No divergence\n");
+        return 0;
+    }
+
+    fprintf(stderr, "\nCase %lu of seed %lu: %s differs after %lu instructions (%s). Minimizing...\n",
+            (unsigned long) failingNumber, (unsigned long) seed, divergence.candidate->name,
+            (unsigned long) divergence.instructions, divergence.difference.c_str());
+    if (check(failingCase, divergence.candidate, divergence.instructions).candidate == NULL){
+        // Only happens on simd, when the case needed the other lanes' cases beside it
+        fprintf(stderr, "It doesn't diverge on its own, so it is saved as it was\n");
+    } else {
+        failingCase = minimize(failingCase, divergence);
+    }
+    findFirstInstruction(failingCase, divergence);
+    report(failingCase, divergence);
+    if (saveCase(savePath, failingCase, divergence)){
+        fprintf(stderr, "Saved the case to %s (run it again with --replay %s --cores %s)\n", savePath, savePath,
+                divergence.candidate->name);
+    }
+    return 1;
+}
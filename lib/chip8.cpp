@@ -0,0 +1,163 @@
+#include "chip8.h"
+
+#include <algorithm>
+#include <memory>
+#include <new>
+#include <stdio.h>
+#include <thread>
+#include <vector>
+
+#include "emulator.h"
+#include "headless_frontend.h"
+#include "quirks.h"
+#include "rom_image.h"
+
+static const Core cores[] = {Core::Switch, Core::Table, Core::Threaded, Core::Blocks, Core::Jit};
+
+/* An emulator and what it needs to start over: the program image it shares with its clones, and the state it was
+ * loaded in.
+ */
+struct chip8_env {
+    std::shared_ptr<const RomImage> rom;
+    QuirkProfile quirks;
+    HeadlessFrontend frontend;
+    Emulator emulator;
+    MachineState start;
+    int core = CHIP8_CORE_THREADED;
+    int instPerSecond = 700;
+    uint64_t frames = 0;
+
+    chip8_env(std::shared_ptr<const RomImage> rom, QuirkProfile quirks)
+        : rom(rom), quirks(quirks), emulator(&frontend) {
+        emulator.loadProgram(*rom, quirks);
+        emulator.saveState(start);
+        emulator.setCore(cores[core]);
+    }
+};
+
+/* Exceptions mustn't cross into C callers, so running out of memory (the only thing that throws here) returns NULL.
+ * Loading a RomImage can't fail: RomImage::load has already checked that the program fits.
+ */
+chip8_env* chip8_create(const char* path, const char* quirks) {
+    QuirkProfile profile = QuirkProfile::Modern;
+    if (quirks != NULL && !parseQuirkProfile(quirks, profile)){
+        printf("Unknown quirk profile: %s\n", quirks);
+        return NULL;
+    }
+    try {
+        std::shared_ptr<const RomImage> rom = RomImage::load(path);
+        if (!rom){
+            return NULL;
+        }
+        return new chip8_env(rom, profile);
+    } catch (const std::bad_alloc &){
+        printf("Out of memory creating an environment for %s\n", path);
+        return NULL;
+    }
+}
+
+chip8_env* chip8_clone(const chip8_env* env) {
+    std::unique_ptr<chip8_env> clone;
+    try {
+        clone.reset(new chip8_env(env->rom, env->quirks));
+    } catch (const std::bad_alloc &){
+        printf("Out of memory cloning an environment\n");
+        return NULL;
+    }
+    chip8_set_core(clone.get(), env->core);
+    chip8_set_speed(clone.get(), env->instPerSecond);
+    MachineState state;
+    env->emulator.saveState(state);
+    clone->emulator.loadState(state);
+    clone->emulator.setKeypad(env->emulator.getKeypad());
+    clone->frames = env->frames;
+    return clone.release();
+}
+
+void chip8_destroy(chip8_env* env) {
+    delete env;
+}
+
+void chip8_set_core(chip8_env* env, int core) {
+    if (core >= 0 && core < (int) (sizeof(cores) / sizeof(cores[0]))){
+        env->core = core;
+        env->emulator.setCore(cores[core]);
+    }
+}
+
+void chip8_set_speed(chip8_env* env, int instPerSecond) {
+    env->instPerSecond = instPerSecond;
+    env->emulator.setInstPerSecond(instPerSecond);
+}
+
+/* Loading the start state only drops the cached blocks whose memory the episode changed, so resetting is cheap enough
+ * to do every episode.
+ */
+void chip8_reset(chip8_env* env, uint32_t seed) {
+    env->emulator.setKeypad(0);
+    env->emulator.loadState(env->start);
+    env->emulator.setSeed(seed);
+    env->frames = 0;
+}
+
+void chip8_step(chip8_env* env, uint16_t keypad, int frames) {
+    env->emulator.setKeypad(keypad);
+    for (int f = 0; f < frames; ++f){
+        env->emulator.runFrame();
+    }
+    env->frames += frames;
+}
+
+static void stepRange(chip8_env* const* envs, const uint16_t* keypads, size_t begin, size_t end, int frames) {
+    for (size_t i = begin; i < end; ++i){
+        chip8_step(envs[i], keypads[i], frames);
+    }
+}
+
+/* Splits the environments into contiguous shares, one per hardware thread, and steps the first share on the calling
+ * thread while new threads step the rest. Starting a thread costs tens of microseconds, so each thread must have at
+ * least minThreadWork instructions to run, and small batches run on the calling thread alone. If a thread can't be
+ * started, the calling thread steps its share too.
+ */
+static const uint64_t minThreadWork = 1 << 18;
+
+void chip8_step_many(chip8_env* const* envs, const uint16_t* keypads, size_t count, int frames) {
+    uint64_t work = 0;
+    for (size_t i = 0; i < count; ++i){
+        work += (uint64_t) envs[i]->instPerSecond * std::max(frames, 0) / 60;
+    }
+    size_t threads = std::max(std::thread::hardware_concurrency(), 1u);
+    threads = std::min<size_t>({threads, std::max<uint64_t>(work / minThreadWork, 1), std::max<size_t>(count, 1)});
+
+    std::vector<std::thread> pool;
+    size_t started = 1;
+    try {
+        for (; started < threads; ++started){
+            pool.emplace_back(stepRange, envs, keypads, count * started / threads, count * (started + 1) / threads,
+                              frames);
+        }
+    } catch (const std::exception &){
+        // Fewer threads than planned: the rest of the shares run here
+    }
+    stepRange(envs, keypads, 0, count / threads, frames);
+    stepRange(envs, keypads, count * started / threads, count, frames);
+    for (std::thread &thread : pool){
+        thread.join();
+    }
+}
+
+const uint64_t* chip8_framebuffer(const chip8_env* env) {
+    return env->emulator.getFramebuffer();
+}
+
+const uint8_t* chip8_memory(const chip8_env* env) {
+    return env->emulator.getMemory();
+}
+
+const uint8_t* chip8_registers(const chip8_env* env) {
+    return env->emulator.getRegisters();
+}
+
+uint64_t chip8_frame_count(const chip8_env* env) {
+    return env->frames;
+}
@@ -0,0 +1,72 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* libchip8: a C interface for driving emulators from other programs, such as reinforcement learning code.
+ *
+ * Each environment is one headless emulator running one program. Stepping it takes a keypad mask and a number of
+ * frames; the display, memory and registers are read in place, through pointers that stay valid for the environment's
+ * lifetime and always show its current state, so nothing is copied. Nothing here uses SDL.
+ *
+ * An environment must only be used by one thread at a time, but separate environments can be stepped on separate
+ * threads at once. chip8_step_many does this itself for large enough batches.
+ *
+ * Build with make lib, which makes libchip8.a and libchip8.so.
+ */
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct chip8_env chip8_env;
+
+// Dispatch cores (see the README); all of them give the same results
+enum chip8_core {
+    CHIP8_CORE_SWITCH,
+    CHIP8_CORE_TABLE,
+    CHIP8_CORE_THREADED,
+    CHIP8_CORE_BLOCKS,
+    CHIP8_CORE_JIT
+};
+
+// Creates an environment running the program file, with the quirks of a variant (modern, vip, chip48 or schip; NULL
+// for modern). Returns NULL (after describing the problem on stdout) if the program can't be loaded, the variant isn't
+// known or there isn't enough memory.
+chip8_env* chip8_create(const char* path, const char* quirks);
+
+// Creates another environment running the same program (without reading it again), with the same settings and a copy
+// of the current state. Returns NULL if there isn't enough memory.
+chip8_env* chip8_clone(const chip8_env* env);
+
+void chip8_destroy(chip8_env* env);
+
+// Settings: the dispatch core (CHIP8_CORE_THREADED by default) and instructions per emulated second (700 by default)
+void chip8_set_core(chip8_env* env, int core);
+void chip8_set_speed(chip8_env* env, int instPerSecond);
+
+// Returns to the state the program was loaded in (with no keys held), and seeds CXNN's random numbers
+void chip8_reset(chip8_env* env, uint32_t seed);
+
+// Holds the keys in the mask (bit k for key k) and runs that many 60 Hz frames
+void chip8_step(chip8_env* env, uint16_t keypad, int frames);
+
+// Steps a batch of environments in one call: envs[i] with keypads[i], each for the same number of frames. Batches with
+// enough work (about 2^18 instructions per thread: at 700 instructions per second, some 22500 frames over the batch)
+// are spread over up to one thread per hardware thread; smaller ones run one environment after another on the calling
+// thread. An environment must appear in the batch only once.
+void chip8_step_many(chip8_env* const* envs, const uint16_t* keypads, size_t count, int frames);
+
+// The display: 32 rows of 64 pixels, one word per row with the most significant bit as the leftmost pixel
+const uint64_t* chip8_framebuffer(const chip8_env* env);
+
+// The 4096 bytes of memory (for reading scores, lives and the like), and the sixteen V registers
+const uint8_t* chip8_memory(const chip8_env* env);
+const uint8_t* chip8_registers(const chip8_env* env);
+
+// Frames stepped since the environment was created or last reset
+uint64_t chip8_frame_count(const chip8_env* env);
+
+#ifdef __cplusplus
+}
+#endif
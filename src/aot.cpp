@@ -0,0 +1,70 @@
+#include <stdio.h>
+
+#ifndef _WIN32
+#include <dlfcn.h>
+#endif
+
+#include "aot.h"
+
+AotModule::~AotModule() {
+#ifndef _WIN32
+    if (handle != NULL){
+        dlclose(handle);
+    }
+#endif
+}
+
+/* Opens the shared object and looks up what it exports.
+ */
+AotModule* AotModule::load(const char* path) {
+#ifdef _WIN32
+    printf("Error loading recompiled program %s: not supported on this host\n", path);
+    return NULL;
+#else
+    void* handle = dlopen(path, RTLD_NOW | RTLD_LOCAL);
+    if (handle == NULL){
+        printf("Error loading recompiled program %s: %s\n", path, dlerror());
+        return NULL;
+    }
+
+    const int* version = (const int*) dlsym(handle, "chip8AotVersion");
+    const uint32_t* romSize = (const uint32_t*) dlsym(handle, "chip8AotRomSize");
+    const uint8_t* rom = (const uint8_t*) dlsym(handle, "chip8AotRom");
+    AotRun run = (AotRun) dlsym(handle, "chip8AotRun");
+    if (version == NULL || romSize == NULL || rom == NULL || run == NULL){
+        printf("Error loading recompiled program %s: it isn't one (missing symbols)\n", path);
+        dlclose(handle);
+        return NULL;
+    }
+    if (*version != aotVersion || *romSize > 0x1000 - 0x200){
+        printf("Error loading recompiled program %s: it was generated for version %d (this is %d), recompile it\n", path,
+               *version, aotVersion);
+        dlclose(handle);
+        return NULL;
+    }
+
+    AotModule* module = new AotModule();
+    module->handle = handle;
+    module->runFunction = run;
+    module->rom = rom;
+    module->romSize = *romSize;
+    return module;
+#endif
+}
+
+/* Compares memory with the recompiled program a page at a time. Pages outside the program hold no recompiled code, so
+ * they never need to match.
+ */
+uint64_t AotModule::validPages(const uint8_t memory[4096]) const {
+    uint64_t valid = ~0ULL;
+    for (uint32_t offset = 0; offset < romSize; ++offset){
+        if (memory[0x200 + offset] != rom[offset]){
+            valid &= ~(1ULL << ((0x200 + offset) >> 6));
+        }
+    }
+    return valid;
+}
+
+int AotModule::run(AotContext* context, int budget) const {
+    return runFunction(context, budget);
+}
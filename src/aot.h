@@ -0,0 +1,55 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+#include "machine_state.h"
+
+/* Interface between the emulator and programs recompiled ahead of time by chip8_aot (see recompiler.h).
+ *
+ * A recompiled program is C++ source that is built into a shared object and loaded with AotModule. It exports:
+ *   extern "C" const int chip8AotVersion;          // aotVersion when it was generated
+ *   extern "C" const uint32_t chip8AotRomSize;     // The program it was recompiled from (loaded at 0x200)...
+ *   extern "C" const uint8_t chip8AotRom[];        // ...so code that no longer matches memory isn't run
+ *   extern "C" int chip8AotRun(AotContext* context, int budget);
+ */
+static const int aotVersion = 1;
+
+struct AotContext {
+    MachineState* state;
+    uint64_t validPages;    // 64-byte pages of memory that still hold the recompiled program (bit n for page n)
+    uint16_t keypad;        // Keys held, bit k for key k
+    uint16_t fontStart;     // Address of the font sprites (for FX29)
+};
+
+// Runs recompiled code from the program counter for at most budget instructions, and returns how many it ran. It stops
+// (leaving the program counter at the next instruction) at anything that wasn't recompiled, at a block the rest of the
+// budget can't cover, or at code in a page that isn't valid any more.
+typedef int (*AotRun)(AotContext* context, int budget);
+
+/* A recompiled program loaded from a shared object.
+ */
+class AotModule {
+    private:
+        void* handle = NULL;
+        AotRun runFunction = NULL;
+        const uint8_t* rom = NULL;
+        uint32_t romSize = 0;
+
+        AotModule() {}
+
+    public:
+        ~AotModule();
+        AotModule(const AotModule &) = delete;
+        AotModule &operator=(const AotModule &) = delete;
+
+        // Loads a module. Returns NULL (after describing the problem) if it can't be loaded or was generated for a
+        // different version of the interface.
+        static AotModule* load(const char* path);
+
+        // Returns the pages of memory (bit n for the 64 bytes from n*64) whose contents match the program the code was
+        // recompiled from, so the code in them can run
+        uint64_t validPages(const uint8_t memory[4096]) const;
+
+        int run(AotContext* context, int budget) const;
+};
@@ -0,0 +1,201 @@
+#include "batch.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <fstream>
+#include <mutex>
+#include <sstream>
+#include <thread>
+#include <unordered_map>
+
+#include "headless_frontend.h"
+#include "rom_image.h"
+
+/* Parses a "name=value" field of a batch list line into value. Returns false if the field has a different name.
+ */
+static bool parseField(const std::string &field, const char* name, uint64_t &value) {
+    size_t length = strlen(name);
+    if (field.compare(0, length, name) != 0 || field.size() <= length || field[length] != '='){
+        return false;
+    }
+    value = strtoull(field.c_str() + length + 1, NULL, 0);
+    return true;
+}
+
+bool readBatchList(const char* path, uint64_t defaultFrames, QuirkProfile defaultQuirks, std::vector<BatchJob> &jobs) {
+    std::ifstream list(path);
+    if (!list){
+        printf("Error opening batch list %s\n", path);
+        return false;
+    }
+
+    std::string line;
+    for (int lineNumber = 1; std::getline(list, line); ++lineNumber){
+        size_t comment = line.find('#');
+        if (comment != std::string::npos){
+            line.erase(comment);
+        }
+        std::istringstream fields(line);
+        BatchJob job;
+        job.quirks = defaultQuirks;
+        if (!(fields >> job.program)){
+            continue;
+        }
+
+        std::string field;
+        uint64_t value;
+        while (fields >> field){
+            if (parseField(field, "seed", value)){
+                job.seed = (uint32_t) value;
+            } else if (parseField(field, "frames", value)){
+                job.frames = value;
+            } else if (parseField(field, "instructions", value)){
+                job.instructions = value;
+            } else if (field.compare(0, 7, "quirks=") == 0){
+                if (!parseQuirkProfile(field.c_str() + 7, job.quirks)){
+                    printf("%s:%d: unknown quirk profile %s\n", path, lineNumber, field.c_str() + 7);
+                    return false;
+                }
+            } else {
+                printf("%s:%d: unknown field %s\n", path, lineNumber, field.c_str());
+                return false;
+            }
+        }
+        if (job.frames == 0 && job.instructions == 0){
+            job.frames = defaultFrames;
+        }
+        jobs.push_back(job);
+    }
+    return true;
+}
+
+/* Runs a single job on a fresh emulator, started from the job's program image (NULL if it couldn't be loaded).
+ * Everything the run touches belongs to the emulator (or this stack frame), so any number of these can run at once.
+ */
+static BatchResult runJob(const BatchJob &job, const RomImage* rom, Core core, int instPerSecond) {
+    BatchResult result;
+    if (rom == NULL){
+        return result;
+    }
+    HeadlessFrontend frontend;
+    Emulator emulator(&frontend);
+    emulator.loadProgram(*rom, job.quirks);
+    emulator.setCore(core);
+    emulator.setInstPerSecond(instPerSecond);
+    emulator.setSeed(job.seed);
+    result.loaded = true;
+
+    auto start = std::chrono::steady_clock::now();
+    if (job.instructions > 0){
+        while (emulator.getInstExecuted() < job.instructions){
+            emulator.runFrame();
+        }
+    } else {
+        for (uint64_t f = 0; f < job.frames; ++f){
+            emulator.runFrame();
+        }
+    }
+    result.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+    result.frames = emulator.getFrameCount();
+    result.instructions = emulator.getInstExecuted();
+    result.framebufferHash = emulator.framebufferHash();
+    result.programCounter = emulator.getProgramCounter();
+    result.indexRegister = emulator.getIndexRegister();
+    memcpy(result.vRegs, emulator.getRegisters(), sizeof(result.vRegs));
+    return result;
+}
+
+// A worker's queue of job indices. The owner takes from the front, idle workers steal from the back.
+struct WorkQueue {
+    std::mutex lock;
+    std::deque<size_t> jobs;
+};
+
+/* Takes the next job for a worker: its own oldest job, or else the newest job of the first other worker with work left.
+ * Returns false when every queue is empty. No jobs are added once the pool starts, so that means the batch is done.
+ */
+static bool takeJob(std::vector<WorkQueue> &queues, size_t worker, size_t &job) {
+    {
+        std::lock_guard<std::mutex> guard(queues[worker].lock);
+        if (!queues[worker].jobs.empty()){
+            job = queues[worker].jobs.front();
+            queues[worker].jobs.pop_front();
+            return true;
+        }
+    }
+    for (size_t i = 1; i < queues.size(); ++i){
+        WorkQueue &victim = queues[(worker + i) % queues.size()];
+        std::lock_guard<std::mutex> guard(victim.lock);
+        if (!victim.jobs.empty()){
+            job = victim.jobs.back();
+            victim.jobs.pop_back();
+            return true;
+        }
+    }
+    return false;
+}
+
+/* Runs the jobs on a pool of threads.
+ * The jobs are dealt out to the workers in contiguous runs, so each worker mostly works through its own queue. Run
+ * lengths vary a lot between programs and budgets, so a worker that runs out steals from the others instead of idling.
+ */
+std::vector<BatchResult> runBatch(const std::vector<BatchJob> &jobs, Core core, int instPerSecond, unsigned threads) {
+    if (threads == 0){
+        threads = std::max(std::thread::hardware_concurrency(), 1u);
+    }
+    threads = (unsigned) std::min<size_t>(threads, std::max<size_t>(jobs.size(), 1));
+
+    // Each program is loaded once, however many runs it has, and its image is shared read-only by all of them
+    std::unordered_map<std::string, std::shared_ptr<const RomImage>> roms;
+    std::vector<const RomImage*> jobRoms(jobs.size());
+    for (size_t i = 0; i < jobs.size(); ++i){
+        auto found = roms.find(jobs[i].program);
+        if (found == roms.end()){
+            found = roms.emplace(jobs[i].program, RomImage::load(jobs[i].program.c_str())).first;
+        }
+        jobRoms[i] = found->second.get();
+    }
+
+    std::vector<BatchResult> results(jobs.size());
+    std::vector<WorkQueue> queues(threads);
+    for (size_t i = 0; i < jobs.size(); ++i){
+        queues[i * threads / jobs.size()].jobs.push_back(i);
+    }
+
+    // Each result slot is written by exactly one worker, and only read after the join
+    auto work = [&](size_t worker){
+        size_t job;
+        while (takeJob(queues, worker, job)){
+            results[job] = runJob(jobs[job], jobRoms[job], core, instPerSecond);
+        }
+    };
+    std::vector<std::thread> pool;
+    for (unsigned t = 1; t < threads; ++t){
+        pool.emplace_back(work, t);
+    }
+    work(0);
+    for (std::thread &thread : pool){
+        thread.join();
+    }
+    return results;
+}
+
+void printBatchResults(FILE* out, const std::vector<BatchJob> &jobs, const std::vector<BatchResult> &results) {
+    fprintf(out, "program,seed,status,frames,instructions,framebuffer_hash,pc,i,v0-vf,seconds\n");
+    for (size_t i = 0; i < jobs.size(); ++i){
+        const BatchResult &result = results[i];
+        char registers[33];
+        for (int r = 0; r < 16; ++r){
+            snprintf(registers + r * 2, 3, "%02X", result.vRegs[r]);
+        }
+        fprintf(out, "%s,%u,%s,%lu,%lu,%016lX,%03X,%03X,%s,%.6f\n",
+                jobs[i].program.c_str(), jobs[i].seed, result.loaded ? "ok" : "error",
+                (unsigned long) result.frames, (unsigned long) result.instructions,
+                (unsigned long) result.framebufferHash, result.programCounter, result.indexRegister,
+                registers, result.seconds);
+    }
+}
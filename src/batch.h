@@ -0,0 +1,41 @@
+#pragma once
+
+#include <cstdint>
+#include <stdio.h>
+#include <string>
+#include <vector>
+
+#include "emulator.h"
+
+// One headless run in a batch
+struct BatchJob {
+    std::string program;
+    uint32_t seed = 0;
+    uint64_t frames = 0;            // Frame budget
+    uint64_t instructions = 0;      // Instruction budget, rounded up to whole frames (used instead of frames if set)
+    QuirkProfile quirks = QuirkProfile::Modern;
+};
+
+// Outcome of one batch run
+struct BatchResult {
+    bool loaded = false;            // False if the program couldn't be opened
+    uint64_t frames = 0;
+    uint64_t instructions = 0;
+    uint64_t framebufferHash = 0;
+    uint16_t programCounter = 0;
+    uint16_t indexRegister = 0;
+    uint8_t vRegs [16] = {};
+    double seconds = 0;
+};
+
+// Reads a batch list: one run per line, "program [seed=N] [frames=N] [instructions=N] [quirks=NAME]", with # comments.
+// Runs without a budget get defaultFrames, and runs without quirks defaultQuirks. Returns false (after describing the
+// problem) if the list can't be read.
+bool readBatchList(const char* path, uint64_t defaultFrames, QuirkProfile defaultQuirks, std::vector<BatchJob> &jobs);
+
+// Runs every job headless on the given core, spread over a work-stealing pool of threads (0 for one per hardware
+// thread). Returns one result per job, in the same order.
+std::vector<BatchResult> runBatch(const std::vector<BatchJob> &jobs, Core core, int instPerSecond, unsigned threads);
+
+// Writes one CSV record per run
+void printBatchResults(FILE* out, const std::vector<BatchJob> &jobs, const std::vector<BatchResult> &results);
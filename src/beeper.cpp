@@ -0,0 +1,29 @@
+#include "beeper.h"
+
+Beeper::Beeper(int sampleRate, double frequency, int16_t amplitude)
+    : sampleRate(sampleRate), frequency(frequency), amplitude(amplitude) {
+}
+
+/* Fills in the samples for the next 1/60th of a second. While the beep is off the wave still advances (so turning it
+ * back on doesn't depend on how long it was off), but nothing is heard.
+ */
+const std::vector<int16_t> &Beeper::frame(bool on) {
+    sampleRemainder += sampleRate;
+    int count = sampleRemainder / 60;
+    sampleRemainder %= 60;
+
+    double step = frequency / sampleRate;
+    samples.resize(count);
+    for (int i = 0; i < count; ++i){
+        samples[i] = on ? (phase < 0.5 ? amplitude : -amplitude) : 0;
+        phase += step;
+        if (phase >= 1){
+            phase -= 1;
+        }
+    }
+    return samples;
+}
+
+int Beeper::getSampleRate() const {
+    return sampleRate;
+}
@@ -0,0 +1,28 @@
+#pragma once
+
+#include <cstdint>
+#include <vector>
+
+/* The CHIP-8's only sound: a fixed tone while the sound timer is above zero.
+ *
+ * Each emulated 60 Hz frame becomes sampleRate/60 mono samples, a square wave if the beep is on and silence otherwise.
+ * The fraction of a sample left over at the end of a frame is carried to the next one, and the wave's phase runs on
+ * across frames, so a beep held for several frames has no clicks at the frame boundaries.
+ */
+class Beeper {
+    private:
+        int sampleRate;
+        double frequency;
+        int16_t amplitude;
+        double phase = 0;               // Position within the current period of the wave, from 0 to 1
+        int sampleRemainder = 0;        // Carries the fractional part of sampleRate/60 between frames
+        std::vector<int16_t> samples;   // The last frame's samples
+
+    public:
+        Beeper(int sampleRate, double frequency = 440, int16_t amplitude = 3000);
+
+        // Generates one frame's samples, with the beep on or off. They stay valid until the next call.
+        const std::vector<int16_t> &frame(bool on);
+
+        int getSampleRate() const;
+};
@@ -1,55 +1,40 @@
 #include <algorithm>
 #include <chrono>
+#include <cstring>
+#include <ctime>
 #include <iostream>
-#include <random>
+#include <thread>
+#include <type_traits>
 #include <unordered_set>
 
 
 #include "emulator.h"
 
 // TODO: Add debug mode
-/* Creates a CHIP-8 emulator with default settings.
+/* Creates a CHIP-8 emulator with default settings, showing its display on (and taking input from) the given frontend.
  * Load a program with the loadProgram function, then start emulation with the start function.
  */
-Emulator::Emulator() {
+Emulator::Emulator(Frontend* frontend) : frontend(frontend) {
     // Set font part of memory (at 0x050 by convention)
-    uint8_t font[] =
-        {0xF0, 0x90, 0x90, 0x90, 0xF0,  // 0
-         0x20, 0x60, 0x20, 0x20, 0x70,  // 1
-         0xF0, 0x10, 0xF0, 0x80, 0xF0,  // 2
-         0xF0, 0x10, 0xF0, 0x10, 0xF0,  // 3
-         0x90, 0x90, 0xF0, 0x10, 0x10,  // 4
-         0xF0, 0x80, 0xF0, 0x10, 0xF0,  // 5
-         0xF0, 0x80, 0xF0, 0x90, 0xF0,  // 6
-         0xF0, 0x10, 0x20, 0x40, 0x40,  // 7
-         0xF0, 0x90, 0xF0, 0x90, 0xF0,  // 8
-         0xF0, 0x90, 0xF0, 0x10, 0xF0,  // 9
-         0xF0, 0x90, 0xF0, 0x90, 0x90,  // A
-         0xE0, 0x90, 0xE0, 0x90, 0xE0,  // B
-         0xF0, 0x80, 0x80, 0x80, 0xF0,  // C
-         0xE0, 0x90, 0x90, 0x90, 0xE0,  // D
-         0xF0, 0x80, 0xF0, 0x80, 0xF0,  // E
-         0xF0, 0x80, 0xF0, 0x80, 0x80}; // F
-    std::copy(font, std::end(font), memory + fontStart);
-}
-
-// TODO: Actually implement...
+    std::copy(fontSprites, std::end(fontSprites), state.memory + fontStart);
+}
+
 Emulator::~Emulator() {
-    //TODO: Delete SDL elements
 }
 
 /* Sets the instruction variable to the next instruction (pointed to by the program counter).
  * Increments the instruction counter to point to the next instruction (some instructions will undo this increment).
  */
 void Emulator::fetch() {
-    instruction = ((uint16_t) memory[programCounter] << 8) 
-                +  (uint16_t) memory[programCounter + 1];
+    instruction = ((uint16_t) state.memory[state.programCounter & 0xFFF] << 8) 
+                +  (uint16_t) state.memory[(state.programCounter + 1) & 0xFFF];
     
-    programCounter += 2;
+    state.programCounter += 2;
 }
 
 /* Determines and calls the correct function based on the instruction variable (which is set by fetch).
  */
+template<class Quirks>
 void Emulator::decode() {
     // Separate the instruction into nibbles
     uint8_t nibble1 = (instruction >> 12) & 0xF;
@@ -114,13 +99,13 @@ void Emulator::decode() {
             subSRegFromDReg(nibble3, nibble2);
             break;
         case 0x6:
-            rightShift(nibble2);
+            rightShift<Quirks>(nibble3, nibble2);
             break;
         case 0x7:
             subDRegFromSReg(nibble3, nibble2);
             break;
         case 0xE:
-            leftShift(nibble2);
+            leftShift<Quirks>(nibble3, nibble2);
             break;
         default:
             break;
@@ -133,17 +118,17 @@ void Emulator::decode() {
         setIndex(instruction & 0xFFF);
         break;
     case 0xB:
-        jumpWithOffset(instruction & 0xFFF);
+        jumpWithOffset<Quirks>(instruction & 0xFFF);
         break;
     case 0xC:
         random(nibble2, instruction & 0xFF);
         break;
     case 0xD:
-        display(nibble2, nibble3, nibble4);
+        display<Quirks>(nibble2, nibble3, nibble4);
         break;
     case 0xE:
         switch (nibble4){
-        case 0x3:
+        case 0xE:
             skipIfKey(nibble2);
             break;
         case 0x1:
@@ -177,34 +162,1096 @@ void Emulator::decode() {
             decimalConversion(nibble2);
             break;
         case 0x55:
-            storeRegToMem(nibble2);
+            storeRegToMem<Quirks>(nibble2);
             break;
         case 0x65:
-            loadRegFromMem(nibble2);
+            loadRegFromMem<Quirks>(nibble2);
             break;
         default:
             break;
         }
-        break;
-    
-    default:
-        break;
+        break;
+    
+    default:
+        break;
+    }
+}
+
+/* Decodes the fetched instruction with the selected quirk profile. The cores pick their specialization once per batch
+ * of instructions; this is for single instructions (stepping, and probing for idle loops).
+ */
+void Emulator::decodeWithQuirks() {
+    switch (quirks){
+    case QuirkProfile::Modern:
+        decode<ModernQuirks>();
+        break;
+    case QuirkProfile::Vip:
+        decode<VipQuirks>();
+        break;
+    case QuirkProfile::Chip48:
+        decode<Chip48Quirks>();
+        break;
+    case QuirkProfile::SuperChip:
+        decode<SuperChipQuirks>();
+        break;
+    }
+}
+
+/* Returns the operation decode() would dispatch the instruction to.
+ * Mirrors the switch in decode() exactly (including which bits it ignores), so every core agrees on what an instruction does.
+ */
+Emulator::Op Emulator::classify(uint16_t instruction) {
+    uint8_t nibble1 = (instruction >> 12) & 0xF;
+    uint8_t nibble4 =  instruction        & 0xF;
+
+    switch (nibble1) {
+    case 0x0:
+        switch (nibble4){
+        case 0x0: return Op::ClearScreen;
+        case 0xE: return Op::Ret;
+        default:  return Op::Nop;
+        }
+    case 0x1: return Op::Jump;
+    case 0x2: return Op::Call;
+    case 0x3: return Op::SkipRegEqVal;
+    case 0x4: return Op::SkipRegNeqVal;
+    case 0x5: return Op::SkipRegEqReg;
+    case 0x6: return Op::SetRegToVal;
+    case 0x7: return Op::AddValToReg;
+    case 0x8:
+        switch (nibble4){
+        case 0x0: return Op::SetRegToReg;
+        case 0x1: return Op::OrRegToReg;
+        case 0x2: return Op::AndRegToReg;
+        case 0x3: return Op::XorRegToReg;
+        case 0x4: return Op::AddRegToReg;
+        case 0x5: return Op::SubSRegFromDReg;
+        case 0x6: return Op::RightShift;
+        case 0x7: return Op::SubDRegFromSReg;
+        case 0xE: return Op::LeftShift;
+        default:  return Op::Nop;
+        }
+    case 0x9: return Op::SkipRegNeqReg;
+    case 0xA: return Op::SetIndex;
+    case 0xB: return Op::JumpWithOffset;
+    case 0xC: return Op::Random;
+    case 0xD: return Op::Display;
+    case 0xE:
+        switch (nibble4){
+        case 0xE: return Op::SkipIfKey;
+        case 0x1: return Op::SkipIfNotKey;
+        default:  return Op::Nop;
+        }
+    case 0xF:
+        switch (instruction & 0xFF){
+        case 0x07: return Op::SetRegFromDTimer;
+        case 0x15: return Op::SetDTimerFromReg;
+        case 0x18: return Op::SetSTimerFromReg;
+        case 0x1E: return Op::AddToIndex;
+        case 0x0A: return Op::GetKey;
+        case 0x29: return Op::FontChar;
+        case 0x33: return Op::DecimalConversion;
+        case 0x55: return Op::StoreRegToMem;
+        case 0x65: return Op::LoadRegFromMem;
+        default:   return Op::Nop;
+        }
+
+    default:
+        return Op::Nop;
+    }
+}
+
+/* Returns the 64K-entry table mapping each instruction to the operation it performs (built once, then shared read-only).
+ */
+const Emulator::Op* Emulator::opTable() {
+    static const std::vector<Op> table = [](){
+        std::vector<Op> ops(0x10000);
+        for (uint32_t i = 0; i < 0x10000; ++i){
+            ops[i] = classify((uint16_t) i);
+        }
+        return ops;
+    }();
+    return table.data();
+}
+
+/* Returns the 64K-entry table mapping each instruction directly to a handler (built once per quirk profile, then shared
+ * read-only). Each handler unpacks only the operands its instruction uses.
+ */
+template<class Quirks>
+const Emulator::Handler* Emulator::handlerTable() {
+    static const std::vector<Handler> table = [](){
+        const Handler handlers[(int) Op::Count] = {
+            [](Emulator &e, uint16_t i){ e.clearScreen(); },
+            [](Emulator &e, uint16_t i){ e.ret(); },
+            [](Emulator &e, uint16_t i){ e.jump(i & 0xFFF); },
+            [](Emulator &e, uint16_t i){ e.call(i & 0xFFF); },
+            [](Emulator &e, uint16_t i){ e.skipRegEqVal((i >> 8) & 0xF, i & 0xFF); },
+            [](Emulator &e, uint16_t i){ e.skipRegNeqVal((i >> 8) & 0xF, i & 0xFF); },
+            [](Emulator &e, uint16_t i){ e.skipRegEqReg((i >> 8) & 0xF, (i >> 4) & 0xF); },
+            [](Emulator &e, uint16_t i){ e.setRegToVal(i & 0xFF, (i >> 8) & 0xF); },
+            [](Emulator &e, uint16_t i){ e.addValToReg(i & 0xFF, (i >> 8) & 0xF); },
+            [](Emulator &e, uint16_t i){ e.setRegToReg((i >> 4) & 0xF, (i >> 8) & 0xF); },
+            [](Emulator &e, uint16_t i){ e.orRegToReg((i >> 4) & 0xF, (i >> 8) & 0xF); },
+            [](Emulator &e, uint16_t i){ e.andRegToReg((i >> 4) & 0xF, (i >> 8) & 0xF); },
+            [](Emulator &e, uint16_t i){ e.xorRegToReg((i >> 4) & 0xF, (i >> 8) & 0xF); },
+            [](Emulator &e, uint16_t i){ e.addRegToReg((i >> 4) & 0xF, (i >> 8) & 0xF); },
+            [](Emulator &e, uint16_t i){ e.subSRegFromDReg((i >> 4) & 0xF, (i >> 8) & 0xF); },
+            [](Emulator &e, uint16_t i){ e.rightShift<Quirks>((i >> 4) & 0xF, (i >> 8) & 0xF); },
+            [](Emulator &e, uint16_t i){ e.subDRegFromSReg((i >> 4) & 0xF, (i >> 8) & 0xF); },
+            [](Emulator &e, uint16_t i){ e.leftShift<Quirks>((i >> 4) & 0xF, (i >> 8) & 0xF); },
+            [](Emulator &e, uint16_t i){ e.skipRegNeqReg((i >> 8) & 0xF, (i >> 4) & 0xF); },
+            [](Emulator &e, uint16_t i){ e.setIndex(i & 0xFFF); },
+            [](Emulator &e, uint16_t i){ e.jumpWithOffset<Quirks>(i & 0xFFF); },
+            [](Emulator &e, uint16_t i){ e.random((i >> 8) & 0xF, i & 0xFF); },
+            [](Emulator &e, uint16_t i){ e.display<Quirks>((i >> 8) & 0xF, (i >> 4) & 0xF, i & 0xF); },
+            [](Emulator &e, uint16_t i){ e.skipIfKey((i >> 8) & 0xF); },
+            [](Emulator &e, uint16_t i){ e.skipIfNotKey((i >> 8) & 0xF); },
+            [](Emulator &e, uint16_t i){ e.setRegFromDTimer((i >> 8) & 0xF); },
+            [](Emulator &e, uint16_t i){ e.getKey((i >> 8) & 0xF); },
+            [](Emulator &e, uint16_t i){ e.setDTimerFromReg((i >> 8) & 0xF); },
+            [](Emulator &e, uint16_t i){ e.setSTimerFromReg((i >> 8) & 0xF); },
+            [](Emulator &e, uint16_t i){ e.addToIndex((i >> 8) & 0xF); },
+            [](Emulator &e, uint16_t i){ e.fontChar((i >> 8) & 0xF); },
+            [](Emulator &e, uint16_t i){ e.decimalConversion((i >> 8) & 0xF); },
+            [](Emulator &e, uint16_t i){ e.storeRegToMem<Quirks>((i >> 8) & 0xF); },
+            [](Emulator &e, uint16_t i){ e.loadRegFromMem<Quirks>((i >> 8) & 0xF); },
+            [](Emulator &e, uint16_t i){ },
+        };
+
+        const Op* ops = opTable();
+        std::vector<Handler> table(0x10000);
+        for (uint32_t i = 0; i < 0x10000; ++i){
+            table[i] = handlers[(int) ops[i]];
+        }
+        return table;
+    }();
+    return table.data();
+}
+
+/* Executes the given number of instructions with the selected dispatch core, specialized for the quirk profile.
+ */
+void Emulator::execute(int instructions) {
+    switch (quirks){
+    case QuirkProfile::Modern:
+        executeWithQuirks<ModernQuirks>(instructions);
+        break;
+    case QuirkProfile::Vip:
+        executeWithQuirks<VipQuirks>(instructions);
+        break;
+    case QuirkProfile::Chip48:
+        executeWithQuirks<Chip48Quirks>(instructions);
+        break;
+    case QuirkProfile::SuperChip:
+        executeWithQuirks<SuperChipQuirks>(instructions);
+        break;
+    }
+}
+
+/* The block cache, the JIT and recompiled code only implement the modern quirks (their decoded and native code has the
+ * modern behaviour built in), so programs with other quirks run on the threaded core instead.
+ */
+template<class Quirks>
+void Emulator::executeWithQuirks(int instructions) {
+    if (profile){
+        runSwitch<true, Quirks>(instructions);
+        return;
+    }
+
+    Core selected = core;
+    if (!std::is_same<Quirks, ModernQuirks>::value && (core == Core::Blocks || core == Core::Jit || core == Core::Aot)){
+        selected = Core::Threaded;
+    }
+    switch (selected){
+    case Core::Switch:
+        runSwitch<false, Quirks>(instructions);
+        break;
+    case Core::Table:
+        runTable<Quirks>(instructions);
+        break;
+    case Core::Threaded:
+        runThreaded<Quirks>(instructions);
+        break;
+    case Core::Blocks:
+        runBlocks<false>(instructions);
+        break;
+    case Core::Jit:
+        if (jit->available()){
+            runBlocks<true>(instructions);
+        } else {
+            runBlocks<false>(instructions);
+        }
+        break;
+    case Core::Aot:
+        runRecompiled(instructions);
+        break;
+    }
+}
+
+/* Reference core: fetch, then decode through the nested switch.
+ *
+ * With Profiling, each instruction is also counted against its operation and address and timed, and sprite and stack
+ * statistics are gathered around it. That is all resolved at compile time, so runSwitch<false> is the plain loop.
+ */
+template<bool Profiling, class Quirks>
+void Emulator::runSwitch(int instructions) {
+    typedef std::chrono::steady_clock Clock;
+    Clock::time_point last;
+    if (Profiling){
+        last = Clock::now();
+    }
+
+    for (int i = 0; i < instructions; ++i){
+        uint16_t address = state.programCounter & 0xFFF;
+        uint64_t before [32];
+        if (Profiling && state.memory[address] >> 4 == 0xD){
+            std::copy(state.framebuffer, state.framebuffer + 32, before);
+        }
+
+        fetch();
+        decode<Quirks>();
+
+        if (Profiling){
+            Clock::time_point now = Clock::now();
+            int op = (int) opTable()[instruction];
+            profile->opCounts[op] += 1;
+            profile->opNanoseconds[op] += std::chrono::duration_cast<std::chrono::nanoseconds>(now - last).count();
+            profile->addressHits[address] += 1;
+            profile->stackDepths[state.stackPointer] += 1;
+            if ((Op) op == Op::Display){
+                for (int row = 0; row < 32; ++row){
+                    profile->pixelsDrawn += __builtin_popcountll(before[row] ^ state.framebuffer[row]);
+                }
+                profile->draws += 1;
+                profile->collisions += state.vRegs[0xF];
+            }
+            last = now;
+        }
+    }
+}
+
+/* Table core: fetch, then a single indirect call through the pre-decoded handler table.
+ */
+template<class Quirks>
+void Emulator::runTable(int instructions) {
+    const Handler* handlers = handlerTable<Quirks>();
+    for (int i = 0; i < instructions; ++i){
+        fetch();
+        handlers[instruction](*this, instruction);
+    }
+}
+
+/* Threaded core: every handler ends by fetching the next instruction and jumping straight to the code for it, so each
+ * opcode gets its own indirect branch (which predicts far better than the single shared one of a switch) and the
+ * handlers can be inlined into the loop.
+ */
+template<class Quirks>
+void Emulator::runThreaded(int instructions) {
+#if defined(__GNUC__)
+    // Must be in the same order as Op
+    static const void* const labels[(int) Op::Count] = {
+        &&ClearScreen, &&Ret, &&Jump, &&Call, &&SkipRegEqVal, &&SkipRegNeqVal, &&SkipRegEqReg, &&SetRegToVal, &&AddValToReg,
+        &&SetRegToReg, &&OrRegToReg, &&AndRegToReg, &&XorRegToReg, &&AddRegToReg, &&SubSRegFromDReg, &&RightShift,
+        &&SubDRegFromSReg, &&LeftShift, &&SkipRegNeqReg, &&SetIndex, &&JumpWithOffset, &&Random, &&Display, &&SkipIfKey,
+        &&SkipIfNotKey, &&SetRegFromDTimer, &&GetKey, &&SetDTimerFromReg, &&SetSTimerFromReg, &&AddToIndex, &&FontChar,
+        &&DecimalConversion, &&StoreRegToMem, &&LoadRegFromMem, &&Nop
+    };
+    const Op* ops = opTable();
+    int remaining = instructions;
+
+    #define X  ((instruction >> 8) & 0xF)
+    #define Y  ((instruction >> 4) & 0xF)
+    #define NNN (instruction & 0xFFF)
+    #define NN  (instruction & 0xFF)
+    #define DISPATCH() if (remaining-- == 0) { return; } fetch(); goto *labels[(int) ops[instruction]]
+
+    DISPATCH();
+    ClearScreen:       clearScreen();                            DISPATCH();
+    Ret:               ret();                                    DISPATCH();
+    Jump:              jump(NNN);                                DISPATCH();
+    Call:              call(NNN);                                DISPATCH();
+    SkipRegEqVal:      skipRegEqVal(X, NN);                      DISPATCH();
+    SkipRegNeqVal:     skipRegNeqVal(X, NN);                     DISPATCH();
+    SkipRegEqReg:      skipRegEqReg(X, Y);                       DISPATCH();
+    SetRegToVal:       setRegToVal(NN, X);                       DISPATCH();
+    AddValToReg:       addValToReg(NN, X);                       DISPATCH();
+    SetRegToReg:       setRegToReg(Y, X);                        DISPATCH();
+    OrRegToReg:        orRegToReg(Y, X);                         DISPATCH();
+    AndRegToReg:       andRegToReg(Y, X);                        DISPATCH();
+    XorRegToReg:       xorRegToReg(Y, X);                        DISPATCH();
+    AddRegToReg:       addRegToReg(Y, X);                        DISPATCH();
+    SubSRegFromDReg:   subSRegFromDReg(Y, X);                    DISPATCH();
+    RightShift:        rightShift<Quirks>(Y, X);                 DISPATCH();
+    SubDRegFromSReg:   subDRegFromSReg(Y, X);                    DISPATCH();
+    LeftShift:         leftShift<Quirks>(Y, X);                  DISPATCH();
+    SkipRegNeqReg:     skipRegNeqReg(X, Y);                      DISPATCH();
+    SetIndex:          setIndex(NNN);                            DISPATCH();
+    JumpWithOffset:    jumpWithOffset<Quirks>(NNN);              DISPATCH();
+    Random:            random(X, NN);                            DISPATCH();
+    Display:           display<Quirks>(X, Y, instruction & 0xF); DISPATCH();
+    SkipIfKey:         skipIfKey(X);                             DISPATCH();
+    SkipIfNotKey:      skipIfNotKey(X);                          DISPATCH();
+    SetRegFromDTimer:  setRegFromDTimer(X);                      DISPATCH();
+    GetKey:            getKey(X);                                DISPATCH();
+    SetDTimerFromReg:  setDTimerFromReg(X);                      DISPATCH();
+    SetSTimerFromReg:  setSTimerFromReg(X);                      DISPATCH();
+    AddToIndex:        addToIndex(X);                            DISPATCH();
+    FontChar:          fontChar(X);                              DISPATCH();
+    DecimalConversion: decimalConversion(X);                     DISPATCH();
+    StoreRegToMem:     storeRegToMem<Quirks>(X);                 DISPATCH();
+    LoadRegFromMem:    loadRegFromMem<Quirks>(X);                DISPATCH();
+    Nop:                                                         DISPATCH();
+
+    #undef X
+    #undef Y
+    #undef NNN
+    #undef NN
+    #undef DISPATCH
+#else
+    runSwitch<false, Quirks>(instructions);
+#endif
+}
+
+/* Block core: runs whole pre-decoded blocks from the cache, so each instruction costs a single jump to its (inlined)
+ * handler instead of a fetch, decode and call. Blocks run on through jumps and past skips (leaving early if a skip
+ * doesn't skip a call, return or jump), and each remembers the last two blocks that followed it, so loops chain from
+ * block to block without going through the address lookup.
+ *
+ * Chaining is the hot path, so it checks as little as it can: only a block with FX33 or FX55 in it can have written
+ * over cached code, and the cache only grows (and so only needs flushing) on the slow path through the address lookup,
+ * which every call starts with. The reference core runs whatever is left of the budget once the next block is longer.
+ *
+ * With UseJit, blocks that are entered often have the code reachable from them recompiled to native code, which runs
+ * through loops on its own until it reaches something it can't run or the budget runs out (see JitCompiler), counting
+ * instructions exactly as the interpreter would.
+ */
+template<bool UseJit> void Emulator::runBlocks(int instructions) {
+    if (blockAt.empty()){
+        blockAt.assign(0x1000, -1);
+    }
+
+    int remaining = instructions;
+    int32_t index = -1;
+    while (remaining > 0){
+        if (index < 0){
+            // Drop any blocks that were written over (e.g. by loadState). Dropped blocks are never reused, so start
+            // over once enough of them have piled up.
+            if (dirtyPages != 0){
+                invalidateDirtyBlocks();
+            }
+            if (blockOps.size() > 0x10000 || (UseJit && jit->full())){
+                flushBlocks();
+            }
+
+            // Blocks never extend past the end of memory, so let the reference core handle the last address
+            if (state.programCounter > 0xFFE){
+                runSwitch<false>(1);
+                --remaining;
+                continue;
+            }
+            index = blockAt[state.programCounter] >= 0 ? blockAt[state.programCounter] : findBlock(state.programCounter);
+        }
+
+        Block* block = &blocks[index];
+        int executed = 0;
+        if (UseJit){
+            if (!block->compiled && ++block->hits >= jitThreshold){
+                compileBlock(*block);
+            }
+            if (block->native != NULL){
+                executed = block->native(&state, remaining, keypad);
+            }
+        }
+        if (executed > 0){
+            // Native code never writes memory, so there is nothing to check before chaining
+            remaining -= executed;
+        } else {
+            const DecodedOp* ops = &blockOps[block->firstOp];
+            if (block->length > remaining){
+                // Not enough budget left for the whole block: let the reference core run the rest, as this is once a
+                // frame
+                runSwitch<false>(remaining);
+                break;
+            }
+
+            int skipped = 0;    // Instructions in the block that were skipped over
+            const DecodedOp* op = ops;
+            const DecodedOp* end = ops + block->length;
+            while (op != end){
+                // One call site for the handlers, so they stay inlined
+                if (op->fused == Fused::None || op->fused == Fused::Guard || op->fused == Fused::GuardExit){
+                    uint16_t next = state.programCounter += 2;
+                    executeDecoded(*op);
+                    if (op->fused == Fused::None){
+                        ++op;
+                    } else if (state.programCounter != next){
+                        ++skipped;
+                        op += 2;
+                    } else {
+                        // Not skipped: run the guarded instruction, and leave after it if it has to be the last
+                        if (op->fused == Fused::GuardExit){
+                            end = op + 2;
+                        }
+                        ++op;
+                    }
+                } else {
+                    skipped += op->fusedLength - executeFused(op);
+                    op += op->fusedLength;
+                }
+            }
+            remaining -= (op - ops) - skipped;
+
+            if (block->writesMemory && dirtyPages != 0){
+                invalidateDirtyBlocks();
+                index = -1;
+                continue;
+            }
+        }
+
+        // Follow (or make) the chain to the next block. Links are only made to addresses below 0xFFF, so a match
+        // always has a block to go to.
+        uint16_t pc = state.programCounter;
+        if (block->nextAddress[0] == pc){
+            index = block->next[0];
+        } else if (block->nextAddress[1] == pc){
+            index = block->next[1];
+        } else if (pc > 0xFFE){
+            index = -1;
+        } else {
+            int32_t current = index;
+            index = blockAt[pc] >= 0 ? blockAt[pc] : findBlock(pc);
+
+            // Replace the older of the two links
+            Block &linked = blocks[current];
+            linked.next[1] = linked.next[0];
+            linked.nextAddress[1] = linked.nextAddress[0];
+            linked.next[0] = index;
+            linked.nextAddress[0] = pc;
+        }
+    }
+}
+
+/* Recompiled core: runs the loaded module's code, which returns whenever it reaches an instruction it leaves to the
+ * interpreter (drawing, key waits, stores, indirect jumps to unknown addresses), a block the budget can't cover or code
+ * that has been written over. The reference core runs the next instruction, then the recompiled code picks up again.
+ */
+void Emulator::runRecompiled(int instructions) {
+    if (!aot){
+        runSwitch<false>(instructions);
+        return;
+    }
+
+    AotContext context = {&state, aotValidPages, keypad, fontStart};
+    int remaining = instructions;
+    while (remaining > 0){
+        remaining -= aot->run(&context, remaining);
+        if (remaining > 0){
+            runSwitch<false>(1);
+            --remaining;
+            // The instruction may have been a store over recompiled code
+            context.validPages = aotValidPages;
+        }
+    }
+}
+
+/* Returns the index of the cached block starting at the address, decoding a new one if there isn't one yet.
+ */
+int32_t Emulator::findBlock(uint16_t address) {
+    if (blockAt[address] >= 0){
+        return blockAt[address];
+    }
+
+    Block block;
+    block.start = address;
+    block.length = 0;
+    block.firstOp = blockOps.size();
+    block.next[0] = block.next[1] = -1;
+    block.nextAddress[0] = block.nextAddress[1] = noLink;
+    block.hits = 0;
+    block.compiled = false;
+    block.native = NULL;
+
+    // The straight runs of code decoded so far, as [start, end) (the block follows jumps)
+    uint16_t segments[maxBlockLength][2];
+    int segmentCount = 0;
+    uint16_t segmentStart = address;
+    uint16_t pc = address;
+    block.writesMemory = false;
+    auto decode = [&](uint16_t address) {
+        uint16_t inst = ((uint16_t) state.memory[address] << 8) + (uint16_t) state.memory[address + 1];
+        Op op = opTable()[inst];
+        blockOps.push_back({op, (uint8_t) ((inst >> 8) & 0xF), (uint8_t) ((inst >> 4) & 0xF), (uint8_t) (inst & 0xF),
+                            (uint16_t) (inst & 0xFFF)});
+        block.writesMemory |= op == Op::DecimalConversion || op == Op::StoreRegToMem;
+        ++block.length;
+        return op;
+    };
+    while (block.length < maxBlockLength && pc <= 0xFFE){
+        Op op = decode(pc);
+        pc += 2;
+
+        // Carry on through a jump to code the block doesn't already cover, so a loop body split up by jumps is still
+        // one block. A jump back into the block ends it (it is the loop's back edge, which chaining handles).
+        if (op == Op::Jump){
+            uint16_t target = blockOps.back().nnn;
+            bool covered = target >= segmentStart && target < pc;
+            for (int i = 0; i < segmentCount && !covered; ++i){
+                covered = target >= segments[i][0] && target < segments[i][1];
+            }
+            if (target <= 0xFFE && !covered){
+                segments[segmentCount][0] = segmentStart;
+                segments[segmentCount][1] = pc;
+                ++segmentCount;
+                segmentStart = pc = target;
+                continue;
+            }
+            break;
+        }
+
+        if (isSkip(op)){
+            // A skip that fuses with the instruction before it (unless that is guarded by another skip) takes the jump
+            // after it along, so a whole counting loop or timer poll is one superinstruction (fuseBlock marks it)
+            uint16_t next = pc <= 0xFFE ? ((uint16_t) state.memory[pc] << 8) + state.memory[pc + 1] : 0;
+            bool guarded = block.length >= 3 && blockOps[blockOps.size() - 3].fused != Fused::None;
+            if (fusion && block.length >= 2 && block.length < maxBlockLength && opTable()[next] == Op::Jump &&
+                !guarded && fusesWithSkip(blockOps[blockOps.size() - 2], blockOps.back())){
+                decode(pc);
+                pc += 2;
+                break;
+            }
+
+            // Otherwise the skip guards the instruction after it, and the block carries on past both. If that
+            // instruction is one that would end a block, running it leaves this one.
+            if (block.length < maxBlockLength - 1 && pc <= 0xFFE){
+                size_t skip = blockOps.size() - 1;
+                Op guarded = decode(pc);
+                pc += 2;
+                blockOps[skip].fused = endsBlock(guarded) || isSkip(guarded) ? Fused::GuardExit : Fused::Guard;
+                blockOps[skip].fusedLength = 2;
+                continue;
+            }
+            break;
+        }
+
+        // End the block at anything else that can move the program counter or write to memory
+        if (endsBlock(op)){
+            break;
+        }
+    }
+    if (fusion){
+        fuseBlock(block);
+    }
+
+    segments[segmentCount][0] = segmentStart;
+    segments[segmentCount][1] = pc;
+    ++segmentCount;
+    block.pages = 0;
+    for (int i = 0; i < segmentCount; ++i){
+        for (uint16_t page = segments[i][0] >> 6; page <= ((segments[i][1] - 1) >> 6); ++page){
+            block.pages |= 1ULL << page;
+        }
+    }
+    codePages |= block.pages;
+
+    blockAt[address] = blocks.size();
+    blocks.push_back(block);
+    return blockAt[address];
+}
+
+/* Whether an operation skips the instruction after it on some condition.
+ */
+bool Emulator::isSkip(Op op) {
+    return op == Op::SkipRegEqVal || op == Op::SkipRegNeqVal || op == Op::SkipRegEqReg || op == Op::SkipRegNeqReg ||
+           op == Op::SkipIfKey || op == Op::SkipIfNotKey;
+}
+
+/* Whether an operation ends a block other than by skipping: it moves the program counter or writes to memory.
+ */
+bool Emulator::endsBlock(Op op) {
+    return op == Op::Jump || op == Op::Call || op == Op::Ret || op == Op::JumpWithOffset || op == Op::GetKey ||
+           op == Op::DecimalConversion || op == Op::StoreRegToMem;
+}
+
+/* Whether an instruction and the skip after it make a superinstruction: 7XNN or FX07 setting a register, and 3XNN or
+ * 4XNN testing it.
+ */
+bool Emulator::fusesWithSkip(const DecodedOp &first, const DecodedOp &skip) {
+    return (first.op == Op::AddValToReg || first.op == Op::SetRegFromDTimer) &&
+           (skip.op == Op::SkipRegEqVal || skip.op == Op::SkipRegNeqVal) && skip.x == first.x;
+}
+
+/* Marks the superinstructions in a newly decoded block. A skip inside a block is marked as guarding the instruction
+ * after it, and no sequence starts at the guarded instruction or takes in the skip, so execution can't branch into the
+ * middle of a sequence from inside the block; skips and jumps from elsewhere that land inside one start a block of
+ * their own at that address.
+ */
+void Emulator::fuseBlock(const Block &block) {
+    DecodedOp* ops = &blockOps[block.firstOp];
+    int i = 0;
+    while (i < block.length){
+        if (ops[i].fused == Fused::Guard || ops[i].fused == Fused::GuardExit){
+            i += 2;
+            continue;
+        }
+        int length = 1;
+        Fused fused = Fused::None;
+        if (i + 1 < block.length && ops[i + 1].fused == Fused::None && fusesWithSkip(ops[i], ops[i + 1])){
+            fused = ops[i].op == Op::AddValToReg ? Fused::AddSkip : Fused::TimerSkip;
+            length = i + 2 < block.length ? 3 : 2;
+        } else if (ops[i].op == Op::SetRegToVal){
+            while (length < 4 && i + length < block.length && ops[i + length].op == Op::SetRegToVal){
+                ++length;
+            }
+            fused = length > 1 ? Fused::SetRegs : Fused::None;
+        } else if (i + 1 < block.length && ops[i].op == Op::SetIndex && ops[i + 1].op == Op::Display){
+            fused = Fused::IndexDisplay;
+            length = 2;
+        }
+        ops[i].fused = fused;
+        ops[i].fusedLength = length;
+        i += length;
+    }
+}
+
+/* Executes a superinstruction: the same as executing its instructions one by one, with one dispatch for all of them.
+ * Returns how many instructions that was, which is one fewer than its length if the jump at the end was skipped over.
+ */
+inline int Emulator::executeFused(const DecodedOp* ops) {
+    switch (ops->fused){
+    case Fused::SetRegs:
+        for (int i = 0; i < ops->fusedLength; ++i){
+            state.vRegs[ops[i].x] = ops[i].nnn & 0xFF;
+        }
+        state.programCounter += 2 * ops->fusedLength;
+        break;
+    case Fused::IndexDisplay:
+        state.programCounter += 4;
+        state.indexRegister = ops[0].nnn;
+        display<ModernQuirks>(ops[1].x, ops[1].y, ops[1].n);
+        break;
+    case Fused::AddSkip:
+    case Fused::TimerSkip: {
+        uint8_t &reg = state.vRegs[ops[0].x];
+        reg = ops->fused == Fused::AddSkip ? reg + (ops[0].nnn & 0xFF) : state.delayTimer;
+        bool skip = (reg == (ops[1].nnn & 0xFF)) == (ops[1].op == Op::SkipRegEqVal);
+        state.programCounter += skip ? 6 : 4;
+        if (ops->fusedLength == 3){
+            if (skip){
+                return 2;
+            }
+            state.programCounter = ops[2].nnn;
+        }
+        break;
+    }
+    default:
+        break;
+    }
+    return ops->fusedLength;
+}
+
+/* Executes a pre-decoded instruction. The switch is over the already classified operation, and the handlers are
+ * inlined into it, so this is a single jump (rather than a decode and a call) per instruction. It is forced inline into
+ * runBlocks, as both instantiations of that together are over GCC's inlining limit.
+ */
+__attribute__((always_inline)) inline void Emulator::executeDecoded(const DecodedOp &op) {
+    uint8_t nn = op.nnn & 0xFF;
+    switch (op.op){
+    case Op::ClearScreen:       clearScreen();                           break;
+    case Op::Ret:               ret();                                   break;
+    case Op::Jump:              jump(op.nnn);                            break;
+    case Op::Call:              call(op.nnn);                            break;
+    case Op::SkipRegEqVal:      skipRegEqVal(op.x, nn);                  break;
+    case Op::SkipRegNeqVal:     skipRegNeqVal(op.x, nn);                 break;
+    case Op::SkipRegEqReg:      skipRegEqReg(op.x, op.y);                break;
+    case Op::SetRegToVal:       setRegToVal(nn, op.x);                   break;
+    case Op::AddValToReg:       addValToReg(nn, op.x);                   break;
+    case Op::SetRegToReg:       setRegToReg(op.y, op.x);                 break;
+    case Op::OrRegToReg:        orRegToReg(op.y, op.x);                  break;
+    case Op::AndRegToReg:       andRegToReg(op.y, op.x);                 break;
+    case Op::XorRegToReg:       xorRegToReg(op.y, op.x);                 break;
+    case Op::AddRegToReg:       addRegToReg(op.y, op.x);                 break;
+    case Op::SubSRegFromDReg:   subSRegFromDReg(op.y, op.x);             break;
+    case Op::RightShift:        rightShift<ModernQuirks>(op.y, op.x);    break;
+    case Op::SubDRegFromSReg:   subDRegFromSReg(op.y, op.x);             break;
+    case Op::LeftShift:         leftShift<ModernQuirks>(op.y, op.x);     break;
+    case Op::SkipRegNeqReg:     skipRegNeqReg(op.x, op.y);               break;
+    case Op::SetIndex:          setIndex(op.nnn);                        break;
+    case Op::JumpWithOffset:    jumpWithOffset<ModernQuirks>(op.nnn);    break;
+    case Op::Random:            random(op.x, nn);                        break;
+    case Op::Display:           display<ModernQuirks>(op.x, op.y, op.n); break;
+    case Op::SkipIfKey:         skipIfKey(op.x);                         break;
+    case Op::SkipIfNotKey:      skipIfNotKey(op.x);                      break;
+    case Op::SetRegFromDTimer:  setRegFromDTimer(op.x);                  break;
+    case Op::GetKey:            getKey(op.x);                            break;
+    case Op::SetDTimerFromReg:  setDTimerFromReg(op.x);                  break;
+    case Op::SetSTimerFromReg:  setSTimerFromReg(op.x);                  break;
+    case Op::AddToIndex:        addToIndex(op.x);                        break;
+    case Op::FontChar:          fontChar(op.x);                          break;
+    case Op::DecimalConversion: decimalConversion(op.x);                 break;
+    case Op::StoreRegToMem:     storeRegToMem<ModernQuirks>(op.x);       break;
+    case Op::LoadRegFromMem:    loadRegFromMem<ModernQuirks>(op.x);      break;
+    default:                                                         break;
+    }
+}
+
+/* Called whenever an instruction writes to memory. Any cached code in the written pages is marked dirty.
+ */
+void Emulator::markWritten(uint16_t address, uint16_t length) {
+    if (address >= 0x1000 || length == 0){
+        return;
+    }
+    uint16_t last = std::min(address + length - 1, 0xFFF);
+    for (uint16_t page = address >> 6; page <= (last >> 6); ++page){
+        dirtyPages |= (1ULL << page) & codePages;
+        aotValidPages &= ~(1ULL << page);
+    }
+}
+
+/* Drops every cached block that was decoded from a dirty page.
+ * Chains may point at the dropped blocks, so they are all unlinked (and get rebuilt as the surviving blocks run again).
+ */
+void Emulator::invalidateDirtyBlocks() {
+    for (size_t i = 0; i < blocks.size(); ++i){
+        blocks[i].next[0] = blocks[i].next[1] = -1;
+        blocks[i].nextAddress[0] = blocks[i].nextAddress[1] = noLink;
+        if ((blocks[i].pages & dirtyPages) && blockAt[blocks[i].start] == (int32_t) i){
+            blockAt[blocks[i].start] = -1;
+        }
+    }
+    dirtyPages = 0;
+}
+
+/* Compiles the region of code reachable from the start of the block to native code, which the block then runs
+ * instead. The block is dropped (and so is the native code) if any of the memory the region was compiled from changes.
+ */
+void Emulator::compileBlock(Block &block) {
+    block.compiled = true;
+    uint64_t pages = 0;
+    block.native = jit->compile(state, block.start, fontStart, pages);
+    if (block.native != NULL){
+        block.pages |= pages;
+        codePages |= pages;
+    }
+}
+
+/* Empties the block cache (and frees any native code compiled for it).
+ */
+void Emulator::flushBlocks() {
+    if (jit){
+        jit->reset();
+    }
+    blockOps.clear();
+    blocks.clear();
+    if (!blockAt.empty()){
+        blockAt.assign(0x1000, -1);
+    }
+    codePages = 0;
+    dirtyPages = 0;
+}
+
+/* Selects the dispatch core used by runFrame.
+ */
+void Emulator::setCore(Core core) {
+    this->core = core;
+    if (core == Core::Jit && !jit){
+        jit.reset(new JitCompiler());
+    }
+}
+
+void Emulator::setFusion(bool enabled) {
+    fusion = enabled;
+    flushBlocks();
+}
+
+/* Loads the recompiled program. It applies to whatever program is in memory from then on (including one loaded later),
+ * but its code only runs from pages that match the program it was recompiled from.
+ */
+bool Emulator::loadRecompiled(const char* path) {
+    AotModule* module = AotModule::load(path);
+    if (module == NULL){
+        return false;
+    }
+    aot.reset(module);
+    aotValidPages = aot->validPages(state.memory);
+    return true;
+}
+
+/* Copies the architectural state into out.
+ */
+void Emulator::saveState(MachineState &out) const {
+    out = state;
+}
+
+/* Replaces the architectural state with in.
+ * Cached blocks are only dropped for code pages whose contents actually differ, so restoring a recent snapshot (which
+ * usually has the same code) doesn't throw away the block cache or compiled code.
+ */
+void Emulator::loadState(const MachineState &in) {
+    for (uint64_t pages = codePages; pages != 0; pages &= pages - 1){
+        int page = __builtin_ctzll(pages);
+        if (memcmp(&state.memory[page * 64], &in.memory[page * 64], 64) != 0){
+            dirtyPages |= 1ULL << page;
+        }
+    }
+    state = in;
+    framebufferChanged = true;
+    if (aot){
+        aotValidPages = aot->validPages(state.memory);
+    }
+}
+
+/* Starts keeping a rewind history of at most budgetBytes (or stops, if it is 0). The current state is its first frame.
+ */
+void Emulator::setRewindBudget(size_t budgetBytes) {
+    if (budgetBytes == 0){
+        rewindBuffer.reset();
+        return;
+    }
+    rewindBuffer.reset(new RewindBuffer(budgetBytes));
+    rewindBuffer->capture(state);
+}
+
+void Emulator::setRewinding(bool enabled) {
+    rewinding = enabled;
+}
+
+/* Restores the state of the frame before the newest one in the rewind history, and drops the newest one.
+ */
+bool Emulator::stepBack() {
+    MachineState previous;
+    if (!rewindBuffer || !rewindBuffer->stepBack(previous)){
+        return false;
+    }
+    loadState(previous);
+
+    // Rewound frames are silent, but still take up a frame of audio so the sound doesn't fall behind
+    if (beeper){
+        playFrameAudio(false);
+    }
+    return true;
+}
+
+/* Restores any frame still in the rewind history, e.g. to go back to a checkpoint. The frames after it are dropped a
+ * delta at a time, which leaves the history as if the emulator had never run past the restored frame.
+ */
+bool Emulator::restoreFrame(size_t framesBack) {
+    MachineState restored;
+    if (!rewindBuffer || !rewindBuffer->restore(framesBack, restored)){
+        return false;
+    }
+    MachineState dropped;
+    for (size_t i = 0; i < framesBack; ++i){
+        rewindBuffer->stepBack(dropped);
+    }
+    loadState(restored);
+    return true;
+}
+
+/* Compares this emulator's architectural state with another's, field by field.
+ * Returns a description of the first difference found, or an empty string if there is none.
+ */
+std::string Emulator::compareState(const Emulator &other) const {
+    char description[128];
+    if (state.programCounter != other.state.programCounter){
+        snprintf(description, sizeof(description), "program counter 0x%03X vs 0x%03X", state.programCounter,
+                 other.state.programCounter);
+        return description;
+    }
+    if (state.indexRegister != other.state.indexRegister){
+        snprintf(description, sizeof(description), "index register 0x%03X vs 0x%03X", state.indexRegister,
+                 other.state.indexRegister);
+        return description;
+    }
+    for (int i = 0; i < 16; ++i){
+        if (state.vRegs[i] != other.state.vRegs[i]){
+            snprintf(description, sizeof(description), "V%X 0x%02X vs 0x%02X", i, state.vRegs[i], other.state.vRegs[i]);
+            return description;
+        }
+    }
+    if (state.delayTimer != other.state.delayTimer || state.soundTimer != other.state.soundTimer){
+        snprintf(description, sizeof(description), "timers (delay %d, sound %d) vs (delay %d, sound %d)",
+                 state.delayTimer, state.soundTimer, other.state.delayTimer, other.state.soundTimer);
+        return description;
+    }
+    if (state.stackPointer != other.state.stackPointer
+        || !std::equal(state.addressStack, state.addressStack + state.stackPointer, other.state.addressStack)){
+        return "address stack";
+    }
+    if (state.awaitingKey != other.state.awaitingKey || state.keyPressed != other.state.keyPressed){
+        return "key wait state";
+    }
+    for (int i = 0; i < 4096; ++i){
+        if (state.memory[i] != other.state.memory[i]){
+            snprintf(description, sizeof(description), "memory[0x%03X] 0x%02X vs 0x%02X", i, state.memory[i],
+                     other.state.memory[i]);
+            return description;
+        }
+    }
+    for (int y = 0; y < 32; ++y){
+        if (state.framebuffer[y] != other.state.framebuffer[y]){
+            snprintf(description, sizeof(description), "display row %d 0x%016lX vs 0x%016lX", y,
+                     (unsigned long) state.framebuffer[y], (unsigned long) other.state.framebuffer[y]);
+            return description;
+        }
+    }
+    return "";
+}
+
+/* Starts (or stops) profiling. Starting again discards the previous profile.
+ */
+void Emulator::setProfiling(bool enabled) {
+    profile.reset(enabled ? new Profile() : NULL);
+}
+
+/* Returns the name of the handler an operation dispatches to, with its opcode pattern.
+ */
+const char* Emulator::opName(Op op) {
+    // Must be in the same order as Op
+    static const char* const names[(int) Op::Count] = {
+        "clearScreen 00E0", "ret 00EE", "jump 1NNN", "call 2NNN", "skipRegEqVal 3XNN", "skipRegNeqVal 4XNN",
+        "skipRegEqReg 5XY0", "setRegToVal 6XNN", "addValToReg 7XNN", "setRegToReg 8XY0", "orRegToReg 8XY1",
+        "andRegToReg 8XY2", "xorRegToReg 8XY3", "addRegToReg 8XY4", "subSRegFromDReg 8XY5", "rightShift 8XY6",
+        "subDRegFromSReg 8XY7", "leftShift 8XYE", "skipRegNeqReg 9XY0", "setIndex ANNN", "jumpWithOffset BNNN",
+        "random CXNN", "display DXYN", "skipIfKey EX9E", "skipIfNotKey EXA1", "setRegFromDTimer FX07", "getKey FX0A",
+        "setDTimerFromReg FX15", "setSTimerFromReg FX18", "addToIndex FX1E", "fontChar FX29", "decimalConversion FX33",
+        "storeRegToMem FX55", "loadRegFromMem FX65", "(no operation)"
+    };
+    return names[(int) op];
+}
+
+/* Returns the assembly for an instruction, in the usual CHIP-8 mnemonics. It goes through the same classification as
+ * the cores, so it always describes what the emulator will actually do with the instruction.
+ */
+std::string Emulator::disassemble(uint16_t instruction) {
+    unsigned x = (instruction >> 8) & 0xF;
+    unsigned y = (instruction >> 4) & 0xF;
+    unsigned n = instruction & 0xF;
+    unsigned nn = instruction & 0xFF;
+    unsigned nnn = instruction & 0xFFF;
+
+    char text[32];
+    switch (opTable()[instruction]){
+    case Op::ClearScreen:       snprintf(text, sizeof(text), "CLS");                        break;
+    case Op::Ret:               snprintf(text, sizeof(text), "RET");                        break;
+    case Op::Jump:              snprintf(text, sizeof(text), "JP 0x%03X", nnn);             break;
+    case Op::Call:              snprintf(text, sizeof(text), "CALL 0x%03X", nnn);           break;
+    case Op::SkipRegEqVal:      snprintf(text, sizeof(text), "SE V%X, 0x%02X", x, nn);      break;
+    case Op::SkipRegNeqVal:     snprintf(text, sizeof(text), "SNE V%X, 0x%02X", x, nn);     break;
+    case Op::SkipRegEqReg:      snprintf(text, sizeof(text), "SE V%X, V%X", x, y);          break;
+    case Op::SetRegToVal:       snprintf(text, sizeof(text), "LD V%X, 0x%02X", x, nn);      break;
+    case Op::AddValToReg:       snprintf(text, sizeof(text), "ADD V%X, 0x%02X", x, nn);     break;
+    case Op::SetRegToReg:       snprintf(text, sizeof(text), "LD V%X, V%X", x, y);          break;
+    case Op::OrRegToReg:        snprintf(text, sizeof(text), "OR V%X, V%X", x, y);          break;
+    case Op::AndRegToReg:       snprintf(text, sizeof(text), "AND V%X, V%X", x, y);         break;
+    case Op::XorRegToReg:       snprintf(text, sizeof(text), "XOR V%X, V%X", x, y);         break;
+    case Op::AddRegToReg:       snprintf(text, sizeof(text), "ADD V%X, V%X", x, y);         break;
+    case Op::SubSRegFromDReg:   snprintf(text, sizeof(text), "SUB V%X, V%X", x, y);         break;
+    case Op::RightShift:        snprintf(text, sizeof(text), "SHR V%X", x);                 break;
+    case Op::SubDRegFromSReg:   snprintf(text, sizeof(text), "SUBN V%X, V%X", x, y);        break;
+    case Op::LeftShift:         snprintf(text, sizeof(text), "SHL V%X", x);                 break;
+    case Op::SkipRegNeqReg:     snprintf(text, sizeof(text), "SNE V%X, V%X", x, y);         break;
+    case Op::SetIndex:          snprintf(text, sizeof(text), "LD I, 0x%03X", nnn);          break;
+    case Op::JumpWithOffset:    snprintf(text, sizeof(text), "JP V0, 0x%03X", nnn);         break;
+    case Op::Random:            snprintf(text, sizeof(text), "RND V%X, 0x%02X", x, nn);     break;
+    case Op::Display:           snprintf(text, sizeof(text), "DRW V%X, V%X, %u", x, y, n);  break;
+    case Op::SkipIfKey:         snprintf(text, sizeof(text), "SKP V%X", x);                 break;
+    case Op::SkipIfNotKey:      snprintf(text, sizeof(text), "SKNP V%X", x);                break;
+    case Op::SetRegFromDTimer:  snprintf(text, sizeof(text), "LD V%X, DT", x);              break;
+    case Op::GetKey:            snprintf(text, sizeof(text), "LD V%X, K", x);               break;
+    case Op::SetDTimerFromReg:  snprintf(text, sizeof(text), "LD DT, V%X", x);              break;
+    case Op::SetSTimerFromReg:  snprintf(text, sizeof(text), "LD ST, V%X", x);              break;
+    case Op::AddToIndex:        snprintf(text, sizeof(text), "ADD I, V%X", x);              break;
+    case Op::FontChar:          snprintf(text, sizeof(text), "LD F, V%X", x);               break;
+    case Op::DecimalConversion: snprintf(text, sizeof(text), "LD B, V%X", x);               break;
+    case Op::StoreRegToMem:     snprintf(text, sizeof(text), "LD [I], V%X", x);             break;
+    case Op::LoadRegFromMem:    snprintf(text, sizeof(text), "LD V%X, [I]", x);             break;
+    default:                    snprintf(text, sizeof(text), "DW 0x%04X", instruction);     break;
+    }
+    return text;
+}
+
+/* Writes the profile: instructions and host time per operation (busiest first), sprite and stack statistics, and the
+ * most executed addresses with the instructions currently there.
+ */
+void Emulator::printProfile(FILE* out, int hotAddresses) const {
+    if (!profile){
+        fprintf(out, "Profiling is off\n");
+        return;
+    }
+
+    uint64_t total = 0;
+    uint64_t totalNanoseconds = 0;
+    for (int op = 0; op < (int) Op::Count; ++op){
+        total += profile->opCounts[op];
+        totalNanoseconds += profile->opNanoseconds[op];
+    }
+    fprintf(out, "Profile: %lu instructions, %.3f ms of host time\n", (unsigned long) total, totalNanoseconds / 1e6);
+    if (total == 0){
+        return;
+    }
+
+    std::vector<int> ops;
+    for (int op = 0; op < (int) Op::Count; ++op){
+        if (profile->opCounts[op] > 0){
+            ops.push_back(op);
+        }
+    }
+    std::sort(ops.begin(), ops.end(), [&](int a, int b){ return profile->opCounts[a] > profile->opCounts[b]; });
+
+    fprintf(out, "\n%-24s %14s %7s %12s %7s %8s\n", "Operation", "Count", "%", "Host ms", "%", "ns/inst");
+    for (int op : ops){
+        fprintf(out, "%-24s %14lu %6.2f%% %12.3f %6.2f%% %8.1f\n", opName((Op) op), (unsigned long) profile->opCounts[op],
+                100.0 * profile->opCounts[op] / total, profile->opNanoseconds[op] / 1e6,
+                totalNanoseconds > 0 ? 100.0 * profile->opNanoseconds[op] / totalNanoseconds : 0.0,
+                (double) profile->opNanoseconds[op] / profile->opCounts[op]);
+    }
+
+    fprintf(out, "\nSprites: %lu drawn, %lu pixels flipped (%.1f per sprite), %lu with collisions (%.1f%%)\n",
+            (unsigned long) profile->draws, (unsigned long) profile->pixelsDrawn,
+            profile->draws > 0 ? (double) profile->pixelsDrawn / profile->draws : 0.0, (unsigned long) profile->collisions,
+            profile->draws > 0 ? 100.0 * profile->collisions / profile->draws : 0.0);
+
+    int maxDepth = 0;
+    for (int depth = 0; depth <= MachineState::stackSize; ++depth){
+        if (profile->stackDepths[depth] > 0){
+            maxDepth = depth;
+        }
+    }
+    fprintf(out, "Stack: maximum depth %d; instructions at each depth:", maxDepth);
+    for (int depth = 0; depth <= maxDepth; ++depth){
+        fprintf(out, " %d: %.1f%%", depth, 100.0 * profile->stackDepths[depth] / total);
+    }
+    fprintf(out, "\n");
+
+    std::vector<uint16_t> addresses;
+    for (uint16_t address = 0; address < 0x1000; ++address){
+        if (profile->addressHits[address] > 0){
+            addresses.push_back(address);
+        }
+    }
+    std::sort(addresses.begin(), addresses.end(), [&](uint16_t a, uint16_t b){
+        return profile->addressHits[a] != profile->addressHits[b] ? profile->addressHits[a] > profile->addressHits[b] : a < b;
+    });
+    fprintf(out, "\nHot addresses (%lu of %lu executed):\n", (unsigned long) std::min((size_t) hotAddresses, addresses.size()),
+            (unsigned long) addresses.size());
+    if ((int) addresses.size() > hotAddresses){
+        addresses.resize(hotAddresses);
+    }
+    fprintf(out, "%-8s %14s %7s   %-6s %s\n", "Address", "Count", "%", "Inst", "Disassembly");
+    for (uint16_t address : addresses){
+        uint16_t inst = ((uint16_t) state.memory[address] << 8) + state.memory[(address + 1) & 0xFFF];
+        fprintf(out, "0x%03X    %14lu %6.2f%%   %04X   %s\n", address, (unsigned long) profile->addressHits[address],
+                100.0 * profile->addressHits[address] / total, inst, disassemble(inst).c_str());
     }
 }
 
 /* Opcode: 00E0
  * Makes the entire screen black.
  * 
- * Rather than changing individual "pixels" to black, the function makes the entire screen black
- * and fills the pixel array with 0 (which indicates a black pixel).
+ * Zeroes the framebuffer (a 0 bit is a black pixel). The frontend shows it at the end of the frame.
  */
 void Emulator::clearScreen() {
-    // Set pixel array to 0
-    std::fill(&pixels[0][0], &pixels[0][0]+(64*32), 0);
-
-    // Make window black, then update display
-    SDL_FillRect(screenSurface, NULL, SDL_MapRGB(screenSurface->format, 0x00, 0x00, 0x00));
-    SDL_UpdateWindowSurface(window);
+    std::fill(state.framebuffer, state.framebuffer + 32, 0);
+    framebufferChanged = true;
 }
 
 /* Opcode: 00EE
@@ -215,11 +1262,10 @@ void Emulator::clearScreen() {
  */
 void Emulator::ret(){
     // Attempt to update programCounter from address stack, print error if stack is empty
-    if (addressStack.size() > 0) {
-        programCounter = addressStack.back();
-        addressStack.pop_back();
+    if (state.stackPointer > 0) {
+        state.programCounter = state.addressStack[--state.stackPointer];
     } else{
-        printf("Ret (00EE) called with empty address stack! Program Counter: %d\n", programCounter);
+        printf("Ret (00EE) called with empty address stack! Program Counter: %d\n", state.programCounter);
     }
 }
 
@@ -227,24 +1273,30 @@ void Emulator::ret(){
  * Sets the programCounter to the specified address.
  */
 void Emulator::jump(uint16_t address) {
-    programCounter = address;
+    state.programCounter = address;
 }
 
 /* Opcode: 2NNN
  * Pushes the current programCounter to the address stack, then sets the programCounter to the specified address.
  * Should be used with a later "ret" (00EE) instruction.
+ *
+ * Prints an error message if the stack is full, in which case the return address is dropped but the jump still happens.
  */
 void Emulator::call(uint16_t address){
-    addressStack.push_back(programCounter);
-    programCounter = address;
+    if (state.stackPointer < MachineState::stackSize) {
+        state.addressStack[state.stackPointer++] = state.programCounter;
+    } else{
+        printf("Call (2NNN) overflowed the address stack! Program Counter: %d\n", state.programCounter);
+    }
+    state.programCounter = address;
 }
 
 /* Opcode: 3XNN
  * Skips an instruction if the value in the specified register equals the passed value.
  */
 void Emulator::skipRegEqVal(uint8_t reg, uint8_t value) {
-    if (vRegs[reg] == value){
-        programCounter += 2;
+    if (state.vRegs[reg] == value){
+        state.programCounter += 2;
     }
 }
 
@@ -252,8 +1304,8 @@ void Emulator::skipRegEqVal(uint8_t reg, uint8_t value) {
  * Skips an instruction if the value in the specified register does not equal the passed value.
  */
 void Emulator::skipRegNeqVal(uint8_t reg, uint8_t value) {
-    if (vRegs[reg] != value){
-        programCounter += 2;
+    if (state.vRegs[reg] != value){
+        state.programCounter += 2;
     }
 }
 
@@ -261,8 +1313,8 @@ void Emulator::skipRegNeqVal(uint8_t reg, uint8_t value) {
  * Skips an instruction if the values in the specified registers are equal.
  */
 void Emulator::skipRegEqReg(uint8_t reg1, uint8_t reg2) {
-    if (vRegs[reg1] == vRegs[reg2]){
-        programCounter += 2;
+    if (state.vRegs[reg1] == state.vRegs[reg2]){
+        state.programCounter += 2;
     }
 }
 
@@ -270,8 +1322,8 @@ void Emulator::skipRegEqReg(uint8_t reg1, uint8_t reg2) {
  * Skips an instruction if the values in the specified registers are not equal.
  */
 void Emulator::skipRegNeqReg(uint8_t reg1, uint8_t reg2) {
-    if (vRegs[reg1] != vRegs[reg2]){
-        programCounter += 2;
+    if (state.vRegs[reg1] != state.vRegs[reg2]){
+        state.programCounter += 2;
     }
 }
 
@@ -279,7 +1331,7 @@ void Emulator::skipRegNeqReg(uint8_t reg1, uint8_t reg2) {
  * Sets the value of the destination register to the passed value.
  */
 void Emulator::setRegToVal(uint8_t value, uint8_t dstReg){
-    vRegs[dstReg] = value;
+    state.vRegs[dstReg] = value;
 }
 
 /* Opcode: 7XNN
@@ -287,35 +1339,35 @@ void Emulator::setRegToVal(uint8_t value, uint8_t dstReg){
  * Does not set the carry flag (vRegs[0xF]) if there is overflow.
  */
 void Emulator::addValToReg(uint8_t value, uint8_t dstReg){
-    vRegs[dstReg] += value;
+    state.vRegs[dstReg] += value;
 }
 
 /* Opcode: 8XY0
  * Sets the destination register to the value of the source register.
  */
 void Emulator::setRegToReg(uint8_t srcReg, uint8_t dstReg){
-    vRegs[dstReg] = vRegs[srcReg];
+    state.vRegs[dstReg] = state.vRegs[srcReg];
 }
 
 /* Opcode: 8XY1
  * Sets the value of the destination register to the binary OR of the destination and source registers.
  */
 void Emulator::orRegToReg(uint8_t srcReg, uint8_t dstReg){
-    vRegs[dstReg] |= vRegs[srcReg];
+    state.vRegs[dstReg] |= state.vRegs[srcReg];
 }
 
 /* Opcode: 8XY2
  * Sets the value of the destination register to the binary AND of the destination and source registers.
  */
 void Emulator::andRegToReg(uint8_t srcReg, uint8_t dstReg){
-    vRegs[dstReg] &= vRegs[srcReg];
+    state.vRegs[dstReg] &= state.vRegs[srcReg];
 }
 
 /* Opcode: 8XY3
  * Sets the value of the destination register to the binary XOR of the destination and source registers.
  */
 void Emulator::xorRegToReg(uint8_t srcReg, uint8_t dstReg){
-    vRegs[dstReg] ^= vRegs[srcReg];
+    state.vRegs[dstReg] ^= state.vRegs[srcReg];
 }
 
 /* Opcode: 8XY4
@@ -324,13 +1376,13 @@ void Emulator::xorRegToReg(uint8_t srcReg, uint8_t dstReg){
  * If the addition overflows, the carry flag (vRegs[0xF]) is set to 1. Otherwise, it is set to 0.
  */
 void Emulator::addRegToReg(uint8_t srcReg, uint8_t dstReg){
-    vRegs[dstReg] += vRegs[srcReg];
+    state.vRegs[dstReg] += state.vRegs[srcReg];
 
     // Check for overflow, set carry flag accordingly
-    if (vRegs[dstReg] < vRegs[srcReg]){
-        vRegs[0xF] = 1;
+    if (state.vRegs[dstReg] < state.vRegs[srcReg]){
+        state.vRegs[0xF] = 1;
     } else{
-        vRegs[0xF] = 0;
+        state.vRegs[0xF] = 0;
     }
 }
 
@@ -341,13 +1393,13 @@ void Emulator::addRegToReg(uint8_t srcReg, uint8_t dstReg){
  */
 void Emulator::subSRegFromDReg(uint8_t srcReg, uint8_t dstReg){
     // If the subtraction doesn't underflow, set carry flag to 1; otherwise, 0.
-    if (vRegs[dstReg] >= vRegs[srcReg]){
-        vRegs[0xF] = 1;
+    if (state.vRegs[dstReg] >= state.vRegs[srcReg]){
+        state.vRegs[0xF] = 1;
     } else{
-        vRegs[0xF] = 0;
+        state.vRegs[0xF] = 0;
     }
 
-    vRegs[dstReg] = vRegs[dstReg] - vRegs[srcReg];
+    state.vRegs[dstReg] = state.vRegs[dstReg] - state.vRegs[srcReg];
 }
 
 /* Opcode: 8XY7
@@ -357,173 +1409,221 @@ void Emulator::subSRegFromDReg(uint8_t srcReg, uint8_t dstReg){
  */
 void Emulator::subDRegFromSReg(uint8_t srcReg, uint8_t dstReg){
     // If the subtraction doesn't underflow, set carry flag to 1; otherwise, 0.
-    if (vRegs[srcReg] >= vRegs[dstReg]){
-        vRegs[0xF] = 1;
+    if (state.vRegs[srcReg] >= state.vRegs[dstReg]){
+        state.vRegs[0xF] = 1;
     } else{
-        vRegs[0xF] = 0;
+        state.vRegs[0xF] = 0;
     }
 
-    vRegs[dstReg] = vRegs[srcReg] - vRegs[dstReg];
+    state.vRegs[dstReg] = state.vRegs[srcReg] - state.vRegs[dstReg];
 }
 
 /* Opcode: 8XY6
- * Shifts the value in the specified register once to the right.
+ * Shifts the value in the destination register once to the right (or, on the COSMAC VIP, sets the destination register
+ * to the source register shifted right).
  * 
  * Sets the carry flag (vRegs[0xF]) to the value of the bit shifted out.
  */
-void Emulator::rightShift(uint8_t reg){
-    vRegs[0xF] = vRegs[reg] & 1;
-    vRegs[reg] >>= 1;
+template<class Quirks>
+void Emulator::rightShift(uint8_t srcReg, uint8_t dstReg){
+    uint8_t reg = Quirks::shiftsUseVY ? srcReg : dstReg;
+    state.vRegs[0xF] = state.vRegs[reg] & 1;
+    state.vRegs[dstReg] = state.vRegs[reg] >> 1;
 }
 
 /* Opcode: 8XYE
- * Shifts the value in the specified register once to the left.
+ * Shifts the value in the destination register once to the left (or, on the COSMAC VIP, sets the destination register
+ * to the source register shifted left).
  * 
  * Sets the carry flag (vRegs[0xF]) to the value of the bit shifted out.
  */
-void Emulator::leftShift(uint8_t reg){
-    vRegs[0xF] = (vRegs[reg] & 0x80) >> 7;
-    vRegs[reg] <<= 1;
+template<class Quirks>
+void Emulator::leftShift(uint8_t srcReg, uint8_t dstReg){
+    uint8_t reg = Quirks::shiftsUseVY ? srcReg : dstReg;
+    state.vRegs[0xF] = (state.vRegs[reg] & 0x80) >> 7;
+    state.vRegs[dstReg] = state.vRegs[reg] << 1;
 }
 
 /* Opcode: ANNN
  * Sets the index register to the specified address.
  */
 void Emulator::setIndex(uint16_t address){
-    indexRegister = address;
+    state.indexRegister = address;
 }
 
 /* Opcode: BNNN
- * Sets the programCounter to the specified address plus the value in the V0 register (vRegs[0x0]).
+ * Sets the programCounter to the specified address plus the value in the V0 register (vRegs[0x0]). On CHIP-48 and
+ * SUPER-CHIP the instruction is BXNN, and the register added is VX (the top nibble of the address).
  */
+template<class Quirks>
 void Emulator::jumpWithOffset(uint16_t address){
-    programCounter = address + vRegs[0x0];
-}
-
-/* Helper function for random.
- * Returns the random engine of the emulator to be used with other components of the <random> library.
- */
-std::default_random_engine& Emulator::getRNG(){
-    static std::default_random_engine u{};
-    return u;
+    state.programCounter = address + state.vRegs[Quirks::jumpUsesVX ? (address >> 8) & 0xF : 0x0];
 }
 
 /* Opcode: CXNN
  * Sets the value of the specified register to a random number between 0 and 255 binary ANDed with the passed bit mask.
+ * The generator is part of the machine state, so a given seed always produces the same sequence.
  */
 void Emulator::random(uint8_t reg, uint8_t bitMask){
-    std::uniform_int_distribution<int> dist(0,255);
-    vRegs[reg] = (uint8_t) dist(getRNG()) & bitMask;
+    state.vRegs[reg] = nextRandomByte(state.rngState) & bitMask;
 }
 
 /* Opcode: DXYN
  * Displays a sprite to the screen. The sprite is displayed at the (x,y) coordinate contained in xReg and yReg, respectively.
  * When calculating the (x,y) coordinate, the screen wraps -- the x value is modulo the screen width, and the y value is 
  * modulo the screen height. However, after the initial calculation, the sprites clip at the edge of the screen rather than
- * wrap.
+ * wrap (unless the quirk profile has them wrap).
  * 
  * Sprites are 8 bits wide, with the height specified by parameter. The address of the sprite data is stored in the index
  * register. Each byte represents a row of 8 pixels, starting from the top of the sprite.
  * 
- * Drawing a sprite is done bit by bit. If a bit is 0, the screen is not changed. If a bit is 1, the corresponding pixel is
- * flipped (turned on if it is off, and vice versa).
+ * If a bit is 0, the screen is not changed. If a bit is 1, the corresponding pixel is flipped (turned on if it is off,
+ * and vice versa). Since the framebuffer holds a row per word, each sprite row is drawn with a single XOR: the row's byte
+ * is shifted into position, and any bits shifted past the right edge of the screen fall off (which is the clipping).
  * 
  * The carry flag (vRegs[0xF]) is set to 0 if no pixels are turned off by the instruction. If a pixel is turned off, it is 
  * set to 1.
  */
+template<class Quirks>
 void Emulator::display(uint8_t xReg, uint8_t yReg, uint8_t height){
     // Get the x and y coordinate where the sprite will be drawn
-    uint8_t x = vRegs[xReg] % windowWidth;
-    uint8_t y = vRegs[yReg] % windowHeight;
-
-    // Set the carry flag to 0 initially
-    vRegs[0xF] = 0;
+    uint8_t x = state.vRegs[xReg] % windowWidth;
+    uint8_t y = state.vRegs[yReg] % windowHeight;
 
     // Loop over each row of the sprite, and draw row by row
-    SDL_Rect pixelRect;
-    for (uint8_t yOff = 0; (y + yOff) < windowHeight && yOff < height; ++yOff){
-        // Get the sprite data for the row
-        uint8_t spriteData = memory[indexRegister + yOff];
-
-        // Loop over each bit of the row
-        for (uint8_t xOff = 0; xOff < 8 && (x + xOff) < windowWidth; ++xOff){
-            // If the bit is 1, flip the pixel
-            if (spriteData >> (7 - xOff) & 1){
-                // If the bit is getting turned off, set the carry flag
-                if (pixels[x+xOff][y+yOff]){
-                    vRegs[0xF] = 1;
-                }
+    uint64_t collisions = 0;
+    for (uint8_t yOff = 0; (Quirks::spritesWrap || (y + yOff) < windowHeight) && yOff < height; ++yOff){
+        // Line the sprite data for the row up with the screen, clipping at the right edge (or rotating the bits that
+        // would fall off round to the left, to wrap)
+        uint64_t sprite = (uint64_t) state.memory[(state.indexRegister + yOff) & 0xFFF] << 56;
+        uint64_t spriteRow = Quirks::spritesWrap ? (sprite >> x) | (sprite << ((64 - x) & 63)) : sprite >> x;
+        uint8_t row = Quirks::spritesWrap ? (y + yOff) % windowHeight : y + yOff;
+
+        // Any pixels that are already on get turned off, which sets the carry flag
+        collisions |= state.framebuffer[row] & spriteRow;
+        state.framebuffer[row] ^= spriteRow;
+    }
+    state.vRegs[0xF] = collisions != 0;
 
-                // Flip the pixel
-                pixels[x+xOff][y+yOff] ^= 0xFF;
+    // The frontend shows the result at the end of the frame
+    framebufferChanged = true;
+}
 
-                // Actually draw the flipped pixel
-                pixelRect.x = ((uint16_t) (x+xOff))*pixelScale;
-                pixelRect.y = ((uint16_t) (y+yOff))*pixelScale;
-                pixelRect.w = pixelScale;
-                pixelRect.h = pixelScale;
-                uint8_t color = pixels[x+xOff][y+yOff]; // The pixel array doubles as color (0x00 for black, 0xFF for white)
-                SDL_FillRect(screenSurface, &pixelRect, SDL_MapRGB(screenSurface->format, color, color, color));
-            }
+/* Helper function for the key-related skip functions.
+ * Returns true if the key stored in the register is currently pressed.
+ */
+bool Emulator::isPressed(uint8_t reg){
+    return (keypad >> (state.vRegs[reg] & 0xF)) & 1;
+}
+
+/* Records a key (0x0 - 0xF) being pressed or released by the frontend.
+ * While the core runs on its own thread, the change is posted to it through the atomic key masks, to be applied before
+ * its next frame. Otherwise it is applied straight away.
+ */
+void Emulator::setKey(uint8_t key, bool pressed){
+    uint32_t number = inputsPosted.load(std::memory_order_relaxed) + 1;
+    if (!inputWaiting){
+        inputWaiting = true;
+        inputWaitingNumber = number;
+        inputWaitingSince = Clock::now();
+    }
+
+    if (threadRunning){
+        uint16_t bit = 1 << (key & 0xF);
+        if (pressed){
+            hostKeys.fetch_or(bit);
+            hostPresses.fetch_or(bit);
+        } else {
+            hostKeys.fetch_and(~bit);
+        }
+        inputsPosted.store(number, std::memory_order_release);
+    } else {
+        inputsPosted.store(number, std::memory_order_relaxed);
+        handleKey(key, pressed);
+        inputsTaken = number;
+    }
+}
+
+/* Applies the key changes the frontend has posted since the last frame (on the emulation thread). A key pressed and
+ * released again since then is pressed and released here too, so a short tap still reaches FX0A.
+ */
+void Emulator::takeHostKeys(){
+    uint32_t posted = inputsPosted.load(std::memory_order_acquire);
+    if (posted == inputsTaken){
+        return;
+    }
+    uint16_t presses = hostPresses.exchange(0);
+    uint16_t keys = hostKeys.load();
+    for (uint16_t tapped = presses & ~keys; tapped != 0; tapped &= tapped - 1){
+        uint8_t key = __builtin_ctz(tapped);
+        if (!((keypad >> key) & 1)){
+            handleKey(key, true);
         }
+        handleKey(key, false);
+    }
+    for (uint16_t changed = keys ^ keypad; changed != 0; changed &= changed - 1){
+        uint8_t key = __builtin_ctz(changed);
+        handleKey(key, (keys >> key) & 1);
     }
+    inputsTaken = posted;
+}
 
-    // Update the window after all of the new pixels are drawn
-    SDL_UpdateWindowSurface(window);
+/* Records and applies a key change. While a replay is running, the frontend's keys are ignored so they can't change the
+ * outcome.
+ */
+void Emulator::handleKey(uint8_t key, bool pressed){
+    if (inputReplay != NULL){
+        return;
+    }
+    if (inputRecording != NULL){
+        inputRecording->events.push_back({instExecuted, (uint8_t) (key & 0xF), pressed});
+    }
+    applyKey(key, pressed);
 }
 
-/* Helper function for the key-related skip functions.
- * Returns true if the scancode mapped to the key stored in the register is currently pressed.
+/* Sets every key at once from a mask (bit k for key k), as if each key that changed had been pressed or released.
  */
-bool Emulator::isPressed(uint8_t reg){
-    // Switch on the value in the specified register, return whether or not it is pressed
-    const uint8_t* currentKeyStates = SDL_GetKeyboardState(NULL);
-    switch (vRegs[reg] & 0xF){
-    case 0x0:
-        return (bool) currentKeyStates[SDL_SCANCODE_X];
-    case 0x1:
-        return (bool) currentKeyStates[SDL_SCANCODE_1];
-    case 0x2:
-        return (bool) currentKeyStates[SDL_SCANCODE_2];
-    case 0x3:
-        return (bool) currentKeyStates[SDL_SCANCODE_3];
-    case 0x4:
-        return (bool) currentKeyStates[SDL_SCANCODE_Q];
-    case 0x5:
-        return (bool) currentKeyStates[SDL_SCANCODE_W];
-    case 0x6:
-        return (bool) currentKeyStates[SDL_SCANCODE_E];
-    case 0x7:
-        return (bool) currentKeyStates[SDL_SCANCODE_A];
-    case 0x8:
-        return (bool) currentKeyStates[SDL_SCANCODE_S];
-    case 0x9:
-        return (bool) currentKeyStates[SDL_SCANCODE_D];
-    case 0xA:
-        return (bool) currentKeyStates[SDL_SCANCODE_Z];
-    case 0xB:
-        return (bool) currentKeyStates[SDL_SCANCODE_C];
-    case 0xC:
-        return (bool) currentKeyStates[SDL_SCANCODE_4];
-    case 0xD:
-        return (bool) currentKeyStates[SDL_SCANCODE_R];
-    case 0xE:
-        return (bool) currentKeyStates[SDL_SCANCODE_F];
-    case 0xF:
-        return (bool) currentKeyStates[SDL_SCANCODE_V];
-    
-    default:
-        return false;
+void Emulator::setKeypad(uint16_t keys){
+    uint16_t current = threadRunning ? hostKeys.load() : keypad;
+    for (uint16_t changed = keys ^ current; changed != 0; changed &= changed - 1){
+        uint8_t key = __builtin_ctz(changed);
+        setKey(key, (keys >> key) & 1);
     }
 }
 
-/* Opcode: EX93
+uint16_t Emulator::getKeypad() const {
+    return keypad;
+}
+
+/* Updates the key state. If the program is waiting on FX0A, a press also becomes the key it receives.
+ */
+void Emulator::applyKey(uint8_t key, bool pressed){
+    if (pressed){
+        keypad |= 1 << (key & 0xF);
+    } else {
+        keypad &= ~(1 << (key & 0xF));
+    }
+    if (pressed && state.awaitingKey){
+        state.keyPressed = key & 0xF;
+    }
+}
+
+void Emulator::recordInput(InputLog* log){
+    inputRecording = log;
+}
+
+void Emulator::replayInput(const InputLog* log){
+    inputReplay = log;
+    replayPosition = 0;
+}
+
+/* Opcode: EX9E
  * If the key contained in the specified register is pressed, skip the next instruction.
  * The key is a value between 0x0 and 0xF.
  */
 void Emulator::skipIfKey(uint8_t reg){
     if (isPressed(reg)){
-        programCounter += 2;
+        state.programCounter += 2;
     }
 }
 
@@ -533,7 +1633,7 @@ void Emulator::skipIfKey(uint8_t reg){
  */
 void Emulator::skipIfNotKey(uint8_t reg){
     if (!isPressed(reg)){
-        programCounter += 2;
+        state.programCounter += 2;
     }
 }
 
@@ -541,21 +1641,21 @@ void Emulator::skipIfNotKey(uint8_t reg){
  * Sets the specified register to the value of the delay timer.
  */
 void Emulator::setRegFromDTimer(uint8_t reg){
-    vRegs[reg] = delayTimer;
+    state.vRegs[reg] = state.delayTimer;
 }
 
 /* Opcode: FX15
  * Sets the delay timer to the value of the specified register.
  */
 void Emulator::setDTimerFromReg(uint8_t reg){
-    delayTimer = vRegs[reg];
+    state.delayTimer = state.vRegs[reg];
 }
 
 /* Opcode: FX18
  * Sets the sound timer to the value of the specified register.
  */
 void Emulator::setSTimerFromReg(uint8_t reg){
-    soundTimer = vRegs[reg];
+    state.soundTimer = state.vRegs[reg];
 }
 
 /* Opcode: FX1E
@@ -564,9 +1664,9 @@ void Emulator::setSTimerFromReg(uint8_t reg){
  * The carry flag (vRegs[0xF]) is set to 1 if the index register "overflows" (by exceeding the addressing range).
  */
 void Emulator::addToIndex(uint8_t reg){
-    indexRegister += vRegs[reg];
-    if (indexRegister >= 0x1000){
-        vRegs[0xF] = 1;
+    state.indexRegister += state.vRegs[reg];
+    if (state.indexRegister >= 0x1000){
+        state.vRegs[0xF] = 1;
     }
 }
 
@@ -576,24 +1676,24 @@ void Emulator::addToIndex(uint8_t reg){
 void Emulator::getKey(uint8_t reg){
     // If a key has been pressed, set register and increment program counter
     // If we aren't waiting for a key yet, set the awaitingKey flag
-    if (awaitingKey && keyPressed != 0xFF){
-        vRegs[reg] = keyPressed;
-        awaitingKey = false;
-        keyPressed = 0xFF;
-        programCounter += 2;
-    } else if (!awaitingKey) {
-        awaitingKey = true;
+    if (state.awaitingKey && state.keyPressed != 0xFF){
+        state.vRegs[reg] = state.keyPressed;
+        state.awaitingKey = false;
+        state.keyPressed = 0xFF;
+        state.programCounter += 2;
+    } else if (!state.awaitingKey) {
+        state.awaitingKey = true;
     }
 
     // Decrement programCounter to halt execution (the above conditional offsets this once a key is pressed)
-    programCounter -= 2;
+    state.programCounter -= 2;
 }
 
 /* Opcode: FX29
  * Sets the index register to the sprite for the character (0x0 - 0xF) contained in the specified register.
  */
 void Emulator::fontChar(uint8_t reg){
-    indexRegister = fontStart + 5*(vRegs[reg] & 0xF);
+    state.indexRegister = fontStart + 5*(state.vRegs[reg] & 0xF);
 }
 
 /* Opcode: FX33
@@ -601,177 +1701,563 @@ void Emulator::fontChar(uint8_t reg){
  * Each digit is stored in a byte in memory where the index register points (from most to least significant).
  */
 void Emulator::decimalConversion(uint8_t reg){
-    memory[indexRegister]     = (vRegs[reg] / 100) % 10;
-    memory[indexRegister + 1] = (vRegs[reg] /  10) % 10;
-    memory[indexRegister + 2] = (vRegs[reg] /   1) % 10;
+    // FX1E can take I past the end of memory, so the digits wrap round to the start (as sprite rows are read)
+    const uint8_t digits[3] = {(uint8_t) (state.vRegs[reg] / 100), (uint8_t) (state.vRegs[reg] / 10 % 10),
+                               (uint8_t) (state.vRegs[reg] % 10)};
+    for (int i = 0; i < 3; ++i){
+        uint16_t address = (state.indexRegister + i) & 0xFFF;
+        state.memory[address] = digits[i];
+        markWritten(address, 1);
+    }
 }
 
 /* Opcode: FX55
  * Stores all of the registers up to (and including) the specified register to memory pointed to by the index register.
+ * Whether the index register is moved on afterwards depends on the quirk profile.
  */
+template<class Quirks>
 void Emulator::storeRegToMem(uint8_t reg){
-    for (uint8_t i = 0; i <= reg && indexRegister + i < 0x1000; ++i){
-        memory[indexRegister + i] = vRegs[i];
+    for (uint8_t i = 0; i <= reg && state.indexRegister + i < 0x1000; ++i){
+        state.memory[state.indexRegister + i] = state.vRegs[i];
     }
+    markWritten(state.indexRegister, reg + 1);
+    advanceIndex<Quirks>(reg);
 }
 
 /* Opcode: FX65
  * Loads all of the registers up to (and including) the specified register from memory pointed to by the index register.
+ * Whether the index register is moved on afterwards depends on the quirk profile.
  */
+template<class Quirks>
 void Emulator::loadRegFromMem(uint8_t reg){
-    for (uint8_t i = 0; i <= reg && indexRegister + i < 0x1000; ++i){
-        vRegs[i] = memory[indexRegister + i];
+    for (uint8_t i = 0; i <= reg && state.indexRegister + i < 0x1000; ++i){
+        state.vRegs[i] = state.memory[state.indexRegister + i];
+    }
+    advanceIndex<Quirks>(reg);
+}
+
+/* Moves the index register on after FX55/FX65, as the quirk profile says.
+ */
+template<class Quirks>
+void Emulator::advanceIndex(uint8_t reg){
+    if (Quirks::indexAfterMemory == IndexAfterMemory::PlusX){
+        state.indexRegister += reg;
+    } else if (Quirks::indexAfterMemory == IndexAfterMemory::PlusXPlusOne){
+        state.indexRegister += reg + 1;
     }
 }
 
-/* Loads the program contained in the filestream into memory.
+/* Loads the program file into memory.
  * By convention, the program is loaded to location 0x200.
  */
-void Emulator::loadProgram(std::ifstream &filestream){
-    auto size = filestream.tellg();
-    filestream.seekg(0);
-    if (!filestream.read((char*) &memory[0x200], size)){
-        printf("Error reading from filestream into memory array!\n");
+bool Emulator::loadProgram(const char* path, QuirkProfile profile){
+    std::shared_ptr<const RomImage> rom = RomImage::load(path);
+    if (!rom){
+        return false;
+    }
+    loadProgram(*rom, profile);
+    return true;
+}
+
+/* Copies the program into memory at 0x200. Only the program's own bytes are copied: the rest of memory (the font and
+ * the zeroes around it) is already in place from construction.
+ */
+void Emulator::loadProgram(const RomImage &rom, QuirkProfile profile){
+    std::copy(rom.data(), rom.data() + rom.size(), state.memory + 0x200);
+    quirks = profile;
+    flushBlocks();
+    if (aot){
+        aotValidPages = aot->validPages(state.memory);
+    }
+
+    // Rewinding stops at the start of the program
+    if (rewindBuffer){
+        rewindBuffer->clear();
+        rewindBuffer->capture(state);
+    }
+}
+
+/* Fetches and executes the instruction pointed to by the program counter.
+ */
+void Emulator::step() {
+    fetch();
+    decodeWithQuirks();
+    ++instExecuted;
+}
+
+/* Decrements the delay and sound timers if they are above 0.
+ */
+void Emulator::tickTimers() {
+    if (state.delayTimer > 0){
+        --state.delayTimer;
+    }
+    if (state.soundTimer > 0){
+        --state.soundTimer;
+    }
+}
+
+/* Executes one emulated 60 Hz frame.
+ * The instructions for the frame are run back to back, then the timers are decremented. Because the timers are
+ * driven by frames rather than the wall clock, they stay consistent with the instructions executed at any speed.
+ */
+void Emulator::runFrame() {
+    // Replayed keys change at the same point in emulated time as they did when recorded (always between frames)
+    if (inputReplay != NULL){
+        const std::vector<InputEvent> &events = inputReplay->events;
+        for (; replayPosition < events.size() && events[replayPosition].cycle <= instExecuted; ++replayPosition){
+            applyKey(events[replayPosition].key, events[replayPosition].pressed);
+        }
+    }
+
+    // instPerSecond usually isn't a multiple of 60, so carry the remainder over to later frames
+    instRemainder += instPerSecond;
+    int instructions = instRemainder / 60;
+    instRemainder %= 60;
+
+    int done = skipIdle(instructions);
+    execute(instructions - done);
+    instExecuted += instructions;
+
+    // The beep sounds through every frame that ends with the sound timer above zero
+    if (beeper){
+        playFrameAudio(state.soundTimer > 0);
+    }
+    tickTimers();
+    ++frameCount;
+
+    if (rewindBuffer){
+        rewindBuffer->capture(state);
+    }
+}
+
+/* Looks for an idle loop at the program counter at the start of a frame, and fast-forwards through it. Returns how
+ * many of the frame's instructions were used up, either run (while probing for a loop) or skipped.
+ *
+ * Nothing the program waits on can change partway through a frame: keys change and timers tick only between frames.
+ * So an FX0A wait or a jump to itself would run unchanged to the end of the frame, and so would a short loop if one
+ * pass round it leaves the registers as they were (e.g. FX07, 3XNN, 1NNN waiting on the delay timer). Those passes
+ * are skipped, which is exact: whole passes only, so the program counter ends up where running them would leave it.
+ * Loops that draw, write memory, call or use the random generator are never skipped.
+ */
+int Emulator::skipIdle(int instructions) {
+    frameIdle = false;
+    if (!idleSkipping || profile || instructions == 0){
+        // A profile should show the time spent waiting
+        return 0;
+    }
+
+    uint16_t start = state.programCounter;
+    if (start > 0xFFE){
+        return 0;
+    }
+    uint16_t first = ((uint16_t) state.memory[start] << 8) + state.memory[start + 1];
+    if (first == (0x1000 | start) || (state.awaitingKey && state.keyPressed == 0xFF && opTable()[first] == Op::GetKey)){
+        frameIdle = true;
+        instSkipped += instructions;
+        return instructions;
+    }
+
+    // Probing for a loop costs up to two passes round it, which only pays off if the frame is long enough to skip
+    // several more (at the default 700 instructions per second, frames are too short to bother)
+    if (instructions < 4 * maxIdleLoop){
+        return 0;
+    }
+
+    // Run two passes round the loop on the reference core, the first of which may still be settling registers (e.g.
+    // loading the timer into one). If the second leaves them as the first did, every later pass will too. The
+    // instructions allowed in the loop only change the registers, so if it isn't an idle loop after all, the passes
+    // are undone and left to the core.
+    uint8_t vRegs [16];
+    std::copy(state.vRegs, state.vRegs + 16, vRegs);
+    uint16_t indexRegister = state.indexRegister;
+
+    int lengths [2];
+    uint8_t settled [16];
+    uint16_t settledIndex = 0;
+    for (int pass = 0; pass < 2; ++pass){
+        std::copy(state.vRegs, state.vRegs + 16, settled);
+        settledIndex = state.indexRegister;
+
+        lengths[pass] = 0;
+        do {
+            uint16_t pc = state.programCounter;
+            bool allowed = lengths[pass] < maxIdleLoop && pc <= 0xFFE;
+            if (allowed){
+                switch (opTable()[((uint16_t) state.memory[pc] << 8) + state.memory[pc + 1]]){
+                case Op::ClearScreen: case Op::Ret: case Op::Call: case Op::Random: case Op::Display: case Op::GetKey:
+                case Op::SetDTimerFromReg: case Op::SetSTimerFromReg: case Op::DecimalConversion: case Op::StoreRegToMem:
+                    allowed = false;
+                    break;
+                default:
+                    break;
+                }
+            }
+            if (!allowed){
+                std::copy(vRegs, vRegs + 16, state.vRegs);
+                state.indexRegister = indexRegister;
+                state.programCounter = start;
+                return 0;
+            }
+            fetch();
+            decodeWithQuirks();
+            ++lengths[pass];
+        } while (state.programCounter != start);
+    }
+
+    // The state after the second pass is the state after the first, so the second (and any further ones that fit) can
+    // be skipped, with the rest of the frame left to the core
+    bool idle = std::equal(settled, settled + 16, state.vRegs) && settledIndex == state.indexRegister;
+    if (!idle || lengths[0] > instructions){
+        std::copy(vRegs, vRegs + 16, state.vRegs);
+        state.indexRegister = indexRegister;
+        state.programCounter = start;
+        return 0;
+    }
+    int skipped = (instructions - lengths[0]) / lengths[1] * lengths[1];
+    frameIdle = lengths[0] + skipped == instructions;
+    instSkipped += skipped;
+    return lengths[0] + skipped;
+}
+
+void Emulator::setIdleSkipping(bool enabled) {
+    idleSkipping = enabled;
+}
+
+uint64_t Emulator::getInstSkipped() const {
+    return instSkipped;
+}
+
+/* Seeds the random number generator. Each emulator has its own generator, so seeded runs are reproducible even when
+ * many emulators run on different threads.
+ */
+void Emulator::setSeed(uint32_t seed) {
+    state.rngState = seedRandom(seed);
+}
+
+/* Returns a 64-bit FNV-1a hash of the framebuffer, to compare final screens without storing them.
+ */
+uint64_t Emulator::framebufferHash() const {
+    uint64_t hash = 0xCBF29CE484222325ULL;
+    for (int row = 0; row < windowHeight; ++row){
+        for (int byte = 7; byte >= 0; --byte){
+            hash ^= (state.framebuffer[row] >> (byte * 8)) & 0xFF;
+            hash *= 0x100000001B3ULL;
+        }
+    }
+    return hash;
+}
+
+/* Changes the variant without loading a program (for machines set up with loadState). Cached blocks are dropped, since
+ * they were decoded for the old one.
+ */
+void Emulator::setQuirks(QuirkProfile profile) {
+    quirks = profile;
+    flushBlocks();
+}
+
+QuirkProfile Emulator::getQuirks() const {
+    return quirks;
+}
+
+uint64_t Emulator::getInstExecuted() const {
+    return instExecuted;
+}
+
+uint64_t Emulator::getFrameCount() const {
+    return frameCount;
+}
+
+uint16_t Emulator::getProgramCounter() const {
+    return state.programCounter;
+}
+
+uint16_t Emulator::getIndexRegister() const {
+    return state.indexRegister;
+}
+
+const uint8_t* Emulator::getRegisters() const {
+    return state.vRegs;
+}
+
+const uint64_t* Emulator::getFramebuffer() const {
+    return state.framebuffer;
+}
+
+const uint8_t* Emulator::getMemory() const {
+    return state.memory;
+}
+
+/* Sets the number of instructions executed per emulated second.
+ */
+void Emulator::setInstPerSecond(int rate) {
+    instPerSecond = std::max(rate, 1);
+}
+
+/* Sets how many times faster than real time frames are run (ignored in turbo mode).
+ */
+void Emulator::setSpeed(double multiplier) {
+    if (multiplier > 0){
+        speed = multiplier;
     }
 }
 
+/* Enables or disables turbo mode, where frames are run as fast as the host allows.
+ */
+void Emulator::setTurbo(bool enabled) {
+    turbo = enabled;
+}
+
+/* Sets the number of frames start() runs before returning (0 runs until the frontend quits).
+ */
+void Emulator::setFrameLimit(uint64_t frames) {
+    frameLimit = frames;
+}
+
+void Emulator::setAudio(int sampleRate) {
+    beeper.reset(sampleRate > 0 ? new Beeper(sampleRate) : NULL);
+}
+
+/* Generates the samples for a frame and passes them on to the frontend.
+ */
+void Emulator::playFrameAudio(bool soundOn) {
+    const std::vector<int16_t> &samples = beeper->frame(soundOn);
+    frontend->playAudio(samples.data(), samples.size());
+}
+
+/* Runs the core on its own thread in start() (or not).
+ */
+void Emulator::setEmulationThread(bool enabled) {
+    emulationThread = enabled;
+}
+
 /* The main emulation loop.
- * Creates the display, sets the program counter to 0x200, and begins execution of whatever program is loaded into memory.
+ * Initializes the frontend and begins execution of whatever program is loaded into memory, one frame at a time, until
+ * the frontend quits or the frame limit is reached. Then prints a summary of the session.
+ *
+ * Frames are started every 1/60th of a second (divided by the speed multiplier), or back to back in turbo mode.
+ * Deadlines are advanced by a fixed period rather than measured from when the frame actually started, so oversleeping on
+ * one frame is made up on the next instead of accumulating as drift. If the host falls far behind (e.g. the process was
+ * suspended) the schedule is reset rather than running a burst of catch-up frames.
+ *
+ * Rendering is kept off the instruction path: the framebuffer is handed to the frontend once at the end of each frame,
+ * and only if something was drawn. In turbo mode that is further limited to 60 times per (real) second.
  */
 void Emulator::start() {
-    // Attempt to initialize SDL window, setting the window and screenSurface vars
-    if (SDL_Init(SDL_INIT_VIDEO) < 0) {
-        printf("SDL could not initialize! SDL_Error: %s\n", SDL_GetError());
+    if (!frontend->init(windowWidth, windowHeight)) {
         return;
+    }
+
+    uint64_t startInst = instExecuted;
+    uint64_t startFrames = frameCount;
+    uint64_t startSkipped = instSkipped;
+    auto time_start = Clock::now();
+    std::clock_t cpu_start = std::clock();
+
+    SessionStats stats;
+    if (emulationThread){
+        runSessionThreaded(stats);
     } else {
-        window = SDL_CreateWindow("CHIP-8 Emulator", SDL_WINDOWPOS_UNDEFINED, SDL_WINDOWPOS_UNDEFINED, windowWidth*pixelScale, windowHeight*pixelScale, SDL_WINDOW_SHOWN);
-        if (window == NULL) {
-            printf("Window could not be created! SDL_Error: %s\n", SDL_GetError());
-            return;
-        } else {
-            //Get window surface
-            screenSurface = SDL_GetWindowSurface(window);
-        }
+        runSession(stats);
     }
 
-    // Set programCounter to the start of the program
-    programCounter = 0x200;
+    // TODO: lock debug messages behind a flag
+    // Print some info about the execution (mostly for debug purposes)
+    double totalTime = std::chrono::duration<double>(Clock::now() - time_start).count();
+    double cpuTime = (double) (std::clock() - cpu_start) / CLOCKS_PER_SEC;
+    uint64_t inst = instExecuted - startInst;
+    uint64_t frames = frameCount - startFrames;
+
+    printf("Instructions executed: %lu\n", (unsigned long) inst);
+    printf("Instructions fast-forwarded in idle loops: %lu (%.1f%%)\n", (unsigned long) (instSkipped - startSkipped),
+           inst > 0 ? 100.0 * (instSkipped - startSkipped) / inst : 0.0);
+    printf("Frames (timer decrements): %lu\n", (unsigned long) frames);
+    printf("Total time: %f seconds\n", totalTime);
+    printf("Instructions per second: %f\n", ((double) inst)/totalTime);
+    printf("Frames per second: %f\n", ((double) frames)/totalTime);
+    printf("Frames presented: %lu\n", (unsigned long) stats.presents);
+    if (emulationThread){
+        printf("Frames drawn on the emulation thread: %lu (%lu replaced before they could be presented)\n",
+               (unsigned long) stats.published,
+               (unsigned long) (stats.published > stats.presents ? stats.published - stats.presents : 0));
+    }
+    printf("Host CPU usage: %.1f%% (%f seconds)\n", 100.0*cpuTime/totalTime, cpuTime);
+    if (rewindBuffer){
+        printf("Rewind history: %lu frames in %lu KB\n", (unsigned long) rewindBuffer->frames(),
+               (unsigned long) (rewindBuffer->bytesUsed() / 1024));
+    }
+    if (stats.pacedFrames > 0){
+        printf("Frame jitter: %.3f ms mean, %.3f ms max\n", stats.jitterTotal/stats.pacedFrames, stats.jitterMax);
+    }
+    if (stats.latencySamples > 0){
+        printf("Input latency (key event to present): %.3f ms mean, %.3f ms max over %lu key events\n",
+               stats.latencyTotal/stats.latencySamples, stats.latencyMax, (unsigned long) stats.latencySamples);
+    }
+    frontend->finishSession(stdout);
+}
 
-    // Set up some vars for the loop
+/* Runs the session on this thread: between frames the thread sleeps in the frontend until the next deadline, waking
+ * early only to handle input, and presents at the end of each frame.
+ */
+void Emulator::runSession(SessionStats &stats) {
     bool quit = false;
-    SDL_Event e;
-    uint32_t instExecuted = 0;
-    uint32_t timerDecrements = 0;
-    
-    // Set up all time vars for the loop
-    typedef std::chrono::high_resolution_clock Clock;
-    auto last_inst_time = Clock::now();
-    auto last_timer_decrement = Clock::now();
-    auto time_start = Clock::now();
+    uint64_t startFrames = frameCount;
 
-    while (!quit) {
-        // Process any SDL events
-        while (SDL_PollEvent(&e) != 0){
-            switch (e.type){
-            case SDL_QUIT:
-                // End the loop
-                quit = true;
-                break;
-            case SDL_KEYDOWN:
-                // If not waiting for a key, ignore keypress
-                if (!awaitingKey){
-                    break;
-                }
+    auto framePeriod = std::chrono::duration_cast<Clock::duration>(std::chrono::duration<double>(1.0 / (60.0 * speed)));
+    auto maxLag = framePeriod * 4;
+    auto presentPeriod = std::chrono::duration_cast<Clock::duration>(std::chrono::duration<double>(1.0 / 60.0));
+    auto lastPresent = Clock::now() - presentPeriod;
+    auto nextFrame = Clock::now();
 
-                // If waiting for a key, set the keyPressed variable
-                switch (((SDL_KeyboardEvent*) &e)->keysym.scancode){
-                case SDL_SCANCODE_X:
-                    keyPressed = 0x0;
-                    break;
-                case SDL_SCANCODE_1:
-                    keyPressed = 0x1;
-                    break;
-                case SDL_SCANCODE_2:
-                    keyPressed = 0x2;
-                    break;
-                case SDL_SCANCODE_3:
-                    keyPressed = 0x3;
-                    break;
-                case SDL_SCANCODE_Q:
-                    keyPressed = 0x4;
-                    break;
-                case SDL_SCANCODE_W:
-                    keyPressed = 0x5;
-                    break;
-                case SDL_SCANCODE_E:
-                    keyPressed = 0x6;
-                    break;
-                case SDL_SCANCODE_A:
-                    keyPressed = 0x7;
-                    break;
-                case SDL_SCANCODE_S:
-                    keyPressed = 0x8;
-                    break;
-                case SDL_SCANCODE_D:
-                    keyPressed = 0x9;
-                    break;
-                case SDL_SCANCODE_Z:
-                    keyPressed = 0xA;
-                    break;
-                case SDL_SCANCODE_C:
-                    keyPressed = 0xB;
-                    break;
-                case SDL_SCANCODE_4:
-                    keyPressed = 0xC;
-                    break;
-                case SDL_SCANCODE_R:
-                    keyPressed = 0xD;
-                    break;
-                case SDL_SCANCODE_F:
-                    keyPressed = 0xE;
-                    break;
-                case SDL_SCANCODE_V:
-                    keyPressed = 0xF;
-                    break;
-                
-                default:
-                    break;
+    while (!quit && (frameLimit == 0 || frameCount - startFrames < frameLimit)) {
+        if (turbo){
+            quit = !frontend->processEvents(*this);
+        } else {
+            // Sleep until the next frame is due, handling input events as they arrive
+            auto now = Clock::now();
+            while (!quit && now < nextFrame){
+                auto waitMs = std::chrono::duration_cast<std::chrono::milliseconds>(nextFrame - now).count();
+                if (waitMs > 0){
+                    quit = !frontend->waitEvents(*this, (uint32_t) waitMs);
+                } else {
+                    // Less than a millisecond left, which is finer than the frontend can wait
+                    std::this_thread::sleep_until(nextFrame);
+                    quit = !frontend->processEvents(*this);
                 }
+                now = Clock::now();
+            }
+            if (quit){
                 break;
+            }
 
-            default:
-                break;
+            // Frame jitter: how late each paced frame started relative to its deadline
+            double late = std::chrono::duration<double, std::milli>(now - nextFrame).count();
+            stats.jitterTotal += late;
+            stats.jitterMax = std::max(stats.jitterMax, late);
+            ++stats.pacedFrames;
+
+            nextFrame += framePeriod;
+            if (now - nextFrame > maxLag){
+                nextFrame = now;
             }
         }
 
-        // If enough time has passed, process another instruction
-        if ((Clock::now() - last_inst_time) >= (std::chrono::nanoseconds(1000000000) / instPerSecond)){
-            last_inst_time += (std::chrono::nanoseconds(1000000000) / instPerSecond);
-            fetch();
-            decode();
-            ++instExecuted;
+        // While the rewind key is held, frames play backwards out of the history instead
+        if (rewinding && rewindBuffer){
+            stepBack();
+        } else {
+            runFrame();
         }
 
-        // If enough time has passed, decrement the timers as needed
-        if ((Clock::now() - last_timer_decrement) >= (std::chrono::nanoseconds(1000000000) / 60)){
-            last_timer_decrement += (std::chrono::nanoseconds(1000000000) / 60);
-            if (delayTimer > 0){
-                --delayTimer;
-            }
-            if (soundTimer > 0){
-                --soundTimer;
+        // A frame spent entirely waiting cost next to nothing, so give other threads a turn before racing ahead
+        if (turbo && frameIdle){
+            std::this_thread::yield();
+        }
+
+        if (framebufferChanged){
+            auto now = Clock::now();
+            if (!turbo || now - lastPresent >= presentPeriod){
+                frontend->present(state.framebuffer);
+                notePresented(inputsTaken, stats);
+                framebufferChanged = false;
+                lastPresent = now;
             }
-            ++timerDecrements;
         }
     }
+}
 
-    // TODO: lock debug messages behind a flag
-    // Print some info about the execution (mostly for debug purposes)
-    double totalTime = (Clock::now() - time_start) / (std::chrono::nanoseconds(1000000000));
+/* Runs the session with the core on a thread of its own, and this thread left to the frontend: it handles events
+ * (posting key changes to the core) and presents the newest frame the core has published, without either side ever
+ * waiting for the other. So a slow present or a stall in the window system doesn't hold up instructions or timers.
+ */
+void Emulator::runSessionThreaded(SessionStats &stats) {
+    std::atomic<bool> quit{false};
+    hostKeys = keypad;
+    hostPresses = 0;
+    threadRunning = true;
+    std::thread core(&Emulator::emulationLoop, this, std::ref(stats), std::ref(quit));
+
+    auto presentPeriod = std::chrono::duration_cast<Clock::duration>(std::chrono::duration<double>(1.0 / 60.0));
+    auto lastPresent = Clock::now() - presentPeriod;
+    while (!quit){
+        // Sleep briefly (the core publishes up to 60 frames a second, or more in turbo mode), handling input as it comes
+        if (!frontend->waitEvents(*this, 1)){
+            quit = true;
+        }
+        auto now = Clock::now();
+        if ((!turbo || now - lastPresent >= presentPeriod) && publishedFrames.consume()){
+            const PublishedFrame &frame = publishedFrames.readSlot();
+            frontend->present(frame.framebuffer);
+            notePresented(frame.inputsTaken, stats);
+            lastPresent = now;
+        }
+    }
 
-    printf("Instructions executed: %d\n", instExecuted);
-    printf("Timer decrements: %d\n", timerDecrements);
-    printf("Total time: %f seconds\n", totalTime);
-    printf("Instructions per second: %f\n", ((double) instExecuted)/totalTime);
-    printf("Timer decrements per second: %f\n", ((double) timerDecrements)/totalTime);
+    core.join();
+    threadRunning = false;
+
+    // Show the last frame the core drew, if the loop ended before presenting it
+    if (publishedFrames.consume()){
+        const PublishedFrame &frame = publishedFrames.readSlot();
+        frontend->present(frame.framebuffer);
+        notePresented(frame.inputsTaken, stats);
+    }
+}
+
+/* The emulation thread: runs frames on their deadlines (sleeping in between) until the frame limit is reached or quit
+ * is set, applying the frontend's key changes before each frame and publishing each frame that drew something.
+ */
+void Emulator::emulationLoop(SessionStats &stats, std::atomic<bool> &quit) {
+    uint64_t startFrames = frameCount;
+    auto framePeriod = std::chrono::duration_cast<Clock::duration>(std::chrono::duration<double>(1.0 / (60.0 * speed)));
+    auto maxLag = framePeriod * 4;
+    auto nextFrame = Clock::now();
+
+    while (!quit && (frameLimit == 0 || frameCount - startFrames < frameLimit)) {
+        if (!turbo){
+            std::this_thread::sleep_until(nextFrame);
+            auto now = Clock::now();
+            double late = std::chrono::duration<double, std::milli>(now - nextFrame).count();
+            stats.jitterTotal += late;
+            stats.jitterMax = std::max(stats.jitterMax, late);
+            ++stats.pacedFrames;
+
+            nextFrame += framePeriod;
+            if (now - nextFrame > maxLag){
+                nextFrame = now;
+            }
+        }
+
+        takeHostKeys();
+        if (rewinding && rewindBuffer){
+            stepBack();
+        } else {
+            runFrame();
+        }
+        if (turbo && frameIdle){
+            std::this_thread::yield();
+        }
+
+        if (framebufferChanged){
+            PublishedFrame &frame = publishedFrames.writeSlot();
+            std::copy(state.framebuffer, state.framebuffer + 32, frame.framebuffer);
+            frame.inputsTaken = inputsTaken;
+            publishedFrames.publish();
+            framebufferChanged = false;
+            ++stats.published;
+        }
+    }
+    quit = true;
+}
+
+/* Counts a present, and if it shows the oldest key event not yet shown, how long that took.
+ */
+void Emulator::notePresented(uint32_t inputsShown, SessionStats &stats) {
+    ++stats.presents;
+    if (inputWaiting && (int32_t) (inputsShown - inputWaitingNumber) >= 0){
+        double latency = std::chrono::duration<double, std::milli>(Clock::now() - inputWaitingSince).count();
+        stats.latencyTotal += latency;
+        stats.latencyMax = std::max(stats.latencyMax, latency);
+        ++stats.latencySamples;
+        inputWaiting = false;
+    }
 }
@@ -1,109 +1,403 @@
-#pragma once
-
-#include <cstdint>
-#include <fstream>
-#include <random>
-#include <SDL2/SDL.h>
-#include <stdio.h>
-#include <vector>
-
-class Emulator {
-    private:
-        // Debug flag
-        bool debug = false;
-
-        // Instruction rate
-        int instPerSecond = 700;
-
-        // Memory
-        uint8_t memory [4096];
-        uint16_t fontStart = 0x50;
-
-        // Display and SDL
-        uint8_t pixels [64][32]; //Column major, such that access is pixels[x][y]
-        SDL_Window* window = NULL;
-        SDL_Surface* screenSurface = NULL;
-        const uint8_t windowWidth  = 64;
-        const uint8_t windowHeight = 32;
-        uint16_t pixelScale = 16;
-
-        // Address-related vars
-        uint16_t programCounter;
-        uint16_t indexRegister;
-        std::vector<uint16_t> addressStack;
-
-        // Timers
-        uint8_t delayTimer;
-        uint8_t soundTimer;
-
-        // General purpose registers
-        uint8_t vRegs [16];
-
-        // Key press vars
-        bool awaitingKey = false;
-        uint8_t keyPressed = 0xFF;
-
-        // Instruction processing
-        uint16_t instruction;
-        void fetch();
-        void decode();
-
-        // Instructions (and helpers)
-        void clearScreen();                                         //00E0
-        void ret();                                                 //00EE
-        void jump(uint16_t address);                                //1NNN
-        void call(uint16_t address);                                //2NNN
-        void skipRegEqVal(uint8_t reg, uint8_t value);              //3XNN
-        void skipRegNeqVal(uint8_t reg, uint8_t value);             //4XNN
-        void skipRegEqReg(uint8_t reg1, uint8_t reg2);              //5XY0
-        void setRegToVal(uint8_t value, uint8_t dstReg);            //6XNN
-        void addValToReg(uint8_t value, uint8_t dstReg);            //7XNN
-
-        void setRegToReg(uint8_t srcReg, uint8_t dstReg);           //8XY0
-        void orRegToReg(uint8_t srcReg, uint8_t dstReg);            //8XY1
-        void andRegToReg(uint8_t srcReg, uint8_t dstReg);           //8XY2
-        void xorRegToReg(uint8_t srcReg, uint8_t dstReg);           //8XY3
-        void addRegToReg(uint8_t srcReg, uint8_t dstReg);           //8XY4
-        void subSRegFromDReg(uint8_t srcReg, uint8_t dstReg);       //8XY5
-        void rightShift(uint8_t reg);                               //8XY6
-        void subDRegFromSReg(uint8_t srcReg, uint8_t dstReg);       //8XY7
-        void leftShift(uint8_t reg);                                //8XYE
-
-        void skipRegNeqReg(uint8_t reg1, uint8_t reg2);             //9XY0
-        void setIndex(uint16_t address);                            //ANNN
-        void jumpWithOffset(uint16_t address);                      //BNNN
-
-        // TODO: Figure out if this random implementation is actually good...
-        std::default_random_engine& getRNG();
-        void random(uint8_t reg, uint8_t bitMask);                  //CXNN
-
-        void display(uint8_t xReg, uint8_t yReg, uint8_t height);   //DXYN
-
-        bool isPressed(uint8_t reg);
-        void skipIfKey(uint8_t reg);                                //EX93
-        void skipIfNotKey(uint8_t reg);                             //EXA1
-
-        void setRegFromDTimer(uint8_t reg);                         //FX07
-        void getKey(uint8_t reg);                                   //FX0A
-        void setDTimerFromReg(uint8_t reg);                         //FX15
-        void setSTimerFromReg(uint8_t reg);                         //FX18
-        void addToIndex(uint8_t reg);                               //FX1E
-        void fontChar(uint8_t reg);                                 //FX29
-        void decimalConversion(uint8_t reg);                        //FX33
-        void storeRegToMem(uint8_t reg);                            //FX55
-        void loadRegFromMem(uint8_t reg);                           //FX65
-
-
-
-    public:
-        // Constructor and destructor
-        Emulator();
-        ~Emulator();
-
-        // TODO: Probably change this to a string, filestream reference passing feels weird
-        // Load program into memory
-        void loadProgram(std::ifstream &filestream);
-
-        // Main loop function
-        void start();
-};
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <memory>
+#include <stdio.h>
+#include <string>
+#include <vector>
+
+#include "aot.h"
+#include "beeper.h"
+#include "frontend.h"
+#include "input_log.h"
+#include "jit.h"
+#include "machine_state.h"
+#include "quirks.h"
+#include "rewind.h"
+#include "rom_image.h"
+#include "triple_buffer.h"
+
+// Interpreter dispatch cores. They all execute the same handlers, and differ only in how an instruction finds its handler.
+// Switch, Table and Threaded are specialized for every quirk profile; the others only implement the modern quirks, and
+// run programs loaded with another profile on Threaded.
+enum class Core {
+    Switch,     // Nested switch over the nibbles (decode), the reference implementation
+    Table,      // 64K-entry table mapping every instruction straight to its handler
+    Threaded,   // Computed-goto threaded interpreter (falls back to Switch on compilers without labels as values)
+    Blocks,     // Cache of pre-decoded basic blocks, so hot code is only fetched and decoded once
+    Jit,        // Blocks, with hot blocks recompiled to native x86-64 code (falls back to Blocks elsewhere)
+    Aot         // Code recompiled ahead of time by chip8_aot and loaded with loadRecompiled (falls back to Switch)
+};
+
+class Emulator {
+    // Decode through opTable(), so lanes and recompiled code agree with the Emulator on what every instruction does
+    friend class SimdEngine;
+    friend class Recompiler;
+
+    private:
+        // Debug flag
+        bool debug = false;
+
+        // Scheduling: instructions are executed in batches of instPerSecond/60 per emulated 60 Hz frame
+        int instPerSecond = 700;
+        int instRemainder = 0;          // Carries the fractional part of instPerSecond/60 between frames
+        double speed = 1.0;             // Real-time speed multiplier (2.0 runs 120 frames per second)
+        bool turbo = false;             // Run frames back to back, without waiting for real time
+        uint64_t frameLimit = 0;        // Stop after this many frames (0 for no limit)
+
+        // Emulated time so far
+        uint64_t instExecuted = 0;
+        uint64_t frameCount = 0;
+
+        // Idle loops (FX0A waits, jumps to self, and short loops polling the timers or keys) are fast-forwarded: the
+        // iterations they would spend in the rest of the frame are counted as executed without running them.
+        static const int maxIdleLoop = 16;  // Longest loop (in instructions) that is recognized
+        bool idleSkipping = true;
+        bool frameIdle = false;             // Whether the last frame was idle from start to end
+        uint64_t instSkipped = 0;           // Instructions fast-forwarded so far
+        int skipIdle(int instructions);
+
+        // Architectural state: memory, registers, stack, timers and display, in one block that can be saved with memcpy
+        MachineState state;
+        uint16_t fontStart = fontAddress;
+
+        // Variant whose behaviour the differing instructions follow (chosen when the program is loaded)
+        QuirkProfile quirks = QuirkProfile::Modern;
+
+        // Display
+        bool framebufferChanged = false; // Set by 00E0/DXYN, cleared when the frame is presented
+        const uint8_t windowWidth  = 64;
+        const uint8_t windowHeight = 32;
+
+        // Where the framebuffer is shown and key presses come from (not owned by the emulator)
+        Frontend* frontend;
+
+        // Keys currently held down, bit k for key k (host input rather than machine state)
+        uint16_t keypad = 0;
+
+        // Input recording and replay (the logs are not owned by the emulator)
+        InputLog* inputRecording = NULL;
+        const InputLog* inputReplay = NULL;
+        size_t replayPosition = 0;      // Next event of inputReplay to apply
+        void applyKey(uint8_t key, bool pressed);
+
+        // Sound: each frame's sound timer turned into samples for the frontend (NULL while audio is off)
+        std::unique_ptr<Beeper> beeper;
+        void playFrameAudio(bool soundOn);
+
+        // Per-frame history of the state for rewinding (NULL when rewinding is off)
+        std::unique_ptr<RewindBuffer> rewindBuffer;
+        std::atomic<bool> rewinding{false};     // Set while the frontend's rewind key is held
+
+        // Running the core on its own thread (see start). Finished frames go to the frontend's thread through a triple
+        // buffer, and key changes come back through atomic masks that the emulation thread applies between frames.
+        struct PublishedFrame {
+            uint64_t framebuffer [32];
+            uint32_t inputsTaken;       // Key events that had been applied when the frame was drawn
+        };
+        bool emulationThread = false;
+        bool threadRunning = false;                 // Set (by the frontend's thread) while the emulation thread runs
+        std::atomic<uint16_t> hostKeys{0};          // Keys held, as last reported by the frontend
+        std::atomic<uint16_t> hostPresses{0};       // Keys pressed since the last frame (so taps within a frame count)
+        TripleBuffer<PublishedFrame> publishedFrames;
+        void takeHostKeys();
+        void handleKey(uint8_t key, bool pressed);
+
+        // Input-to-photon latency: from a key event reaching the emulator to the present of the first frame drawn after
+        // the key was applied. The frontend's thread notes the oldest key event that hasn't been shown yet.
+        typedef std::chrono::steady_clock Clock;
+        std::atomic<uint32_t> inputsPosted{0};      // Key events from the frontend so far...
+        uint32_t inputsTaken = 0;                   // ...and how many of them have been applied (emulation thread)
+        bool inputWaiting = false;
+        uint32_t inputWaitingNumber = 0;
+        Clock::time_point inputWaitingSince;
+
+        // What start() reports at the end of a session
+        struct SessionStats {
+            uint64_t presents = 0;
+            uint64_t published = 0;         // Frames handed to the frontend's thread (when the core has its own thread)
+            uint64_t pacedFrames = 0;       // Frames started on a deadline (not in turbo mode)...
+            double jitterTotal = 0;         // ...and how late they started, in milliseconds
+            double jitterMax = 0;
+            uint64_t latencySamples = 0;    // Key events shown...
+            double latencyTotal = 0;        // ...and how long it took, in milliseconds
+            double latencyMax = 0;
+        };
+        void runSession(SessionStats &stats);
+        void runSessionThreaded(SessionStats &stats);
+        void emulationLoop(SessionStats &stats, std::atomic<bool> &quit);
+        void notePresented(uint32_t inputsShown, SessionStats &stats);
+
+        // Instruction processing
+        uint16_t instruction;
+        void fetch();
+        template<class Quirks> void decode();
+        void decodeWithQuirks();        // decode() for the selected profile, for single instructions outside the cores
+
+        // Every distinct operation decode() can dispatch to, named after its handler
+        enum class Op : uint8_t {
+            ClearScreen, Ret, Jump, Call, SkipRegEqVal, SkipRegNeqVal, SkipRegEqReg, SetRegToVal, AddValToReg,
+            SetRegToReg, OrRegToReg, AndRegToReg, XorRegToReg, AddRegToReg, SubSRegFromDReg, RightShift, SubDRegFromSReg,
+            LeftShift, SkipRegNeqReg, SetIndex, JumpWithOffset, Random, Display, SkipIfKey, SkipIfNotKey,
+            SetRegFromDTimer, GetKey, SetDTimerFromReg, SetSTimerFromReg, AddToIndex, FontChar, DecimalConversion,
+            StoreRegToMem, LoadRegFromMem, Nop, Count
+        };
+        static Op classify(uint16_t instruction);
+
+        // Dispatch cores
+        typedef void (*Handler)(Emulator &emulator, uint16_t instruction);
+        Core core = Core::Switch;
+        template<class Quirks> static const Handler* handlerTable();
+        static const Op* opTable();
+        void execute(int instructions);
+        template<class Quirks> void executeWithQuirks(int instructions);
+        template<bool Profiling, class Quirks = ModernQuirks> void runSwitch(int instructions);
+        template<class Quirks> void runTable(int instructions);
+        template<class Quirks> void runThreaded(int instructions);
+        template<bool UseJit> void runBlocks(int instructions);
+        void runRecompiled(int instructions);
+
+        // Basic block cache (Core::Blocks). A block is a run of pre-decoded instructions starting at some address and
+        // ending at the first instruction that can change control flow or write to memory, except that it follows 1NNN
+        // jumps to code it doesn't already cover.
+        // Blocks are dropped when memory they were decoded from is written (tracked in 64-byte pages).
+        // Superinstructions: common sequences within a block, run as one operation with a single dispatch (see
+        // executeFused). The first instruction of a sequence is marked with it and the sequence's length; the rest are
+        // decoded as usual, and executeFused takes their operands from there.
+        enum class Fused : uint8_t {
+            None,
+            SetRegs,        // 2 to 4 6XNN in a row (e.g. setting up sprite coordinates)
+            IndexDisplay,   // ANNN DXYN
+            AddSkip,        // 7XNN then 3XNN or 4XNN on the same register, and the 1NNN it skips if there is one
+            TimerSkip,      // FX07 then 3XNN or 4XNN on the same register, and the 1NNN it skips if there is one
+            Guard,          // A skip in the middle of a block and the instruction it guards
+            GuardExit       // The same, where the guarded instruction leaves the block if it runs
+        };
+        struct DecodedOp {
+            Op op;
+            uint8_t x;          // Operands, unpacked ahead of time
+            uint8_t y;
+            uint8_t n;
+            uint16_t nnn;       // NN is the low byte
+            Fused fused;        // Set on the first instruction of a superinstruction...
+            uint8_t fusedLength;    // ...along with how many instructions it covers
+        };
+        struct Block {
+            uint16_t start;
+            uint16_t length;
+            uint32_t firstOp;   // Index of the block's first instruction in blockOps
+            uint64_t pages;     // Pages the block was decoded from
+            uint16_t nextAddress[2];    // The last two addresses execution continued at after this block...
+            int32_t next[2];            // ...and the blocks there (noLink and -1 if not linked yet)
+            bool writesMemory;          // Whether it ends in FX33 or FX55, which can write over cached code
+
+            // Core::Jit only
+            uint32_t hits;              // Times the block has been entered
+            bool compiled;              // Whether compiling it has been attempted
+            JitCompiler::Code native;   // Native code for the region of code starting here, or NULL
+        };
+        static const int maxBlockLength = 64;
+        static const uint16_t noLink = 0xFFFF;  // Not an address a block can start at, so no chain lookup matches it
+        std::vector<DecodedOp> blockOps;
+        std::vector<Block> blocks;
+        std::vector<int32_t> blockAt;   // Index into blocks of the valid block starting at each address, or -1
+        uint64_t codePages = 0;         // Pages that cached blocks were decoded from
+        uint64_t dirtyPages = 0;        // Code pages written since the cache was last checked
+        bool fusion = true;
+        int32_t findBlock(uint16_t address);
+        static bool isSkip(Op op);
+        static bool endsBlock(Op op);
+        static bool fusesWithSkip(const DecodedOp &first, const DecodedOp &skip);
+        void fuseBlock(const Block &block);
+        void executeDecoded(const DecodedOp &op);
+        int executeFused(const DecodedOp* ops);
+        void markWritten(uint16_t address, uint16_t length);
+        void invalidateDirtyBlocks();
+        void flushBlocks();
+
+        // JIT recompiler (Core::Jit). The code reachable from a block is compiled once the block has been entered
+        // jitThreshold times.
+        static const uint32_t jitThreshold = 32;
+        std::unique_ptr<JitCompiler> jit;
+        void compileBlock(Block &block);
+
+        // Execution profile, collected by runSwitch<true> while profiling is on (NULL otherwise). The other cores and
+        // runSwitch<false> have no profiling code in them at all.
+        struct Profile {
+            uint64_t opCounts [(int) Op::Count] = {};
+            uint64_t opNanoseconds [(int) Op::Count] = {};     // Host time, including the fetch
+            uint64_t addressHits [0x1000] = {};                 // Instructions executed at each address
+            uint64_t draws = 0;
+            uint64_t pixelsDrawn = 0;                           // Pixels flipped by DXYN (after clipping)
+            uint64_t collisions = 0;                            // DXYN instructions that turned a pixel off
+            uint64_t stackDepths [MachineState::stackSize + 1] = {};   // Instructions executed at each call depth
+        };
+        std::unique_ptr<Profile> profile;
+        static const char* opName(Op op);
+
+        // Program recompiled ahead of time (Core::Aot), and the pages of memory its code can still run from
+        std::unique_ptr<AotModule> aot;
+        uint64_t aotValidPages = 0;
+
+        // Instructions (and helpers)
+        void clearScreen();                                         //00E0
+        void ret();                                                 //00EE
+        void jump(uint16_t address);                                //1NNN
+        void call(uint16_t address);                                //2NNN
+        void skipRegEqVal(uint8_t reg, uint8_t value);              //3XNN
+        void skipRegNeqVal(uint8_t reg, uint8_t value);             //4XNN
+        void skipRegEqReg(uint8_t reg1, uint8_t reg2);              //5XY0
+        void setRegToVal(uint8_t value, uint8_t dstReg);            //6XNN
+        void addValToReg(uint8_t value, uint8_t dstReg);            //7XNN
+
+        void setRegToReg(uint8_t srcReg, uint8_t dstReg);           //8XY0
+        void orRegToReg(uint8_t srcReg, uint8_t dstReg);            //8XY1
+        void andRegToReg(uint8_t srcReg, uint8_t dstReg);           //8XY2
+        void xorRegToReg(uint8_t srcReg, uint8_t dstReg);           //8XY3
+        void addRegToReg(uint8_t srcReg, uint8_t dstReg);           //8XY4
+        void subSRegFromDReg(uint8_t srcReg, uint8_t dstReg);       //8XY5
+        template<class Quirks> void rightShift(uint8_t srcReg, uint8_t dstReg);     //8XY6
+        void subDRegFromSReg(uint8_t srcReg, uint8_t dstReg);       //8XY7
+        template<class Quirks> void leftShift(uint8_t srcReg, uint8_t dstReg);      //8XYE
+
+        void skipRegNeqReg(uint8_t reg1, uint8_t reg2);             //9XY0
+        void setIndex(uint16_t address);                            //ANNN
+        template<class Quirks> void jumpWithOffset(uint16_t address);               //BNNN
+
+        void random(uint8_t reg, uint8_t bitMask);                  //CXNN
+
+        template<class Quirks> void display(uint8_t xReg, uint8_t yReg, uint8_t height);    //DXYN
+
+        bool isPressed(uint8_t reg);
+        void skipIfKey(uint8_t reg);                                //EX9E
+        void skipIfNotKey(uint8_t reg);                             //EXA1
+
+        void setRegFromDTimer(uint8_t reg);                         //FX07
+        void getKey(uint8_t reg);                                   //FX0A
+        void setDTimerFromReg(uint8_t reg);                         //FX15
+        void setSTimerFromReg(uint8_t reg);                         //FX18
+        void addToIndex(uint8_t reg);                               //FX1E
+        void fontChar(uint8_t reg);                                 //FX29
+        void decimalConversion(uint8_t reg);                        //FX33
+        template<class Quirks> void storeRegToMem(uint8_t reg);                     //FX55
+        template<class Quirks> void loadRegFromMem(uint8_t reg);                    //FX65
+        template<class Quirks> void advanceIndex(uint8_t reg);
+
+
+
+    public:
+        // Constructor and destructor
+        Emulator(Frontend* frontend);
+        ~Emulator();
+
+        // Loads a program file into memory at 0x200, to run with the quirks of the given variant. Returns false (after
+        // describing the problem) if it can't be loaded.
+        bool loadProgram(const char* path, QuirkProfile profile = QuirkProfile::Modern);
+
+        // Loads an already loaded program into memory at 0x200 (no file access, so one image can start any number of
+        // emulators)
+        void loadProgram(const RomImage &rom, QuirkProfile profile = QuirkProfile::Modern);
+        void setQuirks(QuirkProfile profile);
+        QuirkProfile getQuirks() const;
+
+        // Called by the frontend when a key (0x0 - 0xF) is pressed or released
+        void setKey(uint8_t key, bool pressed);
+
+        // Sets or reads all sixteen keys at once, bit k for key k (for input from scripts or other programs)
+        void setKeypad(uint16_t keys);
+        uint16_t getKeypad() const;
+
+        // Records every key press and release into the log, stamped with the emulated time it happened at
+        void recordInput(InputLog* log);
+
+        // Plays the log's key events back at the emulated times they were recorded at (ignoring the frontend's keys).
+        // With the same program, seed and instructions per second, this reproduces the recorded session exactly.
+        void replayInput(const InputLog* log);
+
+        // Executes a single instruction
+        void step();
+
+        // Decrements the delay and sound timers (should happen at 60 Hz)
+        void tickTimers();
+
+        // Runs one emulated 60 Hz frame: a batch of instructions followed by a timer tick
+        void runFrame();
+
+        // Selects the interpreter dispatch core
+        void setCore(Core core);
+
+        // Turns superinstructions in the block cache (Core::Blocks and Core::Jit) on or off. They are on by default, and
+        // never change the outcome.
+        void setFusion(bool enabled);
+
+        // Loads a program recompiled by chip8_aot (a shared object), for Core::Aot. Returns false if it can't be loaded.
+        // Its code only runs where memory still holds the program it was recompiled from.
+        bool loadRecompiled(const char* path);
+
+        // Copies the architectural state out, or replaces it (for save states and rewinding). Loading keeps cached
+        // blocks whose memory is unchanged.
+        void saveState(MachineState &out) const;
+        void loadState(const MachineState &in);
+
+        // Keeps a history of up to budgetBytes of compressed per-frame states (0 turns it off). While rewinding is set,
+        // start() steps back through the history a frame at a time instead of running.
+        void setRewindBudget(size_t budgetBytes);
+        void setRewinding(bool enabled);
+
+        // Returns to the previous frame in the history. Returns false if there is none.
+        bool stepBack();
+
+        // Returns to the frame framesBack frames before the newest in the history (0 being the newest), dropping the ones
+        // after it so that running on continues the history from there. Returns false if it isn't in the history.
+        bool restoreFrame(size_t framesBack);
+
+        // Compares the architectural state (memory, display, registers, stack, timers and key wait) with another
+        // emulator. Returns an empty string if they match, or a description of the first difference.
+        std::string compareState(const Emulator &other) const;
+
+        // Profiles execution per operation, per address, of sprites and of the stack. While it is on, every core runs as
+        // the reference core with the counting compiled in. printProfile writes a report, with the hottest addresses.
+        void setProfiling(bool enabled);
+        void printProfile(FILE* out, int hotAddresses = 20) const;
+
+        // Returns the assembly for an instruction, e.g. "ADD V3, 0x01" (data that isn't an instruction is "DW 0xNNNN")
+        static std::string disassemble(uint16_t instruction);
+
+        // Turns fast-forwarding through idle loops on or off (it is on by default, and never changes the outcome)
+        void setIdleSkipping(bool enabled);
+        uint64_t getInstSkipped() const;
+
+        // Seeds the random number generator used by CXNN, so headless runs can be reproduced
+        void setSeed(uint32_t seed);
+
+        // Read-only views of the state, for reporting the outcome of headless runs
+        uint64_t framebufferHash() const;
+        uint64_t getInstExecuted() const;
+        uint64_t getFrameCount() const;
+        uint16_t getProgramCounter() const;
+        uint16_t getIndexRegister() const;
+        const uint8_t* getRegisters() const;
+
+        // The display (one word per row, as given to Frontend::present) and memory, in place: they stay valid for the
+        // emulator's lifetime and always show the current state
+        const uint64_t* getFramebuffer() const;
+        const uint8_t* getMemory() const;
+
+        // Scheduler settings
+        void setInstPerSecond(int rate);
+        void setSpeed(double multiplier);
+        void setTurbo(bool enabled);
+        void setFrameLimit(uint64_t frames);
+
+        // Turns the sound timer's beep into sampleRate samples per emulated second, handed to the frontend a frame at a
+        // time (0 turns audio off, which is the default)
+        void setAudio(int sampleRate);
+
+        // Runs the core on its own thread in start(), so a slow present or event handling can't delay emulation
+        void setEmulationThread(bool enabled);
+
+        // Main loop function
+        void start();
+};
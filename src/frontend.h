@@ -0,0 +1,36 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <stdio.h>
+
+class Emulator;
+
+/* Everything the emulator needs from the host: somewhere to show the framebuffer, a source of key presses and (if the
+ * emulator has audio on) somewhere to play the beep.
+ * The core only ever touches its own framebuffer and key state, so it can run with any frontend (or none at all).
+ */
+class Frontend {
+    public:
+        virtual ~Frontend() {}
+
+        // Creates any windows/devices needed for a width x height display. Returns false if that fails.
+        virtual bool init(uint8_t width, uint8_t height) = 0;
+
+        // Handles pending host events and forwards key changes to the emulator. Returns false once the user quits.
+        virtual bool processEvents(Emulator &emulator) = 0;
+
+        // Like processEvents, but first blocks for up to timeoutMs until an event arrives (used to sleep between frames)
+        virtual bool waitEvents(Emulator &emulator, uint32_t timeoutMs) = 0;
+
+        // Shows the framebuffer (one 64-bit word per row, with the most significant bit as the leftmost pixel).
+        // Called at most once per emulated frame, and only when 00E0 or DXYN has run since the last call.
+        virtual void present(const uint64_t framebuffer[32]) = 0;
+
+        // Plays one emulated frame's worth of sound: mono 16-bit samples at the rate given to Emulator::setAudio.
+        // Called once per frame on the thread running the core, so it must not block. Frontends without sound drop it.
+        virtual void playAudio(const int16_t* samples, size_t count) {}
+
+        // Called when start() ends: stops anything still playing, and reports what the frontend measured to out
+        virtual void finishSession(FILE* out) {}
+};
@@ -0,0 +1,61 @@
+#include <chrono>
+#include <thread>
+
+#include "headless_frontend.h"
+
+HeadlessFrontend::HeadlessFrontend(KeyScript* script) : script(script) {
+}
+
+/* Nothing to set up, so this never fails.
+ */
+bool HeadlessFrontend::init(uint8_t width, uint8_t height) {
+    return true;
+}
+
+/* There are no host events without a window, so the emulator only stops when its caller says so. Keys come from the
+ * script, if there is one.
+ */
+bool HeadlessFrontend::processEvents(Emulator &emulator) {
+    if (script != NULL){
+        script->apply(emulator);
+    }
+    return true;
+}
+
+/* No events will ever arrive, so just sleep for the whole timeout.
+ */
+bool HeadlessFrontend::waitEvents(Emulator &emulator, uint32_t timeoutMs) {
+    std::this_thread::sleep_for(std::chrono::milliseconds(timeoutMs));
+    return processEvents(emulator);
+}
+
+/* Frames are simply dropped.
+ */
+void HeadlessFrontend::present(const uint64_t framebuffer[32]) {
+}
+
+bool HeadlessFrontend::openWav(const char* path, int sampleRate) {
+    wavPath = path;
+    return wav.open(path, sampleRate);
+}
+
+/* Audio goes to the WAV file, if there is one, and is dropped otherwise.
+ */
+void HeadlessFrontend::playAudio(const int16_t* samples, size_t count) {
+    wav.write(samples, count);
+}
+
+/* Finishes the WAV file, so it is complete as soon as the session is over.
+ */
+void HeadlessFrontend::finishSession(FILE* out) {
+    if (wavPath == NULL){
+        return;
+    }
+    uint32_t samples = wav.getSamplesWritten();
+    if (wav.close()){
+        fprintf(out, "Audio: %lu samples written to %s\n", (unsigned long) samples, wavPath);
+    } else {
+        fprintf(out, "Error writing %s\n", wavPath);
+    }
+    wavPath = NULL;
+}
@@ -0,0 +1,29 @@
+#pragma once
+
+#include "frontend.h"
+#include "key_script.h"
+#include "wav_writer.h"
+
+/* A frontend with no window, and no input other than an optional key script.
+ * Used for CI and batch runs, where only the final machine state matters. Audio can be written to a WAV file, so the
+ * sound a run makes can be checked too.
+ */
+class HeadlessFrontend : public Frontend {
+    private:
+        KeyScript* script;      // Not owned
+        WavWriter wav;
+        const char* wavPath = NULL;
+
+    public:
+        HeadlessFrontend(KeyScript* script = NULL);
+
+        // Writes the audio played to a WAV file (at the emulator's sample rate). Returns false if it can't be created.
+        bool openWav(const char* path, int sampleRate);
+
+        bool init(uint8_t width, uint8_t height) override;
+        bool processEvents(Emulator &emulator) override;
+        bool waitEvents(Emulator &emulator, uint32_t timeoutMs) override;
+        void present(const uint64_t framebuffer[32]) override;
+        void playAudio(const int16_t* samples, size_t count) override;
+        void finishSession(FILE* out) override;
+};
@@ -0,0 +1,72 @@
+#include "input_log.h"
+
+#include <fstream>
+#include <sstream>
+#include <stdio.h>
+
+bool InputLog::save(const char* path) const {
+    FILE* file = fopen(path, "w");
+    if (file == NULL){
+        printf("Error opening input log %s for writing\n", path);
+        return false;
+    }
+    fprintf(file, "program %s\n", program.c_str());
+    fprintf(file, "seed %u\n", seed);
+    fprintf(file, "ips %d\n", instPerSecond);
+    fprintf(file, "quirks %s\n", quirkProfileName(quirks));
+    for (const InputEvent &event : events){
+        fprintf(file, "key %lu %X %s\n", (unsigned long) event.cycle, event.key, event.pressed ? "down" : "up");
+    }
+    fprintf(file, "end %lu %016lX\n", (unsigned long) endCycle, (unsigned long) endFramebufferHash);
+    return fclose(file) == 0;
+}
+
+bool InputLog::load(const char* path) {
+    std::ifstream file(path);
+    if (!file){
+        printf("Error opening input log %s\n", path);
+        return false;
+    }
+
+    events.clear();
+    std::string line;
+    for (int lineNumber = 1; std::getline(file, line); ++lineNumber){
+        std::istringstream fields(line);
+        std::string item;
+        if (!(fields >> item)){
+            continue;
+        }
+
+        bool ok = true;
+        if (item == "program"){
+            ok = (bool) std::getline(fields >> std::ws, program);
+        } else if (item == "seed"){
+            ok = (bool) (fields >> seed);
+        } else if (item == "ips"){
+            ok = (bool) (fields >> instPerSecond);
+        } else if (item == "quirks"){
+            std::string name;
+            ok = (fields >> name) && parseQuirkProfile(name.c_str(), quirks);
+        } else if (item == "key"){
+            InputEvent event;
+            unsigned key;
+            std::string direction;
+            ok = (bool) (fields >> event.cycle >> std::hex >> key >> direction);
+            event.key = key & 0xF;
+            event.pressed = direction == "down";
+            // Events must be in order, since a replay walks through them once
+            ok = ok && (events.empty() || events.back().cycle <= event.cycle);
+            events.push_back(event);
+        } else if (item == "end"){
+            ok = (bool) (fields >> endCycle >> std::hex >> endFramebufferHash);
+        } else {
+            ok = false;
+        }
+
+        if (!ok){
+            printf("%s:%d: can't read \"%s\"\n", path, lineNumber, line.c_str());
+            return false;
+        }
+    }
+    return true;
+}
@@ -0,0 +1,42 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "quirks.h"
+
+// A key press or release, and when it happened in emulated time (instructions executed before it)
+struct InputEvent {
+    uint64_t cycle;
+    uint8_t key;
+    bool pressed;
+};
+
+/* Everything needed to re-run a session exactly: the seed and rate it ran with, its key events in emulated time, and
+ * where it ended (with a hash of the final framebuffer to check a replay against).
+ *
+ * Logs are saved as text, one item per line:
+ *   program chip8_programs/tetris.ch8
+ *   seed 1234
+ *   ips 700
+ *   quirks modern
+ *   key 3512 5 down
+ *   key 3790 5 up
+ *   end 84000 8C2D1F0A9B7E6543
+ */
+struct InputLog {
+    std::string program;
+    uint32_t seed = 0;
+    int instPerSecond = 700;
+    QuirkProfile quirks = QuirkProfile::Modern;     // Logs from before profiles have no quirks line, and ran modern
+    std::vector<InputEvent> events;
+    uint64_t endCycle = 0;
+    uint64_t endFramebufferHash = 0;
+
+    // Writes the log to a file. Returns false if the file can't be written.
+    bool save(const char* path) const;
+
+    // Reads a log from a file. Returns false (after describing the problem) if it can't be read.
+    bool load(const char* path);
+};
@@ -0,0 +1,377 @@
+#include <cstddef>
+#include <cstdio>
+#include <cstring>
+
+#include "jit.h"
+#include "machine_state.h"
+
+#if defined(__x86_64__) && (defined(__linux__) || defined(__APPLE__) || defined(__FreeBSD__))
+#define CHIP8_JIT_SUPPORTED 1
+#include <sys/mman.h>
+#endif
+
+/* Register use in compiled code (System V calling convention, nothing is called so no registers need saving):
+ *   rdi = state, esi = instructions left in the budget, edx = keypad, r8d = the budget on entry, eax/ecx = scratch
+ */
+namespace {
+    // x86 condition codes for near jumps (0F 8x rel32)
+    const uint8_t JB  = 0x82;
+    const uint8_t JAE = 0x83;
+    const uint8_t JE  = 0x84;
+    const uint8_t JNE = 0x85;
+    const uint8_t JL  = 0x8C;
+
+    // Offsets of the registers compiled code uses in MachineState, all within reach of a disp8
+    const uint8_t indexRegister = offsetof(MachineState, indexRegister);
+    const uint8_t programCounter = offsetof(MachineState, programCounter);
+    const uint8_t delayTimer = offsetof(MachineState, delayTimer);
+    const uint8_t soundTimer = offsetof(MachineState, soundTimer);
+    static_assert(offsetof(MachineState, vRegs) == 0 && offsetof(MachineState, soundTimer) < 0x80,
+                  "compiled code addresses the registers as [rdi + disp8]");
+
+    // ModRM byte for [rdi + disp8] with the given register field
+    inline uint8_t vReg(uint8_t reg) {
+        return 0x40 | (reg << 3) | 0x7;
+    }
+}
+
+/* Allocates the executable arena (if the host supports it).
+ */
+JitCompiler::JitCompiler() {
+#ifdef CHIP8_JIT_SUPPORTED
+    void* memory = mmap(NULL, arenaSize, PROT_READ | PROT_WRITE | PROT_EXEC, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (memory != MAP_FAILED) {
+        arena = (uint8_t*) memory;
+    } else {
+        printf("Could not allocate executable memory, the JIT is disabled\n");
+    }
+#endif
+}
+
+JitCompiler::~JitCompiler() {
+#ifdef CHIP8_JIT_SUPPORTED
+    if (arena != NULL) {
+        munmap(arena, arenaSize);
+    }
+#endif
+}
+
+bool JitCompiler::available() const {
+    return arena != NULL;
+}
+
+void JitCompiler::reset() {
+    used = 0;
+    outOfSpace = false;
+}
+
+bool JitCompiler::full() const {
+    return outOfSpace;
+}
+
+void JitCompiler::emit(std::initializer_list<uint8_t> bytes) {
+    code.insert(code.end(), bytes);
+}
+
+void JitCompiler::emit16(uint16_t value) {
+    emit({(uint8_t) value, (uint8_t) (value >> 8)});
+}
+
+void JitCompiler::emit32(uint32_t value) {
+    emit({(uint8_t) value, (uint8_t) (value >> 8), (uint8_t) (value >> 16), (uint8_t) (value >> 24)});
+}
+
+void JitCompiler::patch32(size_t offset, uint32_t value) {
+    for (int i = 0; i < 4; ++i) {
+        code[offset + i] = (uint8_t) (value >> (8*i));
+    }
+}
+
+/* mov word [rdi + programCounter], address
+ */
+void JitCompiler::setProgramCounter(uint16_t address) {
+    emit({0x66, 0xC7, 0x47, programCounter});
+    emit16(address);
+}
+
+/* Leaves the region at the address, returning the number of instructions run.
+ */
+void JitCompiler::exitTo(uint16_t address) {
+    setProgramCounter(address);
+    emit({0x44, 0x89, 0xC0});                                   // mov eax, r8d
+    emit({0x29, 0xF0});                                         // sub eax, esi
+    emit({0xC3});                                               // ret
+}
+
+/* Emits a jump (a jmp, or a jcc with the condition code if there is one) to the code for the address, which is queued
+ * to be compiled if it hasn't been yet. The jump is patched in once the whole region has been compiled.
+ */
+void JitCompiler::branchTo(uint8_t condition, uint16_t address) {
+    if (condition != 0) {
+        emit({0x0F, condition});
+    } else {
+        emit({0xE9});
+    }
+    fixups.push_back({code.size(), address});
+    emit32(0);
+
+    std::map<uint16_t, size_t>::iterator label = labels.find(address);
+    if (label == labels.end()) {
+        labels[address] = pending;
+        queued.push_back(address);
+    } else if (label->second != pending) {
+        branchesBack = true;
+    }
+}
+
+/* Emits code for a single instruction, other than the jump or skip at the end of a run (which compileRun emits after
+ * this). Returns what kind of instruction it is; for a skip, sets skipCondition to the condition code that holds when
+ * it skips, after the flags the emitted code sets.
+ *
+ * Each case mirrors the interpreter's handler, reading registers back from memory wherever the handler does, so
+ * instructions that use VF as an operand behave identically.
+ */
+JitCompiler::Kind JitCompiler::compileInstruction(uint16_t instruction, uint16_t fontStart, uint8_t &skipCondition) {
+    uint8_t x = (instruction >> 8) & 0xF;
+    uint8_t y = (instruction >> 4) & 0xF;
+    uint8_t nn = instruction & 0xFF;
+    uint16_t nnn = instruction & 0xFFF;
+
+    switch (instruction >> 12){
+    case 0x1:                                                   // jump
+        return Kind::Jump;
+    case 0x3:                                                   // skipRegEqVal
+        emit({0x80, vReg(7), x, nn});                           // cmp byte [rdi+x], nn
+        skipCondition = JE;
+        return Kind::Skip;
+    case 0x4:                                                   // skipRegNeqVal
+        emit({0x80, vReg(7), x, nn});                           // cmp byte [rdi+x], nn
+        skipCondition = JNE;
+        return Kind::Skip;
+    case 0x5:                                                   // skipRegEqReg
+    case 0x9:                                                   // skipRegNeqReg
+        emit({0x8A, vReg(0), x});                               // mov al, [rdi+x]
+        emit({0x3A, vReg(0), y});                               // cmp al, [rdi+y]
+        skipCondition = (instruction >> 12) == 0x5 ? JE : JNE;
+        return Kind::Skip;
+    case 0x6:                                                   // setRegToVal
+        emit({0xC6, vReg(0), x, nn});                           // mov byte [rdi+x], nn
+        return Kind::Straight;
+    case 0x7:                                                   // addValToReg
+        emit({0x80, vReg(0), x, nn});                           // add byte [rdi+x], nn
+        return Kind::Straight;
+    case 0x8:
+        switch (instruction & 0xF){
+        case 0x0:                                               // setRegToReg
+            emit({0x8A, vReg(0), y});                           // mov al, [rdi+y]
+            emit({0x88, vReg(0), x});                           // mov [rdi+x], al
+            return Kind::Straight;
+        case 0x1:                                               // orRegToReg
+            emit({0x8A, vReg(0), y});                           // mov al, [rdi+y]
+            emit({0x08, vReg(0), x});                           // or [rdi+x], al
+            return Kind::Straight;
+        case 0x2:                                               // andRegToReg
+            emit({0x8A, vReg(0), y});                           // mov al, [rdi+y]
+            emit({0x20, vReg(0), x});                           // and [rdi+x], al
+            return Kind::Straight;
+        case 0x3:                                               // xorRegToReg
+            emit({0x8A, vReg(0), y});                           // mov al, [rdi+y]
+            emit({0x30, vReg(0), x});                           // xor [rdi+x], al
+            return Kind::Straight;
+        case 0x4:                                               // addRegToReg
+            emit({0x8A, vReg(0), x});                           // mov al, [rdi+x]
+            emit({0x02, vReg(0), y});                           // add al, [rdi+y]
+            emit({0x88, vReg(0), x});                           // mov [rdi+x], al
+            emit({0x8A, vReg(0), x});                           // mov al, [rdi+x]
+            emit({0x3A, vReg(0), y});                           // cmp al, [rdi+y]
+            emit({0x0F, 0x92, 0xC1});                           // setb cl
+            emit({0x88, vReg(1), 0xF});                         // mov [rdi+15], cl
+            return Kind::Straight;
+        case 0x5:                                               // subSRegFromDReg
+            emit({0x8A, vReg(0), x});                           // mov al, [rdi+x]
+            emit({0x3A, vReg(0), y});                           // cmp al, [rdi+y]
+            emit({0x0F, 0x93, 0xC1});                           // setae cl
+            emit({0x88, vReg(1), 0xF});                         // mov [rdi+15], cl
+            emit({0x8A, vReg(0), x});                           // mov al, [rdi+x]
+            emit({0x2A, vReg(0), y});                           // sub al, [rdi+y]
+            emit({0x88, vReg(0), x});                           // mov [rdi+x], al
+            return Kind::Straight;
+        case 0x6:                                               // rightShift
+            emit({0x8A, vReg(0), x});                           // mov al, [rdi+x]
+            emit({0x24, 0x01});                                 // and al, 1
+            emit({0x88, vReg(0), 0xF});                         // mov [rdi+15], al
+            emit({0xD0, vReg(5), x});                           // shr byte [rdi+x], 1
+            return Kind::Straight;
+        case 0x7:                                               // subDRegFromSReg
+            emit({0x8A, vReg(0), y});                           // mov al, [rdi+y]
+            emit({0x3A, vReg(0), x});                           // cmp al, [rdi+x]
+            emit({0x0F, 0x93, 0xC1});                           // setae cl
+            emit({0x88, vReg(1), 0xF});                         // mov [rdi+15], cl
+            emit({0x8A, vReg(0), y});                           // mov al, [rdi+y]
+            emit({0x2A, vReg(0), x});                           // sub al, [rdi+x]
+            emit({0x88, vReg(0), x});                           // mov [rdi+x], al
+            return Kind::Straight;
+        case 0xE:                                               // leftShift
+            emit({0x8A, vReg(0), x});                           // mov al, [rdi+x]
+            emit({0xC0, 0xE8, 0x07});                           // shr al, 7
+            emit({0x88, vReg(0), 0xF});                         // mov [rdi+15], al
+            emit({0xD0, vReg(4), x});                           // shl byte [rdi+x], 1
+            return Kind::Straight;
+        default:
+            return Kind::Unsupported;
+        }
+    case 0xA:                                                   // setIndex
+        emit({0x66, 0xC7, 0x47, indexRegister});                // mov word [rdi+indexRegister], nnn
+        emit16(nnn);
+        return Kind::Straight;
+    case 0xB:                                                   // jumpWithOffset
+        emit({0x0F, 0xB6, vReg(0), 0x0});                       // movzx eax, byte [rdi]
+        emit({0x05});                                           // add eax, nnn
+        emit32(nnn);
+        emit({0x66, 0x89, 0x47, programCounter});               // mov [rdi+programCounter], ax
+        return Kind::Exit;
+    case 0xE:
+        switch (instruction & 0xF){
+        case 0xE:                                               // skipIfKey
+        case 0x1:                                               // skipIfNotKey
+            emit({0x0F, 0xB6, vReg(0), x});                     // movzx eax, byte [rdi+x]
+            emit({0x83, 0xE0, 0x0F});                           // and eax, 0xF
+            emit({0x0F, 0xA3, 0xC2});                           // bt edx, eax (CF = whether the key is held)
+            skipCondition = (instruction & 0xF) == 0xE ? JB : JAE;
+            return Kind::Skip;
+        default:
+            return Kind::Unsupported;
+        }
+    case 0xF:
+        switch (nn){
+        case 0x07:                                              // setRegFromDTimer
+            emit({0x8A, 0x47, delayTimer});                     // mov al, [rdi+delayTimer]
+            emit({0x88, vReg(0), x});                           // mov [rdi+x], al
+            return Kind::Straight;
+        case 0x15:                                              // setDTimerFromReg
+        case 0x18:                                              // setSTimerFromReg
+            emit({0x8A, vReg(0), x});                           // mov al, [rdi+x]
+            emit({0x88, 0x47, nn == 0x15 ? delayTimer : soundTimer});   // mov [rdi+timer], al
+            return Kind::Straight;
+        case 0x1E:                                              // addToIndex
+            emit({0x0F, 0xB6, vReg(0), x});                     // movzx eax, byte [rdi+x]
+            emit({0x66, 0x01, 0x47, indexRegister});            // add [rdi+indexRegister], ax
+            emit({0x66, 0x81, 0x7F, indexRegister});            // cmp word [rdi+indexRegister], 0x1000
+            emit16(0x1000);
+            emit({0x72, 4});                                    // jb over the next mov (4 bytes)
+            emit({0xC6, vReg(0), 0xF, 0x01});                   // mov byte [rdi+15], 1
+            return Kind::Straight;
+        case 0x29:                                              // fontChar
+            emit({0x0F, 0xB6, vReg(0), x});                     // movzx eax, byte [rdi+x]
+            emit({0x83, 0xE0, 0x0F});                           // and eax, 0xF
+            emit({0x8D, 0x84, 0x80});                           // lea eax, [rax + rax*4 + fontStart]
+            emit32(fontStart);
+            emit({0x66, 0x89, 0x47, indexRegister});            // mov [rdi+indexRegister], ax
+            return Kind::Straight;
+        default:
+            return Kind::Unsupported;
+        }
+
+    default:
+        return Kind::Unsupported;
+    }
+}
+
+/* Compiles the straight run of instructions at the address, up to and including the jump or skip that ends it, or up
+ * to the first instruction that can't be compiled. The run starts by taking its length out of the budget, leaving the
+ * region instead if the budget doesn't cover it. A run with nothing in it compiles to a plain exit.
+ */
+void JitCompiler::compileRun(const MachineState &state, uint16_t address, uint16_t fontStart, uint64_t &pages) {
+    size_t start = code.size();
+    labels[address] = start;
+    emit({0x81, 0xFE});                                         // cmp esi, length
+    emit32(0);
+    emit({0x0F, JL});                                           // jl to the exit at the end
+    emit32(0);
+    emit({0x81, 0xEE});                                         // sub esi, length
+    emit32(0);
+
+    uint16_t pc = address;
+    int length = 0;
+    Kind kind = Kind::Straight;
+    uint8_t skipCondition = 0;
+    while (pc <= 0xFFE && length < maxRunLength && regionLength < maxRegionLength) {
+        uint16_t instruction = ((uint16_t) state.memory[pc] << 8) + state.memory[pc + 1];
+        size_t before = code.size();
+        kind = compileInstruction(instruction, fontStart, skipCondition);
+        if (kind == Kind::Unsupported) {
+            code.resize(before);
+            break;
+        }
+        pages |= (1ULL << (pc >> 6)) | (1ULL << ((pc + 1) >> 6));
+        ++length;
+        ++regionLength;
+        pc += 2;
+        if (kind == Kind::Jump) {
+            branchTo(0, instruction & 0xFFF);
+            break;
+        } else if (kind == Kind::Skip) {
+            branchTo(skipCondition, pc + 2);
+            branchTo(0, pc);
+            break;
+        } else if (kind == Kind::Exit) {
+            emit({0x44, 0x89, 0xC0});                           // mov eax, r8d
+            emit({0x29, 0xF0});                                 // sub eax, esi
+            emit({0xC3});                                       // ret
+            break;
+        }
+    }
+    if (length == 0) {
+        code.resize(start);
+        exitTo(address);
+        return;
+    }
+
+    // Carry on at the instruction after a run that stopped before one it couldn't compile (or ran too long)
+    if (kind == Kind::Straight || kind == Kind::Unsupported) {
+        branchTo(0, pc);
+    }
+    patch32(start + 2, length);
+    patch32(start + 8, code.size() - (start + 12));
+    patch32(start + 14, length);
+    exitTo(address);
+}
+
+/* Compiles the region reachable from the address, one straight run at a time, and copies it into the arena.
+ */
+JitCompiler::Code JitCompiler::compile(const MachineState &state, uint16_t address, uint16_t fontStart,
+                                       uint64_t &pages) {
+    pages = 0;
+    if (arena == NULL) {
+        return NULL;
+    }
+
+    code.clear();
+    labels.clear();
+    queued.clear();
+    fixups.clear();
+    regionLength = 0;
+    branchesBack = false;
+
+    emit({0x41, 0x89, 0xF0});                                   // mov r8d, esi
+    labels[address] = pending;
+    queued.push_back(address);
+    for (size_t i = 0; i < queued.size(); ++i) {
+        compileRun(state, queued[i], fontStart, pages);
+    }
+    if (regionLength < minRegionLength && !branchesBack) {
+        return NULL;
+    }
+    for (const std::pair<size_t, uint16_t> &fixup : fixups) {
+        patch32(fixup.first, labels[fixup.second] - (fixup.first + 4));
+    }
+
+    if (used + code.size() > arenaSize) {
+        outOfSpace = true;
+        return NULL;
+    }
+    uint8_t* destination = arena + used;
+    memcpy(destination, code.data(), code.size());
+    used += (code.size() + 15) & ~(size_t) 15;
+    return (Code) destination;
+}
@@ -0,0 +1,83 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <initializer_list>
+#include <map>
+#include <vector>
+
+struct MachineState;
+
+/* Translates regions of CHIP-8 code into native x86-64 code.
+ *
+ * A region is all the code reachable from an entry address through compilable instructions, following jumps and both
+ * sides of skips, so a loop runs natively from one iteration to the next without returning to the interpreter. Each
+ * straight run of instructions in it checks the instruction budget once on entry, so native code stops exactly where
+ * the interpreter would.
+ *
+ * Only instructions that touch nothing but the V registers, the index register, the timers, the keys and the program
+ * counter are compiled: 1NNN, 3XNN, 4XNN, 5XY0, 6XNN, 7XNN, 8XY0-8XYE, 9XY0, ANNN, BNNN, EX9E, EXA1, FX07, FX15, FX18,
+ * FX1E and FX29. Anything else (the display, the stack or memory) leaves the region, for the interpreter to handle.
+ * Compiled code follows the interpreter's handlers exactly, including how VF is written when it is also an operand.
+ *
+ * Code is placed in an executable arena. When the arena fills up, reset() discards everything compiled so far.
+ * On hosts other than x86-64 Linux/BSD/macOS the compiler is unavailable and compile() always fails.
+ */
+class JitCompiler {
+    public:
+        // A compiled region. Runs the machine from the region's entry with the keys in keypad held, for at most budget
+        // instructions, leaves the program counter pointing at whatever should run next, and returns the number of
+        // instructions executed (0 if the budget doesn't cover the first run of them).
+        typedef int (*Code)(MachineState* state, int budget, uint16_t keypad);
+
+        JitCompiler();
+        ~JitCompiler();
+        JitCompiler(const JitCompiler &) = delete;
+        JitCompiler &operator=(const JitCompiler &) = delete;
+
+        // Whether native code can be run on this host
+        bool available() const;
+
+        // Compiles the region starting at address in the machine's memory, and sets pages to the 64-byte pages of
+        // memory it was compiled from. Returns NULL if the region is too small to be worth a call (fewer than
+        // minRegionLength instructions and no branch back into itself), or the arena is full.
+        Code compile(const MachineState &state, uint16_t address, uint16_t fontStart, uint64_t &pages);
+
+        // Frees all compiled code
+        void reset();
+
+        // Whether a compile has failed for lack of space (cleared by reset)
+        bool full() const;
+
+    private:
+        uint8_t* arena = NULL;
+        size_t arenaSize = 1 << 20;
+        size_t used = 0;
+        bool outOfSpace = false;
+
+        static const int minRegionLength = 8;
+        static const int maxRegionLength = 256;     // Instructions in a region
+        static const int maxRunLength = 64;         // Instructions in one straight run within it
+
+        // The region being compiled: its machine code, where the code for each address in it starts (or pending, if
+        // it is still to be compiled), the addresses still to compile, and the branches to patch once they all are
+        std::vector<uint8_t> code;
+        static const size_t pending = SIZE_MAX;
+        std::map<uint16_t, size_t> labels;
+        std::vector<uint16_t> queued;
+        std::vector<std::pair<size_t, uint16_t>> fixups;
+        int regionLength = 0;
+        bool branchesBack = false;
+
+        void emit(std::initializer_list<uint8_t> bytes);
+        void emit16(uint16_t value);
+        void emit32(uint32_t value);
+        void patch32(size_t offset, uint32_t value);
+        void setProgramCounter(uint16_t address);
+        void exitTo(uint16_t address);
+        void branchTo(uint8_t condition, uint16_t address);
+        void compileRun(const MachineState &state, uint16_t address, uint16_t fontStart, uint64_t &pages);
+
+        enum class Kind { Unsupported, Straight, Jump, Skip, Exit };
+        Kind compileInstruction(uint16_t instruction, uint16_t fontStart, uint8_t &skipCondition);
+};
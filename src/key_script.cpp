@@ -0,0 +1,67 @@
+#include <iostream>
+#include <sstream>
+#include <stdio.h>
+
+#include "key_script.h"
+#include "emulator.h"
+
+bool KeyScript::open(const char* path) {
+    this->path = path;
+    if (this->path == "-"){
+        input = &std::cin;
+        return true;
+    }
+    file.open(path);
+    if (!file){
+        printf("Error opening key script %s\n", path);
+        return false;
+    }
+    input = &file;
+    return true;
+}
+
+/* Reads lines up to the next change, which becomes pending. Returns false at the end of the script (or at a line that
+ * can't be read, after describing it).
+ */
+bool KeyScript::readNext() {
+    std::string line;
+    while (input != NULL && std::getline(*input, line)){
+        ++lineNumber;
+        std::istringstream fields(line.substr(0, line.find('#')));
+        uint64_t lineFrame;
+        std::string action;
+        if (!(fields >> lineFrame)){
+            if (fields.eof()){
+                continue;   // Blank or only a comment
+            }
+        } else if (fields >> action){
+            unsigned value;
+            bool ok = (bool) (fields >> std::hex >> value) && lineFrame >= frame;
+            if (ok && (action == "down" || action == "up") && value <= 0xF){
+                frame = lineFrame;
+                affected = 1 << value;
+                keys = action == "down" ? affected : 0;
+                pending = true;
+                return true;
+            }
+            if (ok && action == "keys" && value <= 0xFFFF){
+                frame = lineFrame;
+                affected = 0xFFFF;
+                keys = value;
+                pending = true;
+                return true;
+            }
+        }
+        printf("%s:%d: can't read \"%s\"\n", path.c_str(), lineNumber, line.c_str());
+        break;
+    }
+    input = NULL;
+    return false;
+}
+
+void KeyScript::apply(Emulator &emulator) {
+    while ((pending || readNext()) && frame <= emulator.getFrameCount()){
+        emulator.setKeypad((emulator.getKeypad() & ~affected) | keys);
+        pending = false;
+    }
+}
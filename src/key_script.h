@@ -0,0 +1,39 @@
+#pragma once
+
+#include <cstdint>
+#include <fstream>
+#include <istream>
+#include <memory>
+#include <string>
+
+class Emulator;
+
+/* Key input for runs without a keyboard, read from a file (or a pipe from another program) as emulation reaches it.
+ * Each line changes the keys at the start of an emulated frame (counted from 0):
+ *   120 down 5       press key 5
+ *   135 up 5         release it
+ *   200 keys 0012    set all sixteen keys at once, bit k for key k (here keys 1 and 4 are held, the rest released)
+ * Lines must be in frame order, and # starts a comment. Lines are only read once the frame before them has run, so a
+ * program writing to the pipe can wait to see the outcome of one frame before choosing the next input.
+ */
+class KeyScript {
+    private:
+        std::ifstream file;
+        std::istream* input = NULL;
+        std::string path;
+        int lineNumber = 0;
+
+        // The next change, read but not yet due
+        bool pending = false;
+        uint64_t frame = 0;
+        uint16_t keys = 0;          // New state of the affected keys
+        uint16_t affected = 0;      // Keys the change applies to
+        bool readNext();
+
+    public:
+        // Opens a script file, or standard input for "-". Returns false if it can't be opened.
+        bool open(const char* path);
+
+        // Applies every change due at or before the emulator's current frame
+        void apply(Emulator &emulator);
+};
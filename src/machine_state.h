@@ -0,0 +1,76 @@
+#pragma once
+
+#include <cstdint>
+#include <type_traits>
+
+/* The complete architectural state of a CHIP-8 machine, in one flat block.
+ *
+ * It is trivially copyable, so a snapshot is a single memcpy, and has no pointers, so snapshots can be compared, diffed
+ * or written out byte for byte. The small, frequently used registers come first, so they share the first cache line.
+ */
+struct alignas(64) MachineState {
+    // General purpose registers
+    uint8_t vRegs [16] = {};
+
+    // Address-related registers
+    uint16_t indexRegister = 0;
+    uint16_t programCounter = 0x200;
+
+    // Timers
+    uint8_t delayTimer = 0;
+    uint8_t soundTimer = 0;
+
+    // FX0A key wait
+    bool awaitingKey = false;
+    uint8_t keyPressed = 0xFF;
+
+    // CXNN random number generator (see nextRandomByte), kept here so snapshots and replays reproduce it
+    uint32_t rngState = 0x7F4A7C15;
+
+    // Return addresses of 2NNN calls. Sixteen levels, which is more than the original interpreter allowed.
+    static const int stackSize = 16;
+    uint8_t stackPointer = 0;               // Number of addresses on the stack
+    uint16_t addressStack [stackSize] = {};
+
+    // Display, one word per row; the most significant bit is x = 0
+    uint64_t framebuffer [32] = {};
+
+    // Memory
+    uint8_t memory [4096] = {};
+};
+
+// The hexadecimal digit sprites FX29 points I at, five bytes each, which every machine has in memory from fontAddress
+constexpr uint16_t fontAddress = 0x50;
+inline constexpr uint8_t fontSprites [80] =
+        {0xF0, 0x90, 0x90, 0x90, 0xF0,  // 0
+         0x20, 0x60, 0x20, 0x20, 0x70,  // 1
+         0xF0, 0x10, 0xF0, 0x80, 0xF0,  // 2
+         0xF0, 0x10, 0xF0, 0x10, 0xF0,  // 3
+         0x90, 0x90, 0xF0, 0x10, 0x10,  // 4
+         0xF0, 0x80, 0xF0, 0x10, 0xF0,  // 5
+         0xF0, 0x80, 0xF0, 0x90, 0xF0,  // 6
+         0xF0, 0x10, 0x20, 0x40, 0x40,  // 7
+         0xF0, 0x90, 0xF0, 0x90, 0xF0,  // 8
+         0xF0, 0x90, 0xF0, 0x10, 0xF0,  // 9
+         0xF0, 0x90, 0xF0, 0x90, 0x90,  // A
+         0xE0, 0x90, 0xE0, 0x90, 0xE0,  // B
+         0xF0, 0x80, 0x80, 0x80, 0xF0,  // C
+         0xE0, 0x90, 0x90, 0x90, 0xE0,  // D
+         0xF0, 0x80, 0xF0, 0x80, 0xF0,  // E
+         0xF0, 0x80, 0xF0, 0x80, 0x80}; // F
+
+// Mixes a seed into a generator state, which must not be zero (xorshift would never leave it)
+inline uint32_t seedRandom(uint32_t seed) {
+    uint32_t rngState = seed * 0x9E3779B9u + 0x7F4A7C15u;
+    return rngState != 0 ? rngState : 1;
+}
+
+// Advances a 32-bit xorshift generator and returns the top byte of the new state
+inline uint8_t nextRandomByte(uint32_t &rngState) {
+    rngState ^= rngState << 13;
+    rngState ^= rngState >> 17;
+    rngState ^= rngState << 5;
+    return rngState >> 24;
+}
+
+static_assert(std::is_trivially_copyable<MachineState>::value, "MachineState must be copyable with memcpy");
@@ -1,14 +1,523 @@
-#include "emulator.h"
-
-// TODO: Implement command line argument for CHIP-8 program file
-int main() {
-    Emulator* emulator = new Emulator();
-    if (std::ifstream is{"chip8_programs/tetris.ch8", std::ios::binary | std::ios::ate}) {
-        emulator->loadProgram(is);
-    } else {
-        printf("Error opening input filestream!\n");
-    }
-    emulator->start();
-    delete emulator;
-    return 0;
-}
\ No newline at end of file
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <filesystem>
+#include <string>
+#include <vector>
+
+#include "batch.h"
+#include "emulator.h"
+#include "headless_frontend.h"
+#include "simd_engine.h"
+#ifndef CHIP8_HEADLESS
+#include "sdl_frontend.h"
+#endif
+
+// Sample rate of the beep, in the window and in WAV files
+static const int audioSampleRate = 44100;
+
+/* Parses a core name. Returns false if it isn't one.
+ */
+static bool parseCore(const char* name, Core &core) {
+    if (strcmp(name, "switch") == 0) {
+        core = Core::Switch;
+    } else if (strcmp(name, "table") == 0) {
+        core = Core::Table;
+    } else if (strcmp(name, "threaded") == 0) {
+        core = Core::Threaded;
+    } else if (strcmp(name, "blocks") == 0) {
+        core = Core::Blocks;
+    } else if (strcmp(name, "jit") == 0) {
+        core = Core::Jit;
+    } else if (strcmp(name, "aot") == 0) {
+        core = Core::Aot;
+    } else {
+        return false;
+    }
+    return true;
+}
+
+/* Runs every program in the directory headless on each dispatch core, printing the instructions per second of each.
+ * Frames are run with a large instruction batch so the measurement is dominated by instruction dispatch.
+ */
+static void compareCores(const char* directory, uint64_t frames) {
+    const char* names[] = {"switch", "table", "threaded", "blocks", "jit"};
+    const Core cores[] = {Core::Switch, Core::Table, Core::Threaded, Core::Blocks, Core::Jit};
+    const int coreCount = sizeof(cores) / sizeof(cores[0]);
+    const int instPerFrame = 1000;
+
+    std::vector<std::string> programs;
+    for (const auto &entry : std::filesystem::directory_iterator(directory)) {
+        if (entry.path().extension() == ".ch8") {
+            programs.push_back(entry.path().string());
+        }
+    }
+    std::sort(programs.begin(), programs.end());
+
+    printf("Million instructions per second (%lu frames of %d instructions)\n", (unsigned long) frames, instPerFrame);
+    printf("%-40s", "program");
+    for (int c = 0; c < coreCount; ++c) {
+        printf(" %10s", names[c]);
+    }
+    printf("\n");
+    for (const std::string &program : programs) {
+        printf("%-40s", program.c_str());
+        for (int c = 0; c < coreCount; ++c) {
+            HeadlessFrontend frontend;
+            Emulator emulator(&frontend);
+            if (!emulator.loadProgram(program.c_str())) {
+                break;
+            }
+            emulator.setCore(cores[c]);
+            emulator.setInstPerSecond(instPerFrame * 60);
+            emulator.setIdleSkipping(false);    // Measure the cores, not how much waiting they avoid
+
+            auto start = std::chrono::steady_clock::now();
+            for (uint64_t f = 0; f < frames; ++f) {
+                emulator.runFrame();
+            }
+            double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+            printf(" %10.1f", frames * instPerFrame / seconds / 1e6);
+        }
+        printf("\n");
+    }
+}
+
+/* Runs the program headless on the reference core and the given core side by side, comparing their state after every
+ * frame. Returns false (after describing it) at the first difference. aotPath is the module for Core::Aot, if any.
+ */
+static bool lockstep(const char* programPath, Core core, QuirkProfile quirks, uint64_t frames, const char* aotPath) {
+    HeadlessFrontend frontend;
+    Emulator reference(&frontend);
+    Emulator candidate(&frontend);
+    std::shared_ptr<const RomImage> rom = RomImage::load(programPath);
+    if (!rom) {
+        return false;
+    }
+    reference.loadProgram(*rom, quirks);
+    candidate.loadProgram(*rom, quirks);
+    candidate.setCore(core);
+    if (aotPath != NULL && !candidate.loadRecompiled(aotPath)) {
+        return false;
+    }
+
+    for (uint64_t f = 0; f < frames; ++f) {
+        reference.runFrame();
+        candidate.runFrame();
+        std::string difference = reference.compareState(candidate);
+        if (!difference.empty()) {
+            printf("Lockstep: diverged from the reference core in frame %lu: %s\n", (unsigned long) f, difference.c_str());
+            return false;
+        }
+    }
+    printf("Lockstep: %lu frames identical to the reference core\n", (unsigned long) frames);
+    return true;
+}
+
+/* Runs every entry of the batch list headless on a pool of threads, writing a CSV record per run to stdout and a
+ * summary to stderr. Returns false if the list can't be read or a program couldn't be opened.
+ */
+static bool batch(const char* listPath, Core core, QuirkProfile quirks, int instPerSecond, uint64_t frames,
+                  unsigned threads) {
+    std::vector<BatchJob> jobs;
+    if (!readBatchList(listPath, frames, quirks, jobs)){
+        return false;
+    }
+
+    auto start = std::chrono::steady_clock::now();
+    std::vector<BatchResult> results = runBatch(jobs, core, instPerSecond, threads);
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    printBatchResults(stdout, jobs, results);
+
+    uint64_t instructions = 0;
+    size_t failed = 0;
+    for (const BatchResult &result : results){
+        instructions += result.instructions;
+        failed += result.loaded ? 0 : 1;
+    }
+    fprintf(stderr, "Batch: %zu runs (%zu failed) in %.3f s, %.1f million instructions per second\n",
+            jobs.size(), failed, seconds, instructions / seconds / 1e6);
+    return failed == 0;
+}
+
+/* Runs the program on every lane of a SimdEngine (lane i seeded with i), then on as many separate emulators with the same
+ * seeds, and compares the final state of each lane with its emulator. Prints the throughput of both. Returns false if
+ * any lane differs.
+ */
+static bool simdCompare(const char* programPath, Core core, int instPerSecond, uint64_t frames) {
+    std::shared_ptr<const RomImage> rom = RomImage::load(programPath);
+    if (!rom) {
+        return false;
+    }
+    std::unique_ptr<SimdEngine> engine(new SimdEngine());
+    engine->loadProgram(*rom);
+    engine->setInstPerSecond(instPerSecond);
+    for (int lane = 0; lane < SimdEngine::lanes; ++lane) {
+        engine->setSeed(lane, lane);
+    }
+    auto start = std::chrono::steady_clock::now();
+    for (uint64_t f = 0; f < frames; ++f) {
+        engine->runFrame();
+    }
+    double engineSeconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+    HeadlessFrontend frontend;
+    double emulatorSeconds = 0;
+    int mismatches = 0;
+    for (int lane = 0; lane < SimdEngine::lanes; ++lane) {
+        Emulator emulator(&frontend);
+        emulator.loadProgram(*rom);
+        emulator.setCore(core);
+        emulator.setInstPerSecond(instPerSecond);
+        emulator.setSeed(lane);
+        emulator.setIdleSkipping(false);    // The engine only skips FX0A waits, so the emulators run every loop
+        start = std::chrono::steady_clock::now();
+        for (uint64_t f = 0; f < frames; ++f) {
+            emulator.runFrame();
+        }
+        emulatorSeconds += std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+        bool same = emulator.framebufferHash() == engine->framebufferHash(lane)
+                 && emulator.getProgramCounter() == engine->getProgramCounter(lane)
+                 && emulator.getIndexRegister() == engine->getIndexRegister(lane);
+        for (uint8_t r = 0; r < 16; ++r) {
+            same = same && emulator.getRegisters()[r] == engine->getRegister(lane, r);
+        }
+        if (!same) {
+            printf("SIMD: lane %d differs from its emulator\n", lane);
+            ++mismatches;
+        }
+    }
+
+    double laneInstructions = (double) engine->getInstExecuted() * SimdEngine::lanes;
+    printf("SIMD: %d lanes, %lu frames, %s\n", SimdEngine::lanes, (unsigned long) frames,
+           engine->vectorized() ? "AVX2" : "scalar fallback (no AVX2)");
+    printf("  engine     %8.1f million instructions per second (%.1f%% on the vector path)\n",
+           laneInstructions / engineSeconds / 1e6, 100.0 * engine->getVectorInstructions() / laneInstructions);
+    printf("  emulators  %8.1f million instructions per second\n", laneInstructions / emulatorSeconds / 1e6);
+    printf("  %d of %d lanes match their emulator\n", SimdEngine::lanes - mismatches, SimdEngine::lanes);
+    return mismatches == 0;
+}
+
+/* Re-runs a recorded session headless, as fast as possible, and checks the final framebuffer against the recording.
+ * The program is the one named in the log unless programPath is given. Returns false if the replay doesn't match.
+ */
+static bool replay(const char* logPath, const char* programPath, Core core) {
+    InputLog log;
+    if (!log.load(logPath)) {
+        return false;
+    }
+    if (programPath == NULL) {
+        programPath = log.program.c_str();
+    }
+
+    HeadlessFrontend frontend;
+    Emulator emulator(&frontend);
+    if (!emulator.loadProgram(programPath, log.quirks)) {
+        return false;
+    }
+    emulator.setCore(core);
+    emulator.setSeed(log.seed);
+    emulator.setInstPerSecond(log.instPerSecond);
+    emulator.replayInput(&log);
+
+    auto start = std::chrono::steady_clock::now();
+    while (emulator.getInstExecuted() < log.endCycle) {
+        emulator.runFrame();
+    }
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+    bool match = emulator.framebufferHash() == log.endFramebufferHash;
+    printf("Replay: %lu frames (%lu key events) in %.3f s\n", (unsigned long) emulator.getFrameCount(),
+           (unsigned long) log.events.size(), seconds);
+    printf("Final framebuffer hash %016lX, recorded %016lX: %s\n", (unsigned long) emulator.framebufferHash(),
+           (unsigned long) log.endFramebufferHash, match ? "match" : "MISMATCH");
+    return match;
+}
+
+/* Usage: chip8 [options] [program.ch8]
+ *
+ * --headless     Run without a window or input (implies --turbo)
+ * --turbo        Run frames back to back instead of at 60 Hz
+ * --speed X      Run X times faster than real time
+ * --ips N        Instructions executed per emulated second (default 700)
+ * --frames N     Stop after N frames (default: until the window is closed, or 36000 when headless)
+ * --core NAME    Interpreter dispatch core: switch (default), table, threaded, blocks, jit or aot
+ * --quirks NAME  Run the program as the given variant does: modern (the default), vip (COSMAC VIP), chip48 or schip
+ *                (SUPER-CHIP), which differ in 8XY6/8XYE, FX55/FX65 and BNNN
+ * --aot FILE     Module built from chip8_aot's output for the program, run by the aot core (see the README)
+ * --lockstep     Run headless on the reference core and the selected core (default jit) side by side, and report the
+ *                first frame where their state differs
+ * --compare-cores [DIR]  Measure each core on every program in DIR (default chip8_programs) and exit
+ * --batch LIST   Run every program in LIST headless on the selected core (budget defaults to 3600 frames), and print a
+ *                CSV record of each run's final state
+ * --threads N    Worker threads for --batch (default: one per hardware thread)
+ * --rewind MB    Keep up to MB megabytes of per-frame history, played backwards while Backspace is held (default 16 in a
+ *                window, 0 when headless)
+ * --seed N       Seed for the CXNN random numbers (default: the time in a window, 0 when headless)
+ * --record FILE  Write the seed and every key press, stamped with its emulated time, to FILE when the session ends
+ * --replay FILE  Re-run a recorded session headless at full speed and check its final framebuffer (the program is the
+ *                recorded one unless another is given)
+ * --simd         Run the program on every lane of the SIMD engine and on separate emulators (on the selected core),
+ *                and compare their final states and throughput
+ * --profile      Count instructions and host time per operation and per address, sprites drawn and stack depth, and
+ *                print a report (with the hottest addresses disassembled) at exit
+ * --keymap FILE  Map keyboard keys to the keypad as FILE says (a line per key: the CHIP-8 key in hex, then the SDL key
+ *                name, e.g. "5 W")
+ * --input FILE   Run headless, pressing and releasing keys at the frames FILE gives ("-" reads them from standard
+ *                input, so another program can drive the run); see key_script.h for the format
+ * --single-thread  Run the core on the same thread as the window, instead of its own
+ * --audio-buffer N  Audio device buffer in samples (default 512, about 12 ms): smaller for less latency, larger if the
+ *                sound breaks up (the underruns are reported at exit)
+ * --no-audio     Don't play the beep
+ * --wav FILE     Run headless, writing the beep to FILE as a WAV file
+ * --no-idle-skip Execute idle loops (key waits, timer polling, jumps to self) instruction by instruction instead of
+ *                fast-forwarding through them
+ */
+int main(int argc, char* argv[]) {
+    const char* programPath = "chip8_programs/tetris.ch8";
+    bool headless = false;
+    bool turbo = false;
+    double speed = 1.0;
+    int instPerSecond = 700;
+    uint64_t frames = 0;
+    Core core = Core::Switch;
+    const char* compareDirectory = NULL;
+    bool coreGiven = false;
+    bool lockstepMode = false;
+    const char* batchList = NULL;
+    unsigned threads = 0;
+    bool simdMode = false;
+    bool profiling = false;
+    bool idleSkipping = true;
+    bool singleThread = false;
+    bool audio = true;
+    int audioBuffer = 512;
+    const char* wavPath = NULL;
+    const char* keymapPath = NULL;
+    const char* inputPath = NULL;
+    const char* aotPath = NULL;
+    QuirkProfile quirks = QuirkProfile::Modern;
+    double rewindMegabytes = -1;
+    bool seedGiven = false;
+    uint32_t seed = 0;
+    const char* recordPath = NULL;
+    const char* replayPath = NULL;
+    bool programGiven = false;
+
+    for (int i = 1; i < argc; ++i) {
+        if (strcmp(argv[i], "--headless") == 0) {
+            headless = true;
+        } else if (strcmp(argv[i], "--turbo") == 0) {
+            turbo = true;
+        } else if (strcmp(argv[i], "--speed") == 0 && i + 1 < argc) {
+            speed = atof(argv[++i]);
+        } else if (strcmp(argv[i], "--ips") == 0 && i + 1 < argc) {
+            instPerSecond = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--frames") == 0 && i + 1 < argc) {
+            frames = strtoull(argv[++i], NULL, 10);
+        } else if (strcmp(argv[i], "--core") == 0 && i + 1 < argc) {
+            if (!parseCore(argv[++i], core)) {
+                printf("Unknown core: %s\n", argv[i]);
+                return 1;
+            }
+            coreGiven = true;
+        } else if (strcmp(argv[i], "--lockstep") == 0) {
+            lockstepMode = true;
+        } else if (strcmp(argv[i], "--compare-cores") == 0) {
+            compareDirectory = "chip8_programs";
+            if (i + 1 < argc && argv[i + 1][0] != '-') {
+                compareDirectory = argv[++i];
+            }
+        } else if (strcmp(argv[i], "--batch") == 0 && i + 1 < argc) {
+            batchList = argv[++i];
+        } else if (strcmp(argv[i], "--rewind") == 0 && i + 1 < argc) {
+            rewindMegabytes = atof(argv[++i]);
+        } else if (strcmp(argv[i], "--seed") == 0 && i + 1 < argc) {
+            seed = (uint32_t) strtoul(argv[++i], NULL, 0);
+            seedGiven = true;
+        } else if (strcmp(argv[i], "--record") == 0 && i + 1 < argc) {
+            recordPath = argv[++i];
+        } else if (strcmp(argv[i], "--replay") == 0 && i + 1 < argc) {
+            replayPath = argv[++i];
+        } else if (strcmp(argv[i], "--simd") == 0) {
+            simdMode = true;
+        } else if (strcmp(argv[i], "--profile") == 0) {
+            profiling = true;
+        } else if (strcmp(argv[i], "--keymap") == 0 && i + 1 < argc) {
+            keymapPath = argv[++i];
+        } else if (strcmp(argv[i], "--input") == 0 && i + 1 < argc) {
+            inputPath = argv[++i];
+        } else if (strcmp(argv[i], "--quirks") == 0 && i + 1 < argc) {
+            if (!parseQuirkProfile(argv[++i], quirks)) {
+                printf("Unknown quirk profile: %s\n", argv[i]);
+                return 1;
+            }
+        } else if (strcmp(argv[i], "--aot") == 0 && i + 1 < argc) {
+            aotPath = argv[++i];
+        } else if (strcmp(argv[i], "--single-thread") == 0) {
+            singleThread = true;
+        } else if (strcmp(argv[i], "--audio-buffer") == 0 && i + 1 < argc) {
+            audioBuffer = std::min(std::max(atoi(argv[++i]), 16), 32768);
+        } else if (strcmp(argv[i], "--no-audio") == 0) {
+            audio = false;
+        } else if (strcmp(argv[i], "--wav") == 0 && i + 1 < argc) {
+            wavPath = argv[++i];
+        } else if (strcmp(argv[i], "--no-idle-skip") == 0) {
+            idleSkipping = false;
+        } else if (strcmp(argv[i], "--threads") == 0 && i + 1 < argc) {
+            threads = (unsigned) atoi(argv[++i]);
+        } else if (argv[i][0] == '-') {
+            printf("Unknown option: %s\n", argv[i]);
+            return 1;
+        } else {
+            programPath = argv[i];
+            programGiven = true;
+        }
+    }
+
+    if (compareDirectory != NULL) {
+        compareCores(compareDirectory, frames > 0 ? frames : 5000);
+        return 0;
+    }
+    if (batchList != NULL) {
+        return batch(batchList, core, quirks, instPerSecond, frames > 0 ? frames : 3600, threads) ? 0 : 1;
+    }
+    if (replayPath != NULL) {
+        return replay(replayPath, programGiven ? programPath : NULL, core) ? 0 : 1;
+    }
+    if (simdMode) {
+        if (quirks != QuirkProfile::Modern) {
+            printf("The SIMD engine only runs the modern quirk profile.\n");
+            return 1;
+        }
+        return simdCompare(programPath, core, instPerSecond, frames > 0 ? frames : 3600) ? 0 : 1;
+    }
+    if (lockstepMode) {
+        return lockstep(programPath, coreGiven ? core : Core::Jit, quirks, frames > 0 ? frames : 36000, aotPath) ? 0 : 1;
+    }
+
+    // Scripted keys are for runs without a keyboard
+    KeyScript script;
+    if (inputPath != NULL) {
+        if (!script.open(inputPath)) {
+            return 1;
+        }
+        headless = true;
+    }
+    if (wavPath != NULL) {
+        headless = true;
+    }
+
+#ifdef CHIP8_HEADLESS
+    if (!headless) {
+        printf("Built without SDL, running headless.\n");
+        headless = true;
+    }
+    (void) audioBuffer;     // Only the window has an audio device
+#endif
+
+    Frontend* frontend = NULL;
+    if (headless && keymapPath != NULL) {
+        printf("The keymap only applies to the window, ignoring it.\n");
+    }
+    // Headless runs only make sound when it's going to a file
+    int sampleRate = 0;
+    if (headless) {
+        HeadlessFrontend* headlessFrontend = new HeadlessFrontend(inputPath != NULL ? &script : NULL);
+        if (wavPath != NULL && audio) {
+            if (!headlessFrontend->openWav(wavPath, audioSampleRate)) {
+                delete headlessFrontend;
+                return 1;
+            }
+            sampleRate = audioSampleRate;
+        }
+        frontend = headlessFrontend;
+    }
+#ifndef CHIP8_HEADLESS
+    else {
+        SdlFrontend* sdlFrontend = new SdlFrontend();
+        if (keymapPath != NULL && !sdlFrontend->loadKeymap(keymapPath)) {
+            delete sdlFrontend;
+            return 1;
+        }
+        if (audio) {
+            if (sdlFrontend->openAudio(audioSampleRate, (uint16_t) audioBuffer)) {
+                sampleRate = audioSampleRate;
+            } else {
+                printf("Running without sound.\n");
+            }
+        }
+        frontend = sdlFrontend;
+    }
+#endif
+
+    Emulator* emulator = new Emulator(frontend);
+    if (!emulator->loadProgram(programPath, quirks)) {
+        delete emulator;
+        delete frontend;
+        return 1;
+    }
+    if (aotPath != NULL && !emulator->loadRecompiled(aotPath)) {
+        delete emulator;
+        delete frontend;
+        return 1;
+    }
+
+    if (headless) {
+        turbo = true;
+        if (frames == 0) {
+            frames = 36000;
+        }
+    }
+    emulator->setCore(core);
+    emulator->setTurbo(turbo);
+    emulator->setSpeed(speed);
+    emulator->setInstPerSecond(instPerSecond);
+    emulator->setFrameLimit(frames);
+    if (!seedGiven && !headless) {
+        seed = (uint32_t) std::chrono::system_clock::now().time_since_epoch().count();
+    }
+    emulator->setSeed(seed);
+
+    // A recording has to run straight through, so it can't be rewound
+    InputLog log;
+    if (recordPath != NULL) {
+        log.program = programPath;
+        log.seed = seed;
+        log.instPerSecond = instPerSecond;
+        log.quirks = quirks;
+        emulator->recordInput(&log);
+        if (rewindMegabytes > 0) {
+            printf("Rewinding is off while recording.\n");
+        }
+        rewindMegabytes = 0;
+    }
+    if (rewindMegabytes < 0) {
+        rewindMegabytes = headless ? 0 : 16;
+    }
+    emulator->setRewindBudget((size_t) (rewindMegabytes * 1024 * 1024));
+    emulator->setProfiling(profiling);
+    emulator->setIdleSkipping(idleSkipping);
+    emulator->setAudio(sampleRate);
+    emulator->setEmulationThread(!headless && !singleThread);
+    emulator->start();
+
+    if (profiling) {
+        printf("\n");
+        emulator->printProfile(stdout);
+    }
+
+    if (recordPath != NULL) {
+        log.endCycle = emulator->getInstExecuted();
+        log.endFramebufferHash = emulator->framebufferHash();
+        if (log.save(recordPath)) {
+            printf("Recorded %lu key events to %s\n", (unsigned long) log.events.size(), recordPath);
+        }
+    }
+
+    delete emulator;
+    delete frontend;
+    return 0;
+}
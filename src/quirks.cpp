@@ -0,0 +1,19 @@
+#include "quirks.h"
+
+#include <cstring>
+
+static const char* const profileNames[] = {"modern", "vip", "chip48", "schip"};
+
+bool parseQuirkProfile(const char* name, QuirkProfile &profile) {
+    for (int i = 0; i < (int) (sizeof(profileNames) / sizeof(profileNames[0])); ++i){
+        if (strcmp(name, profileNames[i]) == 0){
+            profile = (QuirkProfile) i;
+            return true;
+        }
+    }
+    return false;
+}
+
+const char* quirkProfileName(QuirkProfile profile) {
+    return profileNames[(int) profile];
+}
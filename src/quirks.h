@@ -0,0 +1,60 @@
+#pragma once
+
+/* CHIP-8 variants disagree on what a few instructions do. A quirk profile describes one variant's choices as
+ * compile-time constants, and the handlers that differ are templates on it, so each profile gets its own copy of the
+ * interpreter with its choices folded in instead of tested on every instruction.
+ */
+
+// What FX55 and FX65 leave in I
+enum class IndexAfterMemory {
+    Unchanged,      // I is left where it was
+    PlusX,          // I += X, one short of the last register (CHIP-48)
+    PlusXPlusOne    // I += X + 1, just past the last register (COSMAC VIP)
+};
+
+// This emulator's behaviour before profiles existed, and still the default: 8XY6/8XYE shift VX in place, FX55/FX65
+// leave I alone, BNNN adds V0 and sprites clip at the screen edges
+struct ModernQuirks {
+    static constexpr bool shiftsUseVY = false;          // 8XY6/8XYE shift VY into VX, rather than VX in place
+    static constexpr IndexAfterMemory indexAfterMemory = IndexAfterMemory::Unchanged;
+    static constexpr bool jumpUsesVX = false;           // BNNN is BXNN, adding VX rather than V0
+    static constexpr bool spritesWrap = false;          // Sprites wrap round the screen edges rather than clip
+};
+
+// The original interpreter on the COSMAC VIP
+struct VipQuirks {
+    static constexpr bool shiftsUseVY = true;
+    static constexpr IndexAfterMemory indexAfterMemory = IndexAfterMemory::PlusXPlusOne;
+    static constexpr bool jumpUsesVX = false;
+    static constexpr bool spritesWrap = false;
+};
+
+// CHIP-48 on the HP-48 calculators
+struct Chip48Quirks {
+    static constexpr bool shiftsUseVY = false;
+    static constexpr IndexAfterMemory indexAfterMemory = IndexAfterMemory::PlusX;
+    static constexpr bool jumpUsesVX = true;
+    static constexpr bool spritesWrap = false;
+};
+
+// SUPER-CHIP 1.1 (only the behaviour of the CHIP-8 instructions; its extra instructions aren't supported)
+struct SuperChipQuirks {
+    static constexpr bool shiftsUseVY = false;
+    static constexpr IndexAfterMemory indexAfterMemory = IndexAfterMemory::Unchanged;
+    static constexpr bool jumpUsesVX = true;
+    static constexpr bool spritesWrap = false;
+};
+
+// The profiles, for picking one at run time (see Emulator::loadProgram)
+enum class QuirkProfile {
+    Modern,
+    Vip,
+    Chip48,
+    SuperChip
+};
+
+// Parses a profile name: modern, vip, chip48 or schip. Returns false if it isn't one.
+bool parseQuirkProfile(const char* name, QuirkProfile &profile);
+
+// Returns the name parseQuirkProfile reads for the profile
+const char* quirkProfileName(QuirkProfile profile);
@@ -0,0 +1,337 @@
+#include <deque>
+#include <map>
+#include <set>
+#include <vector>
+
+#include "recompiler.h"
+#include "aot.h"
+#include "emulator.h"
+
+// Longest block, so that blocks cut short by the end of a frame leave little to the interpreter
+static const int maxBlockLength = 32;
+
+namespace {
+
+// How a block ends, after its last recompiled instruction
+enum class Exit {
+    Terminator,     // The last instruction is a jump, call, return or skip, and transfers control itself
+    Interpret,      // The next instruction is left to the interpreter
+    FallThrough     // The block was cut off (at the maximum length or the end of the program)
+};
+
+struct Block {
+    uint16_t start;
+    std::vector<uint16_t> instructions;
+    Exit exit;
+    uint16_t next;  // Address after the last recompiled instruction
+};
+
+}
+
+/* Writes the code that continues at target: a jump to its block if it has one, or else a return to the interpreter.
+ */
+static void transfer(FILE* out, const std::map<uint16_t, Block> &blocks, uint16_t target, const char* indent) {
+    if (blocks.count(target)){
+        fprintf(out, "%sgoto b%03X;\n", indent, target);
+    } else {
+        fprintf(out, "%ss.programCounter = 0x%03X;\n%sreturn done;\n", indent, target, indent);
+    }
+}
+
+/* Writes the code that counts the instructions run and leaves the one at address to the interpreter.
+ */
+static void interpret(FILE* out, int done, uint16_t address) {
+    if (done > 0){
+        fprintf(out, "                done += %d;\n", done);
+    }
+    fprintf(out, "                s.programCounter = 0x%03X;\n                return done;\n", address);
+}
+
+/* Returns the C++ for an instruction that only touches the machine state and falls through to the next one.
+ */
+std::string Recompiler::statement(uint16_t instruction) {
+    Emulator::Op op = Emulator::opTable()[instruction];
+    unsigned x = (instruction >> 8) & 0xF;
+    unsigned y = (instruction >> 4) & 0xF;
+    unsigned nn = instruction & 0xFF;
+    unsigned nnn = instruction & 0xFFF;
+
+    char text[160];
+    switch (op){
+    case Emulator::Op::SetRegToVal:
+        snprintf(text, sizeof(text), "s.vRegs[0x%X] = 0x%02X;", x, nn);
+        break;
+    case Emulator::Op::AddValToReg:
+        snprintf(text, sizeof(text), "s.vRegs[0x%X] += 0x%02X;", x, nn);
+        break;
+    case Emulator::Op::SetRegToReg:
+        snprintf(text, sizeof(text), "s.vRegs[0x%X] = s.vRegs[0x%X];", x, y);
+        break;
+    case Emulator::Op::OrRegToReg:
+        snprintf(text, sizeof(text), "s.vRegs[0x%X] |= s.vRegs[0x%X];", x, y);
+        break;
+    case Emulator::Op::AndRegToReg:
+        snprintf(text, sizeof(text), "s.vRegs[0x%X] &= s.vRegs[0x%X];", x, y);
+        break;
+    case Emulator::Op::XorRegToReg:
+        snprintf(text, sizeof(text), "s.vRegs[0x%X] ^= s.vRegs[0x%X];", x, y);
+        break;
+    case Emulator::Op::AddRegToReg:
+        snprintf(text, sizeof(text), "s.vRegs[0x%X] += s.vRegs[0x%X]; s.vRegs[0xF] = s.vRegs[0x%X] < s.vRegs[0x%X];",
+                 x, y, x, y);
+        break;
+    case Emulator::Op::SubSRegFromDReg:
+        snprintf(text, sizeof(text), "s.vRegs[0xF] = s.vRegs[0x%X] >= s.vRegs[0x%X]; "
+                 "s.vRegs[0x%X] = s.vRegs[0x%X] - s.vRegs[0x%X];", x, y, x, x, y);
+        break;
+    case Emulator::Op::SubDRegFromSReg:
+        snprintf(text, sizeof(text), "s.vRegs[0xF] = s.vRegs[0x%X] >= s.vRegs[0x%X]; "
+                 "s.vRegs[0x%X] = s.vRegs[0x%X] - s.vRegs[0x%X];", y, x, x, y, x);
+        break;
+    case Emulator::Op::RightShift:
+        snprintf(text, sizeof(text), "s.vRegs[0xF] = s.vRegs[0x%X] & 1; s.vRegs[0x%X] >>= 1;", x, x);
+        break;
+    case Emulator::Op::LeftShift:
+        snprintf(text, sizeof(text), "s.vRegs[0xF] = (s.vRegs[0x%X] & 0x80) >> 7; s.vRegs[0x%X] <<= 1;", x, x);
+        break;
+    case Emulator::Op::SetIndex:
+        snprintf(text, sizeof(text), "s.indexRegister = 0x%03X;", nnn);
+        break;
+    case Emulator::Op::AddToIndex:
+        snprintf(text, sizeof(text), "s.indexRegister += s.vRegs[0x%X]; if (s.indexRegister >= 0x1000) s.vRegs[0xF] = 1;",
+                 x);
+        break;
+    case Emulator::Op::FontChar:
+        snprintf(text, sizeof(text), "s.indexRegister = context->fontStart + 5*(s.vRegs[0x%X] & 0xF);", x);
+        break;
+    case Emulator::Op::Random:
+        snprintf(text, sizeof(text), "s.vRegs[0x%X] = nextRandomByte(s.rngState) & 0x%02X;", x, nn);
+        break;
+    case Emulator::Op::SetRegFromDTimer:
+        snprintf(text, sizeof(text), "s.vRegs[0x%X] = s.delayTimer;", x);
+        break;
+    case Emulator::Op::SetDTimerFromReg:
+        snprintf(text, sizeof(text), "s.delayTimer = s.vRegs[0x%X];", x);
+        break;
+    case Emulator::Op::SetSTimerFromReg:
+        snprintf(text, sizeof(text), "s.soundTimer = s.vRegs[0x%X];", x);
+        break;
+    case Emulator::Op::LoadRegFromMem:
+        snprintf(text, sizeof(text), "for (int i = 0; i <= 0x%X && s.indexRegister + i < 0x1000; ++i) "
+                 "s.vRegs[i] = s.memory[s.indexRegister + i];", x);
+        break;
+    default:
+        snprintf(text, sizeof(text), "// (no operation)");
+        break;
+    }
+    return text;
+}
+
+/* Returns the condition under which a skip instruction skips.
+ */
+std::string Recompiler::skipCondition(uint16_t instruction) {
+    Emulator::Op op = Emulator::opTable()[instruction];
+    unsigned x = (instruction >> 8) & 0xF;
+    unsigned y = (instruction >> 4) & 0xF;
+    unsigned nn = instruction & 0xFF;
+
+    char text[96];
+    switch (op){
+    case Emulator::Op::SkipRegEqVal:
+        snprintf(text, sizeof(text), "s.vRegs[0x%X] == 0x%02X", x, nn);
+        break;
+    case Emulator::Op::SkipRegNeqVal:
+        snprintf(text, sizeof(text), "s.vRegs[0x%X] != 0x%02X", x, nn);
+        break;
+    case Emulator::Op::SkipRegEqReg:
+        snprintf(text, sizeof(text), "s.vRegs[0x%X] == s.vRegs[0x%X]", x, y);
+        break;
+    case Emulator::Op::SkipRegNeqReg:
+        snprintf(text, sizeof(text), "s.vRegs[0x%X] != s.vRegs[0x%X]", x, y);
+        break;
+    case Emulator::Op::SkipIfKey:
+        snprintf(text, sizeof(text), "(context->keypad >> (s.vRegs[0x%X] & 0xF)) & 1", x);
+        break;
+    default:
+        snprintf(text, sizeof(text), "!((context->keypad >> (s.vRegs[0x%X] & 0xF)) & 1)", x);
+        break;
+    }
+    return text;
+}
+
+/* Recovers the blocks reachable from 0x200, then writes a function with a labelled section per block.
+ */
+Recompiler::Summary Recompiler::recompile(const RomImage &rom, const char* name, FILE* out) {
+    const Emulator::Op* ops = Emulator::opTable();
+    const uint8_t* bytes = rom.data();
+    const uint32_t end = 0x200 + rom.size();
+    auto fetch = [&](uint16_t address){
+        return (uint16_t) ((bytes[address - 0x200] << 8) | bytes[address + 1 - 0x200]);
+    };
+
+    // Walk the control-flow graph, one block per address reached
+    std::map<uint16_t, Block> blocks;
+    std::map<uint16_t, bool> visited;
+    std::deque<uint16_t> work = {0x200};
+    while (!work.empty()){
+        uint16_t start = work.front();
+        work.pop_front();
+        if (visited[start] || start < 0x200 || start + 1u >= end){
+            continue;
+        }
+        visited[start] = true;
+
+        Block block = {start, {}, Exit::FallThrough, start};
+        uint16_t pc = start;
+        while (true){
+            if (pc + 1u >= end){
+                break;
+            }
+            if ((int) block.instructions.size() == maxBlockLength){
+                work.push_back(pc);
+                break;
+            }
+            uint16_t instruction = fetch(pc);
+            Emulator::Op op = ops[instruction];
+            if (op == Emulator::Op::ClearScreen || op == Emulator::Op::Display || op == Emulator::Op::GetKey ||
+                op == Emulator::Op::DecimalConversion || op == Emulator::Op::StoreRegToMem){
+                block.exit = Exit::Interpret;
+                work.push_back(pc + 2);
+                break;
+            }
+            block.instructions.push_back(instruction);
+            pc += 2;
+
+            if (op == Emulator::Op::Jump){
+                work.push_back(instruction & 0xFFF);
+            } else if (op == Emulator::Op::Call){
+                work.push_back(instruction & 0xFFF);
+                work.push_back(pc);
+            } else if (op == Emulator::Op::SkipRegEqVal || op == Emulator::Op::SkipRegNeqVal ||
+                       op == Emulator::Op::SkipRegEqReg || op == Emulator::Op::SkipRegNeqReg ||
+                       op == Emulator::Op::SkipIfKey || op == Emulator::Op::SkipIfNotKey){
+                work.push_back(pc);
+                work.push_back(pc + 2);
+            } else if (op != Emulator::Op::Ret && op != Emulator::Op::JumpWithOffset){
+                continue;
+            }
+            block.exit = Exit::Terminator;
+            break;
+        }
+        block.next = pc;
+        if (!block.instructions.empty()){
+            blocks[start] = block;
+        }
+    }
+
+    // Only blocks that are jumped to get labels (the rest are only reached through the switch)
+    std::set<uint16_t> labels;
+    for (const auto &entry : blocks){
+        const Block &block = entry.second;
+        uint16_t last = block.instructions.back();
+        if (block.exit == Exit::FallThrough){
+            labels.insert(block.next);
+        } else if (block.exit == Exit::Terminator && (ops[last] == Emulator::Op::Jump || ops[last] == Emulator::Op::Call)){
+            labels.insert(last & 0xFFF);
+        } else if (block.exit == Exit::Terminator && ops[last] != Emulator::Op::Ret &&
+                   ops[last] != Emulator::Op::JumpWithOffset){
+            labels.insert(block.next);
+            labels.insert(block.next + 2);
+        }
+    }
+
+    Summary summary;
+    fprintf(out, "// Recompiled from %s (%lu bytes) by chip8_aot. Build it as a shared object, e.g.\n"
+                 "//   g++ -std=c++17 -O2 -shared -fPIC -Isrc this.cpp -o this.so\n"
+                 "// and run it with: chip8 --core aot --aot this.so program.ch8\n\n", name, (unsigned long) rom.size());
+    fprintf(out, "#include \"aot.h\"\n\n");
+    fprintf(out, "extern \"C\" const int chip8AotVersion = %d;\n", aotVersion);
+    fprintf(out, "extern \"C\" const uint32_t chip8AotRomSize = %lu;\n", (unsigned long) rom.size());
+    fprintf(out, "extern \"C\" const uint8_t chip8AotRom[] = {");
+    for (size_t i = 0; i < rom.size(); ++i){
+        fprintf(out, "%s0x%02X,", i % 16 == 0 ? "\n    " : " ", bytes[i]);
+    }
+    fprintf(out, "\n};\n\n");
+
+    fprintf(out, "extern \"C\" int chip8AotRun(AotContext* context, int budget) {\n");
+    fprintf(out, "    MachineState &s = *context->state;\n");
+    fprintf(out, "    const uint64_t valid = context->validPages;\n");
+    fprintf(out, "    int done = 0;\n");
+    fprintf(out, "    for (;;) {\n");
+    fprintf(out, "        switch (s.programCounter) {\n");
+    for (const auto &entry : blocks){
+        const Block &block = entry.second;
+        int length = block.instructions.size();
+        uint64_t pages = 0;
+        for (uint16_t page = block.start >> 6; page <= ((block.next - 1) >> 6); ++page){
+            pages |= 1ULL << page;
+        }
+        ++summary.blocks;
+        summary.instructions += length;
+
+        fprintf(out, "\n        case 0x%03X:\n", block.start);
+        if (labels.count(block.start)){
+            fprintf(out, "        b%03X:\n", block.start);
+        }
+        fprintf(out, "            if (budget - done < %d || (valid & 0x%016lXULL) != 0x%016lXULL) {\n", length,
+                (unsigned long) pages, (unsigned long) pages);
+        fprintf(out, "                s.programCounter = 0x%03X;\n                return done;\n            }\n", block.start);
+
+        int straight = block.exit == Exit::Terminator ? length - 1 : length;
+        for (int i = 0; i < straight; ++i){
+            uint16_t instruction = block.instructions[i];
+            fprintf(out, "            %-70s // %03X  %04X  %s\n", statement(instruction).c_str(),
+                    block.start + 2*i, instruction, Emulator::disassemble(instruction).c_str());
+        }
+
+        if (block.exit == Exit::Interpret){
+            fprintf(out, "            done += %d;\n            s.programCounter = 0x%03X;  // Left to the interpreter: %s\n"
+                         "            return done;\n", length, block.next,
+                    Emulator::disassemble(fetch(block.next)).c_str());
+            continue;
+        }
+        if (block.exit == Exit::FallThrough){
+            fprintf(out, "            done += %d;\n", length);
+            transfer(out, blocks, block.next, "            ");
+            continue;
+        }
+
+        uint16_t address = block.next - 2;
+        uint16_t instruction = block.instructions.back();
+        Emulator::Op op = ops[instruction];
+        fprintf(out, "            // %03X  %04X  %s\n", address, instruction, Emulator::disassemble(instruction).c_str());
+        switch (op){
+        case Emulator::Op::Jump:
+            fprintf(out, "            done += %d;\n", length);
+            transfer(out, blocks, instruction & 0xFFF, "            ");
+            break;
+        case Emulator::Op::Call:
+            // A full stack is an error the interpreter reports
+            fprintf(out, "            if (s.stackPointer >= MachineState::stackSize) {\n");
+            interpret(out, length - 1, address);
+            fprintf(out, "            }\n");
+            fprintf(out, "            s.addressStack[s.stackPointer++] = 0x%03X;\n            done += %d;\n", block.next, length);
+            transfer(out, blocks, instruction & 0xFFF, "            ");
+            break;
+        case Emulator::Op::Ret:
+            fprintf(out, "            if (s.stackPointer == 0) {\n");
+            interpret(out, length - 1, address);
+            fprintf(out, "            }\n");
+            fprintf(out, "            s.programCounter = s.addressStack[--s.stackPointer];\n            done += %d;\n"
+                         "            continue;\n", length);
+            break;
+        case Emulator::Op::JumpWithOffset:
+            fprintf(out, "            s.programCounter = 0x%03X + s.vRegs[0x0];\n            done += %d;\n            continue;\n",
+                    instruction & 0xFFF, length);
+            break;
+        default:
+            fprintf(out, "            done += %d;\n            if (%s) {\n", length, skipCondition(instruction).c_str());
+            transfer(out, blocks, block.next + 2, "                ");
+            fprintf(out, "            }\n");
+            transfer(out, blocks, block.next, "            ");
+            break;
+        }
+    }
+    fprintf(out, "\n        default:\n            return done;\n        }\n    }\n}\n");
+    return summary;
+}
@@ -0,0 +1,34 @@
+#pragma once
+
+#include <stdio.h>
+#include <string>
+
+#include "rom_image.h"
+
+/* Recompiles a CHIP-8 program ahead of time into C++ source (the chip8_aot tool), to be built as a shared object and
+ * run by Core::Aot. See aot.h for the interface the source implements.
+ *
+ * The control-flow graph is recovered from the entry point at 0x200 by following jumps (1NNN), calls and the addresses
+ * they return to (2NNN), both sides of skips, and the instruction after anything left to the interpreter. Each basic
+ * block becomes a labelled run of straight-line C++ in a single function. Blocks whose successors are known go straight
+ * to them; returns (00EE) and indirect jumps (BNNN) go back through a switch on the program counter.
+ *
+ * Drawing (00E0, DXYN) and key waits (FX0A) need more than the machine state, and stores (FX33, FX55) might rewrite
+ * code, so those are left to the interpreter, as is any address the graph doesn't reach. The generated code mirrors the
+ * Emulator's handlers statement for statement, so it behaves exactly like the interpreter.
+ */
+class Recompiler {
+    private:
+        // C++ for an instruction that only changes the machine state, and for the condition a skip skips on
+        static std::string statement(uint16_t instruction);
+        static std::string skipCondition(uint16_t instruction);
+
+    public:
+        struct Summary {
+            int blocks = 0;
+            int instructions = 0;       // Instructions recompiled, over all blocks
+        };
+
+        // Writes the C++ for the program to out (name only goes in a comment)
+        static Summary recompile(const RomImage &rom, const char* name, FILE* out);
+};
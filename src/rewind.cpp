@@ -0,0 +1,152 @@
+#include "rewind.h"
+
+#include <cstring>
+
+// The state is handled as an array of words. Its size is a multiple of its 64-byte alignment, so none are partial.
+static const size_t stateWords = sizeof(MachineState) / sizeof(uint64_t);
+static_assert(sizeof(MachineState) % sizeof(uint64_t) == 0, "MachineState must be a whole number of words");
+static_assert(stateWords <= 0xFFFF, "run lengths are stored in 16 bits");
+
+// Each run in an encoded delta: the number of unchanged words to skip, then the number of changed words that follow
+struct RunHeader {
+    uint16_t skip;
+    uint16_t count;
+};
+
+RewindBuffer::RewindBuffer(size_t budgetBytes) : ring(budgetBytes), scratch(stateWords * 12 + sizeof(RunHeader)) {
+}
+
+/* Encodes from XOR to into scratch, as runs of unchanged and changed words. Returns the encoded length.
+ * A change at the very end needs no terminator: decoding stops when the runs cover the whole state.
+ */
+size_t RewindBuffer::encode(const MachineState &from, const MachineState &to) {
+    const uint64_t* a = (const uint64_t*) &from;
+    const uint64_t* b = (const uint64_t*) &to;
+    uint8_t* out = scratch.data();
+    size_t length = 0;
+
+    size_t word = 0;
+    while (word < stateWords){
+        size_t skipStart = word;
+        while (word < stateWords && a[word] == b[word]){
+            ++word;
+        }
+        if (word == stateWords){
+            break;
+        }
+        size_t changedStart = word;
+        while (word < stateWords && a[word] != b[word]){
+            ++word;
+        }
+
+        RunHeader header = {(uint16_t) (changedStart - skipStart), (uint16_t) (word - changedStart)};
+        memcpy(out + length, &header, sizeof(header));
+        length += sizeof(header);
+        for (size_t i = changedStart; i < word; ++i){
+            uint64_t delta = a[i] ^ b[i];
+            memcpy(out + length, &delta, sizeof(delta));
+            length += sizeof(delta);
+        }
+    }
+    return length;
+}
+
+/* XORs an encoded delta into the state, turning one frame into its neighbour.
+ */
+void RewindBuffer::apply(const Record &record, MachineState &state) const {
+    uint64_t* words = (uint64_t*) &state;
+    const uint8_t* in = ring.data() + record.offset;
+    const uint8_t* end = in + record.length;
+    size_t word = 0;
+    while (in < end){
+        RunHeader header;
+        memcpy(&header, in, sizeof(header));
+        in += sizeof(header);
+        word += header.skip;
+        for (uint16_t i = 0; i < header.count; ++i, ++word){
+            uint64_t delta;
+            memcpy(&delta, in, sizeof(delta));
+            in += sizeof(delta);
+            words[word] ^= delta;
+        }
+    }
+}
+
+/* Copies the delta in scratch into the ring as the newest record, dropping the oldest records it overwrites.
+ * Records are never split: if one doesn't fit before the end of the ring, it goes to the start (and the records left
+ * between the end of the previous one and the end of the ring, which are the oldest, are dropped with it).
+ */
+void RewindBuffer::store(size_t length) {
+    if (length > ring.size()){
+        // Larger than the whole budget, so the history can't continue past this frame
+        records.clear();
+        used = 0;
+        head = 0;
+        return;
+    }
+
+    if (head + length > ring.size()){
+        while (!records.empty() && records.front().offset >= head){
+            used -= records.front().length;
+            records.pop_front();
+        }
+        head = 0;
+    }
+    while (!records.empty() && records.front().offset >= head && records.front().offset < head + length){
+        used -= records.front().length;
+        records.pop_front();
+    }
+
+    memcpy(ring.data() + head, scratch.data(), length);
+    records.push_back({head, length});
+    used += length;
+    head += length;
+}
+
+/* Records a frame. The delta from it back to the previous newest frame is stored, and it becomes the newest.
+ */
+void RewindBuffer::capture(const MachineState &state) {
+    if (haveLatest && !ring.empty()){
+        store(encode(state, latest));
+    }
+    latest = state;
+    haveLatest = true;
+}
+
+bool RewindBuffer::stepBack(MachineState &out) {
+    if (records.empty()){
+        return false;
+    }
+    apply(records.back(), latest);
+    head = records.back().offset;
+    used -= records.back().length;
+    records.pop_back();
+    out = latest;
+    return true;
+}
+
+bool RewindBuffer::restore(size_t framesBack, MachineState &out) const {
+    if (!haveLatest || framesBack > records.size()){
+        return false;
+    }
+    out = latest;
+    for (size_t i = 0; i < framesBack; ++i){
+        apply(records[records.size() - 1 - i], out);
+    }
+    return true;
+}
+
+size_t RewindBuffer::frames() const {
+    return haveLatest ? records.size() + 1 : 0;
+}
+
+size_t RewindBuffer::bytesUsed() const {
+    return used;
+}
+
+void RewindBuffer::clear() {
+    records.clear();
+    head = 0;
+    used = 0;
+    haveLatest = false;
+}
@@ -0,0 +1,55 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <vector>
+
+#include "machine_state.h"
+
+/* A history of machine states, one per frame, for rewinding and stepping backwards.
+ *
+ * Only the newest state is kept whole. Every older frame is stored as the XOR of it and the frame after it, run-length
+ * encoded in 8-byte words: most frames only change a few registers and display rows, so the XOR is almost all zeros and
+ * a frame typically takes tens of bytes. Walking back from the newest state applies one delta per frame.
+ *
+ * The deltas are kept in a ring of a fixed number of bytes. When it is full, the oldest frames are dropped.
+ */
+class RewindBuffer {
+    public:
+        explicit RewindBuffer(size_t budgetBytes);
+
+        // Records the state at the end of a frame
+        void capture(const MachineState &state);
+
+        // Drops the newest frame, and sets out to the one before it. Returns false if there is no earlier frame.
+        bool stepBack(MachineState &out);
+
+        // Sets out to the frame framesBack frames before the newest (0 being the newest) without dropping anything.
+        // Returns false if that frame is no longer (or not yet) in the history.
+        bool restore(size_t framesBack, MachineState &out) const;
+
+        // Number of frames that can be restored, and the bytes their deltas take up
+        size_t frames() const;
+        size_t bytesUsed() const;
+
+        void clear();
+
+    private:
+        struct Record {
+            size_t offset;          // Where the encoded delta starts in ring
+            size_t length;
+        };
+
+        std::vector<uint8_t> ring;
+        std::deque<Record> records;     // Oldest first; the newest record turns the newest state into the one before
+        size_t head = 0;                // Where the next record is written
+        size_t used = 0;
+        MachineState latest;
+        bool haveLatest = false;
+        std::vector<uint8_t> scratch;   // Encoding space for the worst case (every other word different)
+
+        size_t encode(const MachineState &from, const MachineState &to);
+        void apply(const Record &record, MachineState &state) const;
+        void store(size_t length);
+};
@@ -0,0 +1,90 @@
+#include <stdio.h>
+
+#ifdef _WIN32
+#include <fstream>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#include "rom_image.h"
+
+RomImage::~RomImage() {
+#ifndef _WIN32
+    if (mapping != NULL){
+        munmap(mapping, mappingLength);
+    }
+#endif
+}
+
+/* Maps the file, checking that it is a program that fits in memory.
+ */
+std::shared_ptr<const RomImage> RomImage::load(const char* path) {
+    std::shared_ptr<RomImage> image(new RomImage());
+
+#ifdef _WIN32
+    std::ifstream file(path, std::ios::binary | std::ios::ate);
+    if (!file){
+        printf("Error opening program %s\n", path);
+        return NULL;
+    }
+    size_t size = (size_t) file.tellg();
+    if (size > 0 && size <= maxSize){
+        image->copy.resize(size);
+        file.seekg(0);
+        if (!file.read((char*) image->copy.data(), size)){
+            printf("Error reading program %s\n", path);
+            return NULL;
+        }
+        image->bytes = image->copy.data();
+    }
+#else
+    int file = open(path, O_RDONLY);
+    if (file < 0){
+        printf("Error opening program %s\n", path);
+        return NULL;
+    }
+    struct stat status;
+    if (fstat(file, &status) != 0 || !S_ISREG(status.st_mode)){
+        printf("Error opening program %s: not a regular file\n", path);
+        close(file);
+        return NULL;
+    }
+    size_t size = (size_t) status.st_size;
+    if (size > 0 && size <= maxSize){
+        void* mapping = mmap(NULL, size, PROT_READ, MAP_PRIVATE, file, 0);
+        if (mapping == MAP_FAILED){
+            printf("Error mapping program %s\n", path);
+            close(file);
+            return NULL;
+        }
+        image->mapping = mapping;
+        image->mappingLength = size;
+        image->bytes = (const uint8_t*) mapping;
+    }
+    // The mapping stays valid after the file is closed
+    close(file);
+#endif
+
+    if (size == 0){
+        printf("Error loading program %s: the file is empty\n", path);
+        return NULL;
+    }
+    if (size > maxSize){
+        printf("Error loading program %s: it is %lu bytes, but only %lu fit in memory above 0x200\n", path,
+               (unsigned long) size, (unsigned long) maxSize);
+        return NULL;
+    }
+    image->length = size;
+    return image;
+}
+
+const uint8_t* RomImage::data() const {
+    return bytes;
+}
+
+size_t RomImage::size() const {
+    return length;
+}
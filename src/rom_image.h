@@ -0,0 +1,38 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+/* A program file, loaded once and then shared read-only by every emulator that runs it (see Emulator::loadProgram).
+ *
+ * The file is mapped into memory rather than read into a buffer, so loading is a single mmap and the bytes are the OS
+ * page cache's own. Programs are loaded at 0x200, so files larger than the 3584 bytes above that are rejected.
+ */
+class RomImage {
+    private:
+        const uint8_t* bytes = NULL;
+        size_t length = 0;
+
+        // The file's mapping, or a copy of it on hosts without mmap
+        void* mapping = NULL;
+        size_t mappingLength = 0;
+        std::vector<uint8_t> copy;
+
+        RomImage() {}
+
+    public:
+        static const size_t maxSize = 0x1000 - 0x200;
+
+        ~RomImage();
+        RomImage(const RomImage &) = delete;
+        RomImage &operator=(const RomImage &) = delete;
+
+        // Loads a program file. Returns NULL (after describing the problem) if it can't be read, is empty or is too
+        // large to fit in memory.
+        static std::shared_ptr<const RomImage> load(const char* path);
+
+        const uint8_t* data() const;
+        size_t size() const;
+};
@@ -0,0 +1,275 @@
+#include <algorithm>
+#include <fstream>
+#include <sstream>
+
+#include "sdl_frontend.h"
+#include "emulator.h"
+
+/* Sets up the default keymap (see the header). The window isn't created until init.
+ */
+SdlFrontend::SdlFrontend() {
+    const SDL_Scancode defaults[16] = {
+        SDL_SCANCODE_X, SDL_SCANCODE_1, SDL_SCANCODE_2, SDL_SCANCODE_3,     // 0 - 3
+        SDL_SCANCODE_Q, SDL_SCANCODE_W, SDL_SCANCODE_E, SDL_SCANCODE_A,     // 4 - 7
+        SDL_SCANCODE_S, SDL_SCANCODE_D, SDL_SCANCODE_Z, SDL_SCANCODE_C,     // 8 - B
+        SDL_SCANCODE_4, SDL_SCANCODE_R, SDL_SCANCODE_F, SDL_SCANCODE_V      // C - F
+    };
+    std::fill(keymap, keymap + SDL_NUM_SCANCODES, 0xFF);
+    for (uint8_t key = 0; key < 16; ++key){
+        keymap[defaults[key]] = key;
+    }
+}
+
+/* Closes the audio device, destroys the texture, renderer and window, and shuts SDL down.
+ */
+SdlFrontend::~SdlFrontend() {
+    if (audioDevice != 0) {
+        SDL_CloseAudioDevice(audioDevice);
+    }
+    if (texture != NULL) {
+        SDL_DestroyTexture(texture);
+    }
+    if (renderer != NULL) {
+        SDL_DestroyRenderer(renderer);
+    }
+    if (window != NULL) {
+        SDL_DestroyWindow(window);
+    }
+    SDL_Quit();
+}
+
+/* Attempts to initialize SDL and create the window, along with a renderer and a texture the size of the CHIP-8 display.
+ */
+bool SdlFrontend::init(uint8_t width, uint8_t height) {
+    this->width = width;
+    this->height = height;
+
+    if (SDL_Init(SDL_INIT_VIDEO) < 0) {
+        printf("SDL could not initialize! SDL_Error: %s\n", SDL_GetError());
+        return false;
+    }
+
+    window = SDL_CreateWindow("CHIP-8 Emulator", SDL_WINDOWPOS_UNDEFINED, SDL_WINDOWPOS_UNDEFINED, width*pixelScale, height*pixelScale, SDL_WINDOW_SHOWN | SDL_WINDOW_RESIZABLE);
+    if (window == NULL) {
+        printf("Window could not be created! SDL_Error: %s\n", SDL_GetError());
+        return false;
+    }
+
+    // Presents are already paced by the emulator's frames, so the renderer doesn't wait for vsync on top of that
+    renderer = SDL_CreateRenderer(window, -1, SDL_RENDERER_ACCELERATED);
+    if (renderer == NULL) {
+        printf("Renderer could not be created! SDL_Error: %s\n", SDL_GetError());
+        return false;
+    }
+
+    // Keep the pixels sharp when scaling up, and letterbox if the window isn't 2:1
+    SDL_SetHint(SDL_HINT_RENDER_SCALE_QUALITY, "nearest");
+    SDL_RenderSetLogicalSize(renderer, width, height);
+
+    texture = SDL_CreateTexture(renderer, SDL_PIXELFORMAT_ARGB8888, SDL_TEXTUREACCESS_STREAMING, width, height);
+    if (texture == NULL) {
+        printf("Texture could not be created! SDL_Error: %s\n", SDL_GetError());
+        return false;
+    }
+
+    // Start from a black screen
+    SDL_RenderClear(renderer);
+    SDL_RenderPresent(renderer);
+    return true;
+}
+
+/* Opens the default audio device, paused until playAudio has queued enough to start it. SDL converts from the
+ * requested format if the device wants another, so the ring always holds the emulator's samples as they are.
+ */
+bool SdlFrontend::openAudio(int sampleRate, uint16_t bufferSamples) {
+    if (SDL_InitSubSystem(SDL_INIT_AUDIO) < 0) {
+        printf("SDL audio could not initialize! SDL_Error: %s\n", SDL_GetError());
+        return false;
+    }
+
+    SDL_AudioSpec wanted = {};
+    SDL_AudioSpec obtained;
+    wanted.freq = sampleRate;
+    wanted.format = AUDIO_S16SYS;
+    wanted.channels = 1;
+    wanted.samples = bufferSamples;
+    wanted.callback = audioCallback;
+    wanted.userdata = this;
+    audioDevice = SDL_OpenAudioDevice(NULL, 0, &wanted, &obtained, SDL_AUDIO_ALLOW_SAMPLES_CHANGE);
+    if (audioDevice == 0) {
+        printf("Audio device could not be opened! SDL_Error: %s\n", SDL_GetError());
+        return false;
+    }
+
+    // Starting with a device buffer and a frame queued means the device still has a buffer's worth left when the next
+    // frame arrives. The ring has room for two frames more than that, to absorb frames arriving early or late.
+    size_t frameSamples = sampleRate / 60 + 1;
+    audioStartLevel = obtained.samples + frameSamples;
+    audioRing.reset(new SpscRing<int16_t>(audioStartLevel + 2 * frameSamples));
+    audioBufferMs = 1000.0 * obtained.samples / sampleRate;
+    return true;
+}
+
+/* Runs on SDL's audio thread: fills the device's buffer from the ring, and with silence if the ring runs out.
+ */
+void SdlFrontend::audioCallback(void* userdata, Uint8* stream, int length) {
+    SdlFrontend* frontend = (SdlFrontend*) userdata;
+    int16_t* samples = (int16_t*) stream;
+    size_t wanted = length / sizeof(int16_t);
+    size_t got = frontend->audioRing->pop(samples, wanted);
+    std::fill(samples + got, samples + wanted, 0);
+
+    frontend->audioCallbacks.fetch_add(1, std::memory_order_relaxed);
+    if (got < wanted) {
+        frontend->audioUnderruns.fetch_add(1, std::memory_order_relaxed);
+        frontend->audioSilence.fetch_add(wanted - got, std::memory_order_relaxed);
+    }
+}
+
+/* Queues a frame's samples for the device (dropping what doesn't fit), and starts the device once enough are queued.
+ */
+void SdlFrontend::playAudio(const int16_t* samples, size_t count) {
+    if (audioDevice == 0) {
+        return;
+    }
+    audioDropped += count - audioRing->push(samples, count);
+    if (!audioPlaying && audioRing->size() >= audioStartLevel) {
+        SDL_PauseAudioDevice(audioDevice, 0);
+        audioPlaying = true;
+    }
+}
+
+/* Stops the device (so the silence after the last frame isn't counted as underruns) and reports how audio went.
+ */
+void SdlFrontend::finishSession(FILE* out) {
+    if (audioDevice == 0) {
+        return;
+    }
+    SDL_PauseAudioDevice(audioDevice, 1);
+    audioPlaying = false;
+    fprintf(out, "Audio: %.1f ms device buffer, %lu callbacks, %lu underruns (%lu samples of silence), %lu samples dropped\n",
+            audioBufferMs, (unsigned long) audioCallbacks.load(), (unsigned long) audioUnderruns.load(),
+            (unsigned long) audioSilence.load(), (unsigned long) audioDropped);
+}
+
+/* Reads a keymap file: a CHIP-8 key in hex and an SDL key name (as SDL_GetScancodeFromName takes) on each line.
+ */
+bool SdlFrontend::loadKeymap(const char* path) {
+    std::ifstream file(path);
+    if (!file){
+        printf("Error opening keymap %s\n", path);
+        return false;
+    }
+
+    uint8_t loaded [SDL_NUM_SCANCODES];
+    std::fill(loaded, loaded + SDL_NUM_SCANCODES, 0xFF);
+    std::string line;
+    for (int lineNumber = 1; std::getline(file, line); ++lineNumber){
+        std::istringstream fields(line.substr(0, line.find('#')));
+        unsigned key;
+        std::string name;
+        if (!(fields >> std::hex >> key)){
+            if (fields.eof()){
+                continue;
+            }
+        } else if (std::getline(fields >> std::ws, name)){
+            // Names can contain spaces ("Keypad 0"), but not trailing ones
+            name.erase(name.find_last_not_of(" \t\r") + 1);
+            SDL_Scancode scancode = SDL_GetScancodeFromName(name.c_str());
+            if (key <= 0xF && scancode != SDL_SCANCODE_UNKNOWN){
+                loaded[scancode] = key;
+                continue;
+            }
+        }
+        printf("%s:%d: can't read \"%s\"\n", path, lineNumber, line.c_str());
+        return false;
+    }
+    std::copy(loaded, loaded + SDL_NUM_SCANCODES, keymap);
+    return true;
+}
+
+bool SdlFrontend::processEvents(Emulator &emulator) {
+    SDL_Event e;
+    while (SDL_PollEvent(&e) != 0){
+        if (!handleEvent(emulator, e)){
+            return false;
+        }
+    }
+    return true;
+}
+
+/* Sleeps until an SDL event arrives or the timeout passes, then processes all pending events.
+ */
+bool SdlFrontend::waitEvents(Emulator &emulator, uint32_t timeoutMs) {
+    SDL_Event e;
+    if (SDL_WaitEventTimeout(&e, timeoutMs) != 0 && !handleEvent(emulator, e)){
+        return false;
+    }
+    return processEvents(emulator);
+}
+
+/* Handles a single SDL event. Returns false if it asks to quit.
+ */
+bool SdlFrontend::handleEvent(Emulator &emulator, const SDL_Event &e) {
+    switch (e.type){
+    case SDL_QUIT:
+        return false;
+    case SDL_WINDOWEVENT:
+        // The window may have been resized or uncovered, so draw the current frame again
+        if (anythingShown){
+            render();
+        }
+        break;
+    case SDL_KEYDOWN:
+    case SDL_KEYUP: {
+        // Backspace plays the session backwards while it is held
+        if (e.key.keysym.scancode == SDL_SCANCODE_BACKSPACE){
+            emulator.setRewinding(e.type == SDL_KEYDOWN);
+            break;
+        }
+        // Key repeats don't change anything, so only actual presses and releases reach the emulator
+        uint8_t key = keymap[e.key.keysym.scancode];
+        if (key != 0xFF && e.key.repeat == 0){
+            emulator.setKey(key, e.type == SDL_KEYDOWN);
+        }
+        break;
+    }
+
+    default:
+        break;
+    }
+    return true;
+}
+
+/* Shows the framebuffer, unless it is the same as what is already on the window.
+ */
+void SdlFrontend::present(const uint64_t framebuffer[32]) {
+    if (anythingShown && std::equal(framebuffer, framebuffer + height, shown)){
+        return;
+    }
+    std::copy(framebuffer, framebuffer + height, shown);
+    anythingShown = true;
+    render();
+}
+
+/* Converts the shown framebuffer into the texture, and presents that scaled to the window.
+ */
+void SdlFrontend::render() {
+    void* texturePixels;
+    int pitch;
+    if (SDL_LockTexture(texture, NULL, &texturePixels, &pitch) != 0){
+        return;
+    }
+    for (uint8_t y = 0; y < height; ++y){
+        uint32_t* row = (uint32_t*) ((uint8_t*) texturePixels + y*pitch);
+        uint64_t bits = shown[y];
+        for (uint8_t x = 0; x < width; ++x, bits <<= 1){
+            row[x] = (bits >> 63) ? 0xFFFFFFFF : 0xFF000000;
+        }
+    }
+    SDL_UnlockTexture(texture);
+
+    SDL_RenderClear(renderer);
+    SDL_RenderCopy(renderer, texture, NULL, NULL);
+    SDL_RenderPresent(renderer);
+}
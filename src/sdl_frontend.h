@@ -0,0 +1,78 @@
+#pragma once
+
+#include <SDL2/SDL.h>
+#include <atomic>
+#include <memory>
+
+#include "frontend.h"
+#include "spsc_ring.h"
+
+/* Frontend that draws to an SDL window and reads the keyboard.
+ *
+ * The framebuffer is converted into a 64x32 streaming texture, and the renderer scales it up to the window (which can be
+ * resized). Presenting is skipped when the framebuffer hasn't changed since the last frame shown.
+ *
+ * By default the CHIP-8 keypad is mapped onto the left side of a QWERTY keyboard:
+ *   1 2 3 C        1 2 3 4
+ *   4 5 6 D   <-   Q W E R
+ *   7 8 9 E        A S D F
+ *   A 0 B F        Z X C V
+ * A keymap file replaces that, with a line per key: the CHIP-8 key in hex, then the SDL name of the keyboard key,
+ * e.g. "5 W" or "0 Keypad 0" (# starts a comment). A CHIP-8 key can be on several keyboard keys.
+ *
+ * Holding Backspace rewinds (when the emulator keeps a rewind history).
+ *
+ * Audio (after openAudio) is played through an SDL audio device. The core's thread pushes each frame's samples into a
+ * wait-free ring, and the device's callback pops what it needs from there, so neither ever blocks the other. The device
+ * starts once the ring holds a device buffer and a frame, and plays silence (counted as an underrun) if it ever runs
+ * dry. Samples that don't fit, because the core is running ahead of real time, are dropped.
+ */
+class SdlFrontend : public Frontend {
+    private:
+        SDL_Window* window = NULL;
+        SDL_Renderer* renderer = NULL;
+        SDL_Texture* texture = NULL;
+        uint16_t pixelScale = 16;
+        uint8_t width = 64;
+        uint8_t height = 32;
+
+        // What is currently on the window, so unchanged frames don't have to be presented again
+        uint64_t shown [32] = {};
+        bool anythingShown = false;
+
+        // CHIP-8 key (0x0 - 0xF) for each scancode, or 0xFF if it isn't mapped
+        uint8_t keymap [SDL_NUM_SCANCODES];
+
+        // Audio, when a device is open. The counters are written on the device's thread and read at the end.
+        SDL_AudioDeviceID audioDevice = 0;
+        std::unique_ptr<SpscRing<int16_t>> audioRing;
+        size_t audioStartLevel = 0;         // Samples queued before the device is started
+        bool audioPlaying = false;
+        double audioBufferMs = 0;
+        std::atomic<uint64_t> audioCallbacks{0};
+        std::atomic<uint64_t> audioUnderruns{0};    // Callbacks that found fewer samples than they needed...
+        std::atomic<uint64_t> audioSilence{0};      // ...and the samples of silence played in their place
+        uint64_t audioDropped = 0;
+        static void audioCallback(void* userdata, Uint8* stream, int length);
+
+        bool handleEvent(Emulator &emulator, const SDL_Event &e);
+        void render();
+
+    public:
+        SdlFrontend();
+        ~SdlFrontend();
+
+        // Replaces the keymap with one read from a file. Returns false (keeping the old one) if it can't be read.
+        bool loadKeymap(const char* path);
+
+        // Opens the audio device for mono samples at sampleRate, with a buffer of bufferSamples samples (smaller is less
+        // latency, larger is fewer underruns). Returns false if there is no usable audio device.
+        bool openAudio(int sampleRate, uint16_t bufferSamples);
+
+        bool init(uint8_t width, uint8_t height) override;
+        bool processEvents(Emulator &emulator) override;
+        bool waitEvents(Emulator &emulator, uint32_t timeoutMs) override;
+        void present(const uint64_t framebuffer[32]) override;
+        void playAudio(const int16_t* samples, size_t count) override;
+        void finishSession(FILE* out) override;
+};
@@ -0,0 +1,786 @@
+#include "simd_engine.h"
+
+#include <algorithm>
+#include <cstring>
+#include <stdio.h>
+
+#include "emulator.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define CHIP8_AVX2_SUPPORTED 1
+#endif
+
+SimdEngine::SimdEngine() {
+    for (int lane = 0; lane < lanes; ++lane){
+        std::copy(fontSprites, std::end(fontSprites), memory[lane] + fontStart);
+        programCounter[lane] = 0x200;
+        keyPressed[lane] = 0xFF;
+        rngState[lane] = seedRandom(0);
+    }
+
+#ifdef CHIP8_AVX2_SUPPORTED
+    useAvx2 = __builtin_cpu_supports("avx2");
+#endif
+}
+
+/* Loads the program into the memory of every lane, at 0x200.
+ */
+void SimdEngine::loadProgram(const RomImage &rom){
+    for (int lane = 0; lane < lanes; ++lane){
+        memcpy(&memory[lane][0x200], rom.data(), rom.size());
+    }
+    std::fill(sharedPages, sharedPages + 64, 0xFFFFFFFF);
+}
+
+/* Spreads a MachineState out over the lane's slots. The lane only keeps sharing lane 0's fetches from the pages of its
+ * memory that are the same.
+ */
+void SimdEngine::loadState(int lane, const MachineState &state){
+    for (int r = 0; r < 16; ++r){
+        vRegs[r][lane] = state.vRegs[r];
+    }
+    programCounter[lane] = state.programCounter;
+    indexRegister[lane] = state.indexRegister;
+    delayTimer[lane] = state.delayTimer;
+    soundTimer[lane] = state.soundTimer;
+    memcpy(memory[lane], state.memory, sizeof(state.memory));
+    std::copy(state.framebuffer, state.framebuffer + 32, framebuffer[lane]);
+    std::copy(state.addressStack, state.addressStack + MachineState::stackSize, addressStack[lane]);
+    stackDepth[lane] = state.stackPointer;
+    awaitingKey[lane] = state.awaitingKey;
+    keyPressed[lane] = state.keyPressed;
+    rngState[lane] = state.rngState;
+
+    // Changing lane 0 can break the sharing of every other lane
+    for (int other = lane == 0 ? 1 : lane; other < (lane == 0 ? lanes : lane + 1); ++other){
+        for (int page = 0; page < 64; ++page){
+            if (memcmp(&memory[other][page * 64], &memory[0][page * 64], 64) == 0){
+                sharedPages[page] |= 1u << other;
+            } else {
+                sharedPages[page] &= ~(1u << other);
+            }
+        }
+    }
+}
+
+void SimdEngine::saveState(int lane, MachineState &out) const {
+    for (int r = 0; r < 16; ++r){
+        out.vRegs[r] = vRegs[r][lane];
+    }
+    out.programCounter = programCounter[lane];
+    out.indexRegister = indexRegister[lane];
+    out.delayTimer = delayTimer[lane];
+    out.soundTimer = soundTimer[lane];
+    memcpy(out.memory, memory[lane], sizeof(out.memory));
+    std::copy(framebuffer[lane], framebuffer[lane] + 32, out.framebuffer);
+    std::copy(addressStack[lane], addressStack[lane] + MachineState::stackSize, out.addressStack);
+    out.stackPointer = stackDepth[lane];
+    out.awaitingKey = awaitingKey[lane];
+    out.keyPressed = keyPressed[lane];
+    out.rngState = rngState[lane];
+}
+
+void SimdEngine::setSeed(int lane, uint32_t seed){
+    rngState[lane] = seedRandom(seed);
+}
+
+/* Records a key (0x0 - 0xF) being pressed or released on one lane, as Emulator::setKey.
+ */
+void SimdEngine::setKey(int lane, uint8_t key, bool pressed){
+    if (pressed){
+        keyStates[lane] |= 1 << (key & 0xF);
+    } else {
+        keyStates[lane] &= ~(1 << (key & 0xF));
+    }
+    if (pressed && awaitingKey[lane]){
+        keyPressed[lane] = key & 0xF;
+    }
+}
+
+void SimdEngine::setInstPerSecond(int rate){
+    instPerSecond = std::max(rate, 1);
+}
+
+/* Runs one emulated frame on every lane, with the same instruction batching as Emulator::runFrame.
+ */
+void SimdEngine::runFrame(){
+    instRemainder += instPerSecond;
+    int instructions = instRemainder / 60;
+    instRemainder %= 60;
+
+    if (useAvx2){
+        runAvx2(instructions);
+    } else {
+        for (int i = 0; i < instructions; ++i){
+            stepScalar();
+        }
+    }
+    instExecuted += instructions;
+    tickTimers();
+}
+
+bool SimdEngine::vectorized() const {
+    return useAvx2;
+}
+
+/* Executes one instruction on every lane, a lane at a time.
+ */
+void SimdEngine::stepScalar(){
+    for (int lane = 0; lane < lanes; ++lane){
+        uint16_t pc = programCounter[lane];
+        uint16_t instruction = ((uint16_t) memory[lane][pc & 0xFFF] << 8) + memory[lane][(pc + 1) & 0xFFF];
+        programCounter[lane] = pc + 2;
+        executeLane(lane, instruction);
+    }
+    writes = 0;
+}
+
+/* Notes that the lane being executed wrote memory, for checkSharedMemory.
+ */
+void SimdEngine::recordWrite(uint16_t start, uint16_t length){
+    writeStart[writes] = start;
+    writeLength[writes] = length;
+    ++writes;
+}
+
+/* Drops lanes from sharedPages where their memory no longer matches lane 0's, wherever anything was written since the
+ * last check. (A lane that skipped a store lane 0 made, or stored different values, now differs there.)
+ */
+void SimdEngine::checkSharedMemory(){
+    for (int w = 0; w < writes; ++w){
+        for (uint16_t i = 0; i < writeLength[w]; ++i){
+            uint16_t address = (writeStart[w] + i) & 0xFFF;
+            uint32_t &shared = sharedPages[address >> 6];
+            for (uint32_t others = shared & ~1u; others != 0; others &= others - 1){
+                int lane = __builtin_ctz(others);
+                if (memory[lane][address] != memory[0][address]){
+                    shared &= ~(1u << lane);
+                }
+            }
+        }
+    }
+    writes = 0;
+}
+
+#ifdef CHIP8_AVX2_SUPPORTED
+
+// Helpers for the vector path. A byte vector holds one register of all 32 lanes; a word vector holds the program
+// counters or index registers of half of them. Masks select the lanes being written.
+#define CHIP8_AVX2 __attribute__((target("avx2")))
+
+static inline CHIP8_AVX2 __m256i loadLanes(const uint8_t* lanes){
+    return _mm256_load_si256((const __m256i*) lanes);
+}
+
+static inline CHIP8_AVX2 void storeLanes(uint8_t* lanes, __m256i value, __m256i mask){
+    _mm256_store_si256((__m256i*) lanes, _mm256_blendv_epi8(loadLanes(lanes), value, mask));
+}
+
+static inline CHIP8_AVX2 void storeLanes16(uint16_t* lanes, __m256i value, __m256i mask){
+    __m256i* address = (__m256i*) lanes;
+    _mm256_store_si256(address, _mm256_blendv_epi8(_mm256_load_si256(address), value, mask));
+}
+
+// Zero-extends the bytes of half of the lanes to words
+static inline CHIP8_AVX2 __m256i widenLanes(__m256i bytes, int half){
+    return _mm256_cvtepu8_epi16(half == 0 ? _mm256_castsi256_si128(bytes) : _mm256_extracti128_si256(bytes, 1));
+}
+
+// Sign-extends the bytes of half of the lanes to words (so a byte mask becomes a word mask)
+static inline CHIP8_AVX2 __m256i widenMask(__m256i mask, int half){
+    return _mm256_cvtepi8_epi16(half == 0 ? _mm256_castsi256_si128(mask) : _mm256_extracti128_si256(mask, 1));
+}
+
+// Byte mask of the lanes where a >= b (unsigned)
+static inline CHIP8_AVX2 __m256i atLeast(__m256i a, __m256i b){
+    return _mm256_cmpeq_epi8(_mm256_max_epu8(a, b), a);
+}
+
+// Byte mask of the lanes holding down the key in the low nibble of their byte of keys
+static inline CHIP8_AVX2 __m256i keyHeld(const uint16_t* keyStates, __m256i keys){
+    const __m256i lowBits = _mm256_setr_epi8(1, 2, 4, 8, 16, 32, 64, -128, 0, 0, 0, 0, 0, 0, 0, 0,
+                                             1, 2, 4, 8, 16, 32, 64, -128, 0, 0, 0, 0, 0, 0, 0, 0);
+    const __m256i highBits = _mm256_setr_epi8(0, 0, 0, 0, 0, 0, 0, 0, 1, 2, 4, 8, 16, 32, 64, -128,
+                                              0, 0, 0, 0, 0, 0, 0, 0, 1, 2, 4, 8, 16, 32, 64, -128);
+    // Split each lane's keys into a byte of keys 0-7 and a byte of keys 8-F
+    __m256i states[2] = {_mm256_load_si256((const __m256i*) &keyStates[0]),
+                         _mm256_load_si256((const __m256i*) &keyStates[16])};
+    const __m256i lowByte = _mm256_set1_epi16(0xFF);
+    __m256i low = _mm256_permute4x64_epi64(_mm256_packus_epi16(_mm256_and_si256(states[0], lowByte),
+                                                               _mm256_and_si256(states[1], lowByte)), 0xD8);
+    __m256i high = _mm256_permute4x64_epi64(_mm256_packus_epi16(_mm256_srli_epi16(states[0], 8),
+                                                                _mm256_srli_epi16(states[1], 8)), 0xD8);
+    keys = _mm256_and_si256(keys, _mm256_set1_epi8(0xF));
+    __m256i held = _mm256_or_si256(_mm256_and_si256(low, _mm256_shuffle_epi8(lowBits, keys)),
+                                   _mm256_and_si256(high, _mm256_shuffle_epi8(highBits, keys)));
+    return _mm256_xor_si256(_mm256_cmpeq_epi8(held, _mm256_setzero_si256()), _mm256_set1_epi8(-1));
+}
+
+// Bit mask of the lanes (one per bit) from two word masks of 16 lanes each
+static inline CHIP8_AVX2 uint32_t laneBits(__m256i low, __m256i high){
+    return (uint32_t) _mm256_movemask_epi8(_mm256_permute4x64_epi64(_mm256_packs_epi16(low, high), 0xD8));
+}
+
+// The lowest of the 32 words in two vectors
+static inline CHIP8_AVX2 uint16_t lowestLane(__m256i low, __m256i high){
+    __m256i lowest = _mm256_min_epu16(low, high);
+    __m128i half = _mm_min_epu16(_mm256_castsi256_si128(lowest), _mm256_extracti128_si256(lowest, 1));
+    return (uint16_t) _mm_cvtsi128_si32(_mm_minpos_epu16(half));
+}
+
+/* Runs the instructions on every lane. Lanes are independent within a frame, so they needn't run in lockstep: each one
+ * has its own count of instructions left, and each step runs the lanes at the lowest program counter. Lanes that are
+ * ahead in the same code wait there for the rest to catch up, so lanes in a loop together run each instruction of it
+ * together, whatever the iteration they are on.
+ *
+ * A group of lanes at the same address fetches the instruction once if the page it is in matches lane 0's on all of
+ * them, and runs it on the vector path if it only touches registers. A lane alone at the lowest address runs on its own
+ * until it reaches another lane's address (or its instructions run out), without going back through the scheduling.
+ */
+CHIP8_AVX2
+void SimdEngine::runAvx2(int instructions){
+    const __m256i zero = _mm256_setzero_si256();
+    const __m256i allOnes = _mm256_set1_epi8(-1);
+    const __m256i two = _mm256_set1_epi16(2);
+    const __m256i one = _mm256_set1_epi16(1);
+    __m256i* pcLow = (__m256i*) &programCounter[0];
+    __m256i* pcHigh = (__m256i*) &programCounter[16];
+
+    // Counts are words, so a long frame is run in parts
+    for (int done = 0; done < instructions;){
+        int part = std::min(instructions - done, 0x7FFF);
+        done += part;
+        alignas(32) int16_t left[lanes];
+        std::fill(left, left + lanes, (int16_t) part);
+
+        for (;;){
+            __m256i activeLow = _mm256_cmpgt_epi16(_mm256_load_si256((const __m256i*) &left[0]), zero);
+            __m256i activeHigh = _mm256_cmpgt_epi16(_mm256_load_si256((const __m256i*) &left[16]), zero);
+            uint32_t active = laneBits(activeLow, activeHigh);
+            if (active == 0){
+                break;
+            }
+
+            // Lanes with nothing left are left out of the minimum by treating their address as 0xFFFF
+            __m256i pcs[2] = {_mm256_or_si256(_mm256_load_si256(pcLow), _mm256_andnot_si256(activeLow, allOnes)),
+                              _mm256_or_si256(_mm256_load_si256(pcHigh), _mm256_andnot_si256(activeHigh, allOnes))};
+            uint16_t pc = lowestLane(pcs[0], pcs[1]);
+            __m256i atPc[2] = {_mm256_and_si256(_mm256_cmpeq_epi16(pcs[0], _mm256_set1_epi16(pc)), activeLow),
+                               _mm256_and_si256(_mm256_cmpeq_epi16(pcs[1], _mm256_set1_epi16(pc)), activeHigh)};
+            uint32_t group = laneBits(atPc[0], atPc[1]);
+
+            if ((group & (group - 1)) == 0){
+                int lane = __builtin_ctz(group);
+                uint16_t others = group == active ? 0xFFFF
+                        : lowestLane(_mm256_or_si256(pcs[0], atPc[0]), _mm256_or_si256(pcs[1], atPc[1]));
+                do {
+                    uint16_t lanePc = programCounter[lane];
+                    uint16_t instruction = ((uint16_t) memory[lane][lanePc & 0xFFF] << 8) +
+                                           memory[lane][(lanePc + 1) & 0xFFF];
+                    programCounter[lane] = lanePc + 2;
+                    executeLane(lane, instruction);
+                    if (writes == lanes){
+                        checkSharedMemory();
+                    }
+                    --left[lane];
+                    if (waitingForKey(lane, instruction)){
+                        left[lane] = 0;
+                    }
+                } while (left[lane] > 0 && programCounter[lane] < others);
+            } else if (group == 0xFFFFFFFF && sharesCode(pc)){
+                // Every lane is at the same address in the same code: run them all together, without going back
+                // through the scheduling, for as long as that lasts
+                int16_t most = (int16_t) lowestLane(_mm256_load_si256((const __m256i*) &left[0]),
+                                                    _mm256_load_si256((const __m256i*) &left[16]));
+                int16_t ran = 0;
+                uint16_t instruction;
+                do {
+                    instruction = ((uint16_t) memory[0][pc & 0xFFF] << 8) + memory[0][(pc + 1) & 0xFFF];
+                    _mm256_store_si256(pcLow, _mm256_add_epi16(_mm256_load_si256(pcLow), two));
+                    _mm256_store_si256(pcHigh, _mm256_add_epi16(_mm256_load_si256(pcHigh), two));
+                    executeGroup(instruction, group);
+                    ++ran;
+                    if (writes > 0){
+                        checkSharedMemory();
+                    }
+                    pc = programCounter[0];
+                    __m256i samePc = _mm256_set1_epi16(pc);
+                    if (!_mm256_testc_si256(_mm256_and_si256(_mm256_cmpeq_epi16(_mm256_load_si256(pcLow), samePc),
+                                                             _mm256_cmpeq_epi16(_mm256_load_si256(pcHigh), samePc)),
+                                            allOnes)){
+                        break;
+                    }
+                } while (ran < most && (instruction & 0xF0FF) != 0xF00A && sharesCode(pc));
+                for (int half = 0; half < 2; ++half){
+                    __m256i* counts = (__m256i*) &left[half * 16];
+                    _mm256_store_si256(counts, _mm256_sub_epi16(_mm256_load_si256(counts), _mm256_set1_epi16(ran)));
+                }
+                skipKeyWaits(instruction, group, left);
+            } else {
+                // Every lane in the group moves past the instruction it fetched (some instructions then undo or
+                // override this), and has one fewer left
+                for (int half = 0; half < 2; ++half){
+                    __m256i* counts = (__m256i*) &left[half * 16];
+                    __m256i ran = _mm256_and_si256(atPc[half], one);
+                    _mm256_store_si256(counts, _mm256_sub_epi16(_mm256_load_si256(counts), ran));
+                }
+                uint32_t sharers = sharedPages[pc >> 6] & sharedPages[((pc + 1) & 0xFFF) >> 6];
+                if ((group & ~sharers) == 0){
+                    uint16_t instruction = ((uint16_t) memory[0][pc & 0xFFF] << 8) + memory[0][(pc + 1) & 0xFFF];
+                    __m256i* pcHalves[2] = {pcLow, pcHigh};
+                    for (int half = 0; half < 2; ++half){
+                        __m256i step = _mm256_and_si256(atPc[half], two);
+                        _mm256_store_si256(pcHalves[half], _mm256_add_epi16(_mm256_load_si256(pcHalves[half]), step));
+                    }
+                    executeGroup(instruction, group);
+                    skipKeyWaits(instruction, group, left);
+                } else {
+                    // The code differs between some of them: fetch it for each, and run each instruction on the lanes
+                    // that fetched it
+                    alignas(32) uint16_t fetched[lanes] = {};
+                    for (uint32_t lanesLeft = group; lanesLeft != 0; lanesLeft &= lanesLeft - 1){
+                        int lane = __builtin_ctz(lanesLeft);
+                        fetched[lane] = ((uint16_t) memory[lane][pc & 0xFFF] << 8) + memory[lane][(pc + 1) & 0xFFF];
+                        programCounter[lane] = pc + 2;
+                    }
+                    for (uint32_t pending = group; pending != 0;){
+                        uint16_t instruction = fetched[__builtin_ctz(pending)];
+                        __m256i wanted = _mm256_set1_epi16(instruction);
+                        __m256i low = _mm256_load_si256((const __m256i*) &fetched[0]);
+                        __m256i high = _mm256_load_si256((const __m256i*) &fetched[16]);
+                        uint32_t same = laneBits(_mm256_cmpeq_epi16(low, wanted), _mm256_cmpeq_epi16(high, wanted));
+                        same &= pending;
+                        pending &= ~same;
+                        executeGroup(instruction, same);
+                        skipKeyWaits(instruction, same, left);
+                    }
+                }
+            }
+            if (writes > 0){
+                checkSharedMemory();
+            }
+        }
+    }
+}
+
+// Whether every lane's memory matches lane 0's at the instruction at address
+bool SimdEngine::sharesCode(uint16_t address) const {
+    return (sharedPages[address >> 6] & sharedPages[((address + 1) & 0xFFF) >> 6]) == 0xFFFFFFFF;
+}
+
+/* Whether the lane has just run FX0A and is still waiting. Keys only change between frames, so it would run the same
+ * FX0A for the rest of this one without anything changing; like Emulator's idle skipping, the frame ends for it there.
+ */
+bool SimdEngine::waitingForKey(int lane, uint16_t instruction) const {
+    return (instruction & 0xF0FF) == 0xF00A && awaitingKey[lane] && keyPressed[lane] == 0xFF;
+}
+
+void SimdEngine::skipKeyWaits(uint16_t instruction, uint32_t group, int16_t* left) const {
+    if ((instruction & 0xF0FF) != 0xF00A){
+        return;
+    }
+    for (uint32_t lanesLeft = group; lanesLeft != 0; lanesLeft &= lanesLeft - 1){
+        int lane = __builtin_ctz(lanesLeft);
+        if (waitingForKey(lane, instruction)){
+            left[lane] = 0;
+        }
+    }
+}
+
+/* Executes the instruction on the group of lanes, together on the vector path if it can be, and lane by lane if not.
+ */
+CHIP8_AVX2
+void SimdEngine::executeGroup(uint16_t instruction, uint32_t group){
+    if ((group & (group - 1)) != 0 && executeVector(instruction, group)){
+        vectorInstructions += __builtin_popcount(group);
+        return;
+    }
+    for (uint32_t lanesLeft = group; lanesLeft != 0; lanesLeft &= lanesLeft - 1){
+        executeLane(__builtin_ctz(lanesLeft), instruction);
+    }
+}
+
+/* Executes the instruction on the group of lanes (a bit per lane) with vector operations.
+ * Returns false, without doing anything, if the instruction isn't one the vector path handles.
+ *
+ * Registers are loaded and stored in the same order as the Emulator handlers read and write them, so the results match
+ * when VF is also one of the operands. Lanes outside the group keep their old values through blends.
+ */
+CHIP8_AVX2
+bool SimdEngine::executeVector(uint16_t instruction, uint32_t group){
+    uint8_t x = (instruction >> 8) & 0xF;
+    uint8_t y = (instruction >> 4) & 0xF;
+    uint8_t nn = instruction & 0xFF;
+    uint16_t nnn = instruction & 0xFFF;
+
+    // Expand the group to a byte mask (one byte per lane) and two word masks (16 lanes each)
+    const __m256i bitSelect = _mm256_setr_epi8(1, 2, 4, 8, 16, 32, 64, -128, 1, 2, 4, 8, 16, 32, 64, -128,
+                                               1, 2, 4, 8, 16, 32, 64, -128, 1, 2, 4, 8, 16, 32, 64, -128);
+    const __m256i byteSpread = _mm256_setr_epi8(0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 1, 1, 1, 1,
+                                                2, 2, 2, 2, 2, 2, 2, 2, 3, 3, 3, 3, 3, 3, 3, 3);
+    __m256i spread = _mm256_shuffle_epi8(_mm256_set1_epi32((int) group), byteSpread);
+    __m256i mask = _mm256_cmpeq_epi8(_mm256_and_si256(spread, bitSelect), bitSelect);
+    const __m256i one = _mm256_set1_epi8(1);
+    const __m256i allOnes = _mm256_set1_epi8(-1);
+
+    __m256i skip = _mm256_setzero_si256();     // Lanes whose program counter skips the next instruction
+    switch (Emulator::opTable()[instruction]){
+    case Emulator::Op::Jump:
+        for (int half = 0; half < 2; ++half){
+            storeLanes16(&programCounter[half * 16], _mm256_set1_epi16(nnn), widenMask(mask, half));
+        }
+        break;
+    case Emulator::Op::SkipRegEqVal:
+        skip = _mm256_cmpeq_epi8(loadLanes(vRegs[x]), _mm256_set1_epi8(nn));
+        break;
+    case Emulator::Op::SkipRegNeqVal:
+        skip = _mm256_xor_si256(_mm256_cmpeq_epi8(loadLanes(vRegs[x]), _mm256_set1_epi8(nn)), allOnes);
+        break;
+    case Emulator::Op::SkipRegEqReg:
+        skip = _mm256_cmpeq_epi8(loadLanes(vRegs[x]), loadLanes(vRegs[y]));
+        break;
+    case Emulator::Op::SkipRegNeqReg:
+        skip = _mm256_xor_si256(_mm256_cmpeq_epi8(loadLanes(vRegs[x]), loadLanes(vRegs[y])), allOnes);
+        break;
+    case Emulator::Op::SetRegToVal:
+        storeLanes(vRegs[x], _mm256_set1_epi8(nn), mask);
+        break;
+    case Emulator::Op::AddValToReg:
+        storeLanes(vRegs[x], _mm256_add_epi8(loadLanes(vRegs[x]), _mm256_set1_epi8(nn)), mask);
+        break;
+    case Emulator::Op::SetRegToReg:
+        storeLanes(vRegs[x], loadLanes(vRegs[y]), mask);
+        break;
+    case Emulator::Op::OrRegToReg:
+        storeLanes(vRegs[x], _mm256_or_si256(loadLanes(vRegs[x]), loadLanes(vRegs[y])), mask);
+        break;
+    case Emulator::Op::AndRegToReg:
+        storeLanes(vRegs[x], _mm256_and_si256(loadLanes(vRegs[x]), loadLanes(vRegs[y])), mask);
+        break;
+    case Emulator::Op::XorRegToReg:
+        storeLanes(vRegs[x], _mm256_xor_si256(loadLanes(vRegs[x]), loadLanes(vRegs[y])), mask);
+        break;
+    case Emulator::Op::AddRegToReg:
+        // The carry is set if the sum (read back, in case X is Y) is below VY
+        storeLanes(vRegs[x], _mm256_add_epi8(loadLanes(vRegs[x]), loadLanes(vRegs[y])), mask);
+        storeLanes(vRegs[0xF], _mm256_andnot_si256(atLeast(loadLanes(vRegs[x]), loadLanes(vRegs[y])), one), mask);
+        break;
+    case Emulator::Op::SubSRegFromDReg:
+        storeLanes(vRegs[0xF], _mm256_and_si256(atLeast(loadLanes(vRegs[x]), loadLanes(vRegs[y])), one), mask);
+        storeLanes(vRegs[x], _mm256_sub_epi8(loadLanes(vRegs[x]), loadLanes(vRegs[y])), mask);
+        break;
+    case Emulator::Op::SubDRegFromSReg:
+        storeLanes(vRegs[0xF], _mm256_and_si256(atLeast(loadLanes(vRegs[y]), loadLanes(vRegs[x])), one), mask);
+        storeLanes(vRegs[x], _mm256_sub_epi8(loadLanes(vRegs[y]), loadLanes(vRegs[x])), mask);
+        break;
+    case Emulator::Op::RightShift:
+        // There is no byte shift, so shift words and drop the bit that crossed in from the neighbouring byte
+        storeLanes(vRegs[0xF], _mm256_and_si256(loadLanes(vRegs[x]), one), mask);
+        storeLanes(vRegs[x], _mm256_and_si256(_mm256_srli_epi16(loadLanes(vRegs[x]), 1), _mm256_set1_epi8(0x7F)), mask);
+        break;
+    case Emulator::Op::LeftShift:
+        storeLanes(vRegs[0xF], _mm256_and_si256(_mm256_srli_epi16(loadLanes(vRegs[x]), 7), one), mask);
+        storeLanes(vRegs[x], _mm256_add_epi8(loadLanes(vRegs[x]), loadLanes(vRegs[x])), mask);
+        break;
+    case Emulator::Op::SetIndex:
+        for (int half = 0; half < 2; ++half){
+            storeLanes16(&indexRegister[half * 16], _mm256_set1_epi16(nnn), widenMask(mask, half));
+        }
+        break;
+    case Emulator::Op::JumpWithOffset:
+        for (int half = 0; half < 2; ++half){
+            __m256i target = _mm256_add_epi16(_mm256_set1_epi16(nnn), widenLanes(loadLanes(vRegs[0]), half));
+            storeLanes16(&programCounter[half * 16], target, widenMask(mask, half));
+        }
+        break;
+    case Emulator::Op::SkipIfKey:
+        skip = keyHeld(keyStates, loadLanes(vRegs[x]));
+        break;
+    case Emulator::Op::SkipIfNotKey:
+        skip = _mm256_xor_si256(keyHeld(keyStates, loadLanes(vRegs[x])), allOnes);
+        break;
+    case Emulator::Op::SetRegFromDTimer:
+        storeLanes(vRegs[x], loadLanes(delayTimer), mask);
+        break;
+    case Emulator::Op::SetDTimerFromReg:
+        storeLanes(delayTimer, loadLanes(vRegs[x]), mask);
+        break;
+    case Emulator::Op::SetSTimerFromReg:
+        storeLanes(soundTimer, loadLanes(vRegs[x]), mask);
+        break;
+    case Emulator::Op::AddToIndex: {
+        // VF is only written by lanes whose index register passes the end of memory
+        __m256i overflow[2];
+        for (int half = 0; half < 2; ++half){
+            __m256i index = _mm256_add_epi16(_mm256_load_si256((const __m256i*) &indexRegister[half * 16]),
+                                             widenLanes(loadLanes(vRegs[x]), half));
+            storeLanes16(&indexRegister[half * 16], index, widenMask(mask, half));
+            overflow[half] = _mm256_cmpeq_epi16(_mm256_max_epu16(index, _mm256_set1_epi16(0x1000)), index);
+        }
+        __m256i overflowBytes = _mm256_permute4x64_epi64(_mm256_packs_epi16(overflow[0], overflow[1]), 0xD8);
+        storeLanes(vRegs[0xF], one, _mm256_and_si256(mask, overflowBytes));
+        break;
+    }
+    case Emulator::Op::FontChar:
+        for (int half = 0; half < 2; ++half){
+            __m256i digit = _mm256_and_si256(widenLanes(loadLanes(vRegs[x]), half), _mm256_set1_epi16(0xF));
+            __m256i address = _mm256_add_epi16(_mm256_set1_epi16(fontStart),
+                                               _mm256_mullo_epi16(digit, _mm256_set1_epi16(5)));
+            storeLanes16(&indexRegister[half * 16], address, widenMask(mask, half));
+        }
+        break;
+    case Emulator::Op::Nop:
+        break;
+    default:
+        return false;
+    }
+
+    // Skipping lanes move two bytes further
+    skip = _mm256_and_si256(skip, mask);
+    for (int half = 0; half < 2; ++half){
+        __m256i* pc = (__m256i*) &programCounter[half * 16];
+        __m256i step = _mm256_and_si256(widenMask(skip, half), _mm256_set1_epi16(2));
+        _mm256_store_si256(pc, _mm256_add_epi16(_mm256_load_si256(pc), step));
+    }
+    return true;
+}
+
+#else
+
+void SimdEngine::runAvx2(int instructions){
+    for (int i = 0; i < instructions; ++i){
+        stepScalar();
+    }
+}
+
+void SimdEngine::executeGroup(uint16_t instruction, uint32_t group){
+}
+
+bool SimdEngine::executeVector(uint16_t instruction, uint32_t group){
+    return false;
+}
+
+#endif
+
+/* Executes an instruction on one lane (whose program counter has already moved past it).
+ * Follows the Emulator handlers for each operation exactly. The only difference is that addresses past the end of
+ * memory wrap around, since a lane must never write into its neighbour's memory.
+ */
+void SimdEngine::executeLane(int lane, uint16_t instruction){
+    uint8_t x = (instruction >> 8) & 0xF;
+    uint8_t y = (instruction >> 4) & 0xF;
+    uint8_t n = instruction & 0xF;
+    uint8_t nn = instruction & 0xFF;
+    uint16_t nnn = instruction & 0xFFF;
+    uint8_t vx = vRegs[x][lane];
+    uint8_t vy = vRegs[y][lane];
+    uint8_t* vf = &vRegs[0xF][lane];
+    uint8_t* dst = &vRegs[x][lane];
+    uint16_t &pc = programCounter[lane];
+    uint16_t &index = indexRegister[lane];
+    uint8_t* mem = memory[lane];
+
+    switch (Emulator::opTable()[instruction]){
+    case Emulator::Op::ClearScreen:
+        std::fill(framebuffer[lane], framebuffer[lane] + 32, 0);
+        break;
+    case Emulator::Op::Ret:
+        if (stackDepth[lane] > 0){
+            pc = addressStack[lane][--stackDepth[lane]];
+        } else {
+            printf("Ret (00EE) called with empty address stack! Program Counter: %d\n", pc);
+        }
+        break;
+    case Emulator::Op::Jump:
+        pc = nnn;
+        break;
+    case Emulator::Op::Call:
+        if (stackDepth[lane] < 16){
+            addressStack[lane][stackDepth[lane]++] = pc;
+        } else {
+            printf("Call (2NNN) overflowed the address stack! Program Counter: %d\n", pc);
+        }
+        pc = nnn;
+        break;
+    case Emulator::Op::SkipRegEqVal:
+        if (vx == nn){
+            pc += 2;
+        }
+        break;
+    case Emulator::Op::SkipRegNeqVal:
+        if (vx != nn){
+            pc += 2;
+        }
+        break;
+    case Emulator::Op::SkipRegEqReg:
+        if (vx == vy){
+            pc += 2;
+        }
+        break;
+    case Emulator::Op::SkipRegNeqReg:
+        if (vx != vy){
+            pc += 2;
+        }
+        break;
+    case Emulator::Op::SetRegToVal:
+        *dst = nn;
+        break;
+    case Emulator::Op::AddValToReg:
+        *dst += nn;
+        break;
+    case Emulator::Op::SetRegToReg:
+        *dst = vy;
+        break;
+    case Emulator::Op::OrRegToReg:
+        *dst |= vy;
+        break;
+    case Emulator::Op::AndRegToReg:
+        *dst &= vy;
+        break;
+    case Emulator::Op::XorRegToReg:
+        *dst ^= vy;
+        break;
+    case Emulator::Op::AddRegToReg:
+        *dst += vy;
+        *vf = *dst < vRegs[y][lane] ? 1 : 0;
+        break;
+    case Emulator::Op::SubSRegFromDReg:
+        *vf = vx >= vy ? 1 : 0;
+        *dst = vRegs[x][lane] - vRegs[y][lane];
+        break;
+    case Emulator::Op::SubDRegFromSReg:
+        *vf = vy >= vx ? 1 : 0;
+        *dst = vRegs[y][lane] - vRegs[x][lane];
+        break;
+    case Emulator::Op::RightShift:
+        *vf = vx & 1;
+        *dst >>= 1;
+        break;
+    case Emulator::Op::LeftShift:
+        *vf = (vx & 0x80) >> 7;
+        *dst <<= 1;
+        break;
+    case Emulator::Op::SetIndex:
+        index = nnn;
+        break;
+    case Emulator::Op::JumpWithOffset:
+        pc = nnn + vRegs[0][lane];
+        break;
+    case Emulator::Op::Random:
+        *dst = nextRandomByte(rngState[lane]) & nn;
+        break;
+    case Emulator::Op::Display: {
+        uint8_t px = vx % 64;
+        uint8_t py = vy % 32;
+        uint64_t collisions = 0;
+        for (uint8_t yOff = 0; (py + yOff) < 32 && yOff < n; ++yOff){
+            uint64_t spriteRow = ((uint64_t) mem[(index + yOff) & 0xFFF] << 56) >> px;
+            collisions |= framebuffer[lane][py + yOff] & spriteRow;
+            framebuffer[lane][py + yOff] ^= spriteRow;
+        }
+        *vf = collisions != 0;
+        break;
+    }
+    case Emulator::Op::SkipIfKey:
+        if (keyStates[lane] & (1 << (vx & 0xF))){
+            pc += 2;
+        }
+        break;
+    case Emulator::Op::SkipIfNotKey:
+        if (!(keyStates[lane] & (1 << (vx & 0xF)))){
+            pc += 2;
+        }
+        break;
+    case Emulator::Op::SetRegFromDTimer:
+        *dst = delayTimer[lane];
+        break;
+    case Emulator::Op::GetKey:
+        if (awaitingKey[lane] && keyPressed[lane] != 0xFF){
+            *dst = keyPressed[lane];
+            awaitingKey[lane] = false;
+            keyPressed[lane] = 0xFF;
+            pc += 2;
+        } else if (!awaitingKey[lane]){
+            awaitingKey[lane] = true;
+        }
+        pc -= 2;
+        break;
+    case Emulator::Op::SetDTimerFromReg:
+        delayTimer[lane] = vx;
+        break;
+    case Emulator::Op::SetSTimerFromReg:
+        soundTimer[lane] = vx;
+        break;
+    case Emulator::Op::AddToIndex:
+        index += vx;
+        if (index >= 0x1000){
+            *vf = 1;
+        }
+        break;
+    case Emulator::Op::FontChar:
+        index = fontStart + 5 * (vx & 0xF);
+        break;
+    case Emulator::Op::DecimalConversion:
+        mem[index & 0xFFF]       = (vx / 100) % 10;
+        mem[(index + 1) & 0xFFF] = (vx /  10) % 10;
+        mem[(index + 2) & 0xFFF] = (vx /   1) % 10;
+        recordWrite(index, 3);
+        break;
+    case Emulator::Op::StoreRegToMem:
+        for (uint8_t i = 0; i <= x && index + i < 0x1000; ++i){
+            mem[index + i] = vRegs[i][lane];
+        }
+        recordWrite(index, x + 1);
+        break;
+    case Emulator::Op::LoadRegFromMem:
+        for (uint8_t i = 0; i <= x && index + i < 0x1000; ++i){
+            vRegs[i][lane] = mem[index + i];
+        }
+        break;
+    default:
+        break;
+    }
+}
+
+/* Decrements every lane's delay and sound timers that are above 0.
+ */
+void SimdEngine::tickTimers(){
+    for (int lane = 0; lane < lanes; ++lane){
+        delayTimer[lane] -= delayTimer[lane] > 0;
+        soundTimer[lane] -= soundTimer[lane] > 0;
+    }
+}
+
+/* Returns the same framebuffer hash as Emulator::framebufferHash for one lane.
+ */
+uint64_t SimdEngine::framebufferHash(int lane) const {
+    uint64_t hash = 0xCBF29CE484222325ULL;
+    for (int row = 0; row < 32; ++row){
+        for (int byte = 7; byte >= 0; --byte){
+            hash ^= (framebuffer[lane][row] >> (byte * 8)) & 0xFF;
+            hash *= 0x100000001B3ULL;
+        }
+    }
+    return hash;
+}
+
+uint16_t SimdEngine::getProgramCounter(int lane) const {
+    return programCounter[lane];
+}
+
+uint16_t SimdEngine::getIndexRegister(int lane) const {
+    return indexRegister[lane];
+}
+
+uint8_t SimdEngine::getRegister(int lane, uint8_t reg) const {
+    return vRegs[reg & 0xF][lane];
+}
+
+uint64_t SimdEngine::getInstExecuted() const {
+    return instExecuted;
+}
+
+uint64_t SimdEngine::getVectorInstructions() const {
+    return vectorInstructions;
+}
@@ -0,0 +1,105 @@
+#pragma once
+
+#include <cstdint>
+
+#include "machine_state.h"
+#include "rom_image.h"
+
+/* Runs a group of CHIP-8 machines in lockstep, for brute-force input searches and fuzzing.
+ *
+ * The machines (lanes) are held in structure-of-arrays form: each V register, the index register, the program counter
+ * and the timers are arrays with one entry per lane, so the same register of every lane fits in a single AVX2 vector.
+ * Within a frame the lanes at the lowest program counter run first, so lanes in the same code gather at the same
+ * address, and lanes at the same address that fetched the same instruction execute it together with vector operations
+ * when it only touches registers. Everything else (and every lane on hosts without AVX2, which step in lockstep) runs
+ * one lane at a time through the same semantics as the Emulator handlers, so each lane behaves exactly like an Emulator
+ * running the same program with the same seed and keys.
+ *
+ * executeLane and executeVector are a second implementation of every instruction, kept in step with the Emulator's by
+ * hand: any change to the handlers decode() calls must be mirrored there. chip8_fuzz compares the two.
+ */
+class SimdEngine {
+    public:
+        static const int lanes = 32;
+
+        SimdEngine();
+
+        // Loads the program into every lane
+        void loadProgram(const RomImage &rom);
+
+        // Replaces or copies out one lane's whole state, in the Emulator's layout (for starting lanes from arbitrary
+        // states, and comparing them with emulators)
+        void loadState(int lane, const MachineState &state);
+        void saveState(int lane, MachineState &out) const;
+
+        // Per-lane inputs: the CXNN seed and the keypad
+        void setSeed(int lane, uint32_t seed);
+        void setKey(int lane, uint8_t key, bool pressed);
+
+        // Instructions executed per emulated second, as Emulator::setInstPerSecond
+        void setInstPerSecond(int rate);
+
+        // Runs one emulated 60 Hz frame on every lane: a batch of instructions followed by a timer tick
+        void runFrame();
+
+        // Whether the vector path is used (it needs AVX2)
+        bool vectorized() const;
+
+        // Per-lane state, for reporting results
+        uint64_t framebufferHash(int lane) const;
+        uint16_t getProgramCounter(int lane) const;
+        uint16_t getIndexRegister(int lane) const;
+        uint8_t getRegister(int lane, uint8_t reg) const;
+
+        // Instructions executed by each lane, and how many lane-instructions ran on the vector path
+        uint64_t getInstExecuted() const;
+        uint64_t getVectorInstructions() const;
+
+    private:
+        // Registers, one array entry per lane (aligned so a register of every lane loads as one vector)
+        alignas(32) uint8_t vRegs [16][lanes] = {};
+        alignas(32) uint16_t programCounter [lanes];
+        alignas(32) uint16_t indexRegister [lanes] = {};
+        alignas(32) uint8_t delayTimer [lanes] = {};
+        alignas(32) uint8_t soundTimer [lanes] = {};
+
+        // Memory, display and stack, one per lane
+        uint8_t memory [lanes][4096 + 64] = {};   // Padded so the same address in every lane maps to different cache sets
+        uint64_t framebuffer [lanes][32] = {};
+        uint16_t addressStack [lanes][16];
+        uint8_t stackDepth [lanes] = {};
+        uint16_t fontStart = fontAddress;
+
+        // For each 64-byte page of memory, the lanes whose page is known to match lane 0's, so that lanes at the same
+        // address there only need the instruction fetching once. Memory written is compared against lane 0 after each
+        // step, or once as many writes as there are lanes have built up.
+        uint32_t sharedPages [64];
+        uint16_t writeStart [lanes];
+        uint16_t writeLength [lanes];
+        int writes = 0;
+        void recordWrite(uint16_t start, uint16_t length);
+        void checkSharedMemory();
+
+        // Keys and randomness, one per lane
+        alignas(32) uint16_t keyStates [lanes] = {};    // Bit k is set while key k is pressed
+        bool awaitingKey [lanes] = {};
+        uint8_t keyPressed [lanes];
+        uint32_t rngState [lanes];      // As MachineState::rngState
+
+        // Scheduling
+        int instPerSecond = 700;
+        int instRemainder = 0;
+        uint64_t instExecuted = 0;
+        uint64_t vectorInstructions = 0;
+        bool useAvx2 = false;
+
+        void stepScalar();
+        void runAvx2(int instructions);
+        void executeGroup(uint16_t instruction, uint32_t group);
+        bool sharesCode(uint16_t address) const;
+        bool waitingForKey(int lane, uint16_t instruction) const;
+        void skipKeyWaits(uint16_t instruction, uint32_t group, int16_t* left) const;
+        bool executeVector(uint16_t instruction, uint32_t group);
+        void executeLane(int lane, uint16_t instruction);      // Mirrors Emulator::decode() and its handlers
+        void tickTimers();
+};
@@ -0,0 +1,54 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <memory>
+
+/* Wait-free queue from one producer thread to one consumer thread, holding up to a fixed number of values.
+ *
+ * Each side owns one counter (the producer the number of values pushed, the consumer the number popped) and only reads
+ * the other's, so pushing and popping never loop, lock or wait: they move as many values as fit (or are there) and
+ * report how many that was. The counters only ever grow, and a value's slot is its count modulo the capacity.
+ */
+template<class T>
+class SpscRing {
+    private:
+        std::unique_ptr<T[]> slots;
+        size_t capacity;
+
+        alignas(64) std::atomic<size_t> pushed{0};     // Written by the producer only...
+        alignas(64) std::atomic<size_t> popped{0};     // ...and this by the consumer only
+
+    public:
+        explicit SpscRing(size_t capacity) : slots(new T[capacity]), capacity(capacity) {
+        }
+
+        // Producer: appends up to count values, and returns how many there was room for
+        size_t push(const T* values, size_t count) {
+            size_t head = pushed.load(std::memory_order_relaxed);
+            size_t room = capacity - (head - popped.load(std::memory_order_acquire));
+            count = count < room ? count : room;
+            for (size_t i = 0; i < count; ++i){
+                slots[(head + i) % capacity] = values[i];
+            }
+            pushed.store(head + count, std::memory_order_release);
+            return count;
+        }
+
+        // Consumer: takes up to count values, oldest first, and returns how many there were
+        size_t pop(T* values, size_t count) {
+            size_t tail = popped.load(std::memory_order_relaxed);
+            size_t available = pushed.load(std::memory_order_acquire) - tail;
+            count = count < available ? count : available;
+            for (size_t i = 0; i < count; ++i){
+                values[i] = slots[(tail + i) % capacity];
+            }
+            popped.store(tail + count, std::memory_order_release);
+            return count;
+        }
+
+        // Values waiting, as seen from either side (it can only be out of date in that side's favour)
+        size_t size() const {
+            return pushed.load(std::memory_order_acquire) - popped.load(std::memory_order_acquire);
+        }
+};
@@ -0,0 +1,44 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+
+/* Lock-free handoff of the newest value from one producer thread to one consumer thread.
+ *
+ * There are three slots: the producer writes into one, the consumer reads from another, and the third holds the most
+ * recently published value. Publishing and consuming each swap a slot with the middle one in a single atomic exchange,
+ * so neither side ever waits for the other. Values the consumer doesn't get to before the next one is published are
+ * simply replaced (for frames, the display only ever needs the newest).
+ */
+template<class T>
+class TripleBuffer {
+    private:
+        // Middle slot index, with freshBit set while it holds a value the consumer hasn't taken
+        static const uint8_t freshBit = 4;
+        alignas(64) std::atomic<uint8_t> middle{1};
+
+        alignas(64) uint8_t back = 0;   // Producer's slot
+        alignas(64) uint8_t front = 2;  // Consumer's slot
+        T slots [3];
+
+    public:
+        // Producer: the slot to fill in, then publish it as the newest value
+        T &writeSlot() {
+            return slots[back];
+        }
+        void publish() {
+            back = middle.exchange(back | freshBit, std::memory_order_acq_rel) & 3;
+        }
+
+        // Consumer: takes the newest published value into readSlot. Returns false if nothing new has been published.
+        bool consume() {
+            if ((middle.load(std::memory_order_relaxed) & freshBit) == 0){
+                return false;
+            }
+            front = middle.exchange(front, std::memory_order_acq_rel) & 3;
+            return true;
+        }
+        const T &readSlot() const {
+            return slots[front];
+        }
+};
@@ -0,0 +1,70 @@
+#include "wav_writer.h"
+
+// WAV is little-endian whatever the host is
+static void writeLittleEndian(FILE* file, uint32_t value, int bytes) {
+    for (int i = 0; i < bytes; ++i){
+        fputc((value >> (8 * i)) & 0xFF, file);
+    }
+}
+
+WavWriter::~WavWriter() {
+    close();
+}
+
+bool WavWriter::open(const char* path, int sampleRate) {
+    close();
+    file = fopen(path, "wb");
+    if (file == NULL){
+        printf("Error opening %s for writing\n", path);
+        return false;
+    }
+    samplesWritten = 0;
+    writeHeader(sampleRate);
+    return true;
+}
+
+/* Writes the 44-byte RIFF header for mono 16-bit PCM. The two sizes in it are written as zero, and patched by close.
+ */
+void WavWriter::writeHeader(int sampleRate) {
+    fwrite("RIFF", 1, 4, file);
+    writeLittleEndian(file, 0, 4);              // Size of everything after this field
+    fwrite("WAVEfmt ", 1, 8, file);
+    writeLittleEndian(file, 16, 4);             // Format chunk size
+    writeLittleEndian(file, 1, 2);              // PCM
+    writeLittleEndian(file, 1, 2);              // Channels
+    writeLittleEndian(file, sampleRate, 4);
+    writeLittleEndian(file, sampleRate * 2, 4); // Bytes per second
+    writeLittleEndian(file, 2, 2);              // Bytes per sample
+    writeLittleEndian(file, 16, 2);             // Bits per sample
+    fwrite("data", 1, 4, file);
+    writeLittleEndian(file, 0, 4);              // Size of the samples
+}
+
+void WavWriter::write(const int16_t* samples, size_t count) {
+    if (file == NULL){
+        return;
+    }
+    for (size_t i = 0; i < count; ++i){
+        writeLittleEndian(file, (uint16_t) samples[i], 2);
+    }
+    samplesWritten += count;
+}
+
+bool WavWriter::close() {
+    if (file == NULL){
+        return true;
+    }
+    uint32_t dataBytes = samplesWritten * 2;
+    fseek(file, 4, SEEK_SET);
+    writeLittleEndian(file, 36 + dataBytes, 4);
+    fseek(file, 40, SEEK_SET);
+    writeLittleEndian(file, dataBytes, 4);
+    bool ok = !ferror(file);
+    ok = fclose(file) == 0 && ok;
+    file = NULL;
+    return ok;
+}
+
+uint32_t WavWriter::getSamplesWritten() const {
+    return samplesWritten;
+}
@@ -0,0 +1,27 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <stdio.h>
+
+/* Writes mono 16-bit PCM samples to a WAV file as they come. The header's sizes are filled in when the file is closed.
+ */
+class WavWriter {
+    private:
+        FILE* file = NULL;
+        uint32_t samplesWritten = 0;
+        void writeHeader(int sampleRate);
+
+    public:
+        ~WavWriter();
+
+        // Creates the file (replacing any existing one). Returns false (after describing the problem) if it can't.
+        bool open(const char* path, int sampleRate);
+
+        void write(const int16_t* samples, size_t count);
+
+        // Finishes the header and closes the file. Returns false if anything couldn't be written.
+        bool close();
+
+        uint32_t getSamplesWritten() const;
+};